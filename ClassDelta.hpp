@@ -0,0 +1,149 @@
+/*
+ * Binary deltas between versions of a class file, for the redefined
+ * classes of the store: most redefinitions (hot swap, retransforming
+ * agents) change a few methods, so a version is kept as the byte
+ * ranges it shares with the previous one plus the bytes that differ.
+ *
+ * Format: the magic "BCCDLT01", the hex hash of the base version (32
+ * bytes), the base size and the target size (LEB128 varints), then
+ * operations until the target is complete. An operation starts with
+ * a varint (length << 1 | copy): a copy is followed by the varint
+ * offset of the range in the base; an add by the length bytes.
+ */
+
+#ifndef CLASS_DELTA_HPP
+#define CLASS_DELTA_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define CLASS_DELTA_MAGIC "BCCDLT01"
+/** Shortest range looked up in the base. */
+#define DELTA_BLOCK 16
+
+inline void delta_put_varint(std::vector<unsigned char>* out, uint64_t v) {
+  while (v >= 0x80) {
+    out->push_back((unsigned char)(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back((unsigned char)v);
+}
+
+inline bool delta_get_varint(const unsigned char* data, size_t size, size_t* pos, uint64_t* v) {
+  *v = 0;
+  for (int shift = 0; shift < 64 && *pos < size; shift += 7) {
+    unsigned char b = data[(*pos)++];
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+inline uint64_t delta_block_hash(const unsigned char* p) {
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = 0; i < DELTA_BLOCK; i++)
+    h = (h ^ p[i]) * 1099511628211ULL;
+  return h;
+}
+
+/** Encodes target as a delta against base, whose hash is base_hex. */
+inline void encode_delta(const unsigned char* base, size_t base_size,
+                         const unsigned char* target, size_t target_size,
+                         const std::string& base_hex, std::vector<unsigned char>* out) {
+  out->clear();
+  out->insert(out->end(), CLASS_DELTA_MAGIC, CLASS_DELTA_MAGIC + 8);
+  out->insert(out->end(), base_hex.begin(), base_hex.end());
+  delta_put_varint(out, base_size);
+  delta_put_varint(out, target_size);
+
+  // The aligned blocks of the base, by hash (first occurrence).
+  std::unordered_map<uint64_t, size_t> blocks;
+  for (size_t off = 0; off + DELTA_BLOCK <= base_size; off += DELTA_BLOCK)
+    blocks.insert(std::make_pair(delta_block_hash(base + off), off));
+
+  size_t add_start = 0;
+  size_t pos = 0;
+  while (pos < target_size) {
+    size_t copy_off = 0, copy_len = 0;
+    if (pos + DELTA_BLOCK <= target_size) {
+      auto it = blocks.find(delta_block_hash(target + pos));
+      if (it != blocks.end() && memcmp(base + it->second, target + pos, DELTA_BLOCK) == 0) {
+        copy_off = it->second;
+        copy_len = DELTA_BLOCK;
+        while (copy_off + copy_len < base_size && pos + copy_len < target_size &&
+               base[copy_off + copy_len] == target[pos + copy_len])
+          copy_len++;
+        // Also take back what matches of the pending add.
+        while (copy_off > 0 && pos > add_start && base[copy_off - 1] == target[pos - 1]) {
+          copy_off--;
+          pos--;
+          copy_len++;
+        }
+      }
+    }
+    if (copy_len == 0) {
+      pos++;
+      continue;
+    }
+    if (pos > add_start) {
+      delta_put_varint(out, (uint64_t)(pos - add_start) << 1);
+      out->insert(out->end(), target + add_start, target + pos);
+    }
+    delta_put_varint(out, ((uint64_t)copy_len << 1) | 1);
+    delta_put_varint(out, copy_off);
+    pos += copy_len;
+    add_start = pos;
+  }
+  if (target_size > add_start) {
+    delta_put_varint(out, (uint64_t)(target_size - add_start) << 1);
+    out->insert(out->end(), target + add_start, target + target_size);
+  }
+}
+
+/** The hash of the base of a delta, or "" if it is not a delta. */
+inline std::string delta_base_hex(const unsigned char* delta, size_t delta_size) {
+  if (delta_size < 40 || memcmp(delta, CLASS_DELTA_MAGIC, 8) != 0)
+    return std::string();
+  return std::string((const char*)delta + 8, 32);
+}
+
+/** Rebuilds a version from its base and its delta. Returns false if
+    the delta is malformed or does not match the base. */
+inline bool apply_delta(const unsigned char* base, size_t base_size,
+                        const unsigned char* delta, size_t delta_size,
+                        std::vector<unsigned char>* out) {
+  if (delta_base_hex(delta, delta_size).empty())
+    return false;
+  size_t pos = 40;
+  uint64_t expected_base_size, target_size;
+  if (!delta_get_varint(delta, delta_size, &pos, &expected_base_size) ||
+      !delta_get_varint(delta, delta_size, &pos, &target_size) ||
+      expected_base_size != base_size)
+    return false;
+  out->clear();
+  out->reserve(target_size);
+  while (out->size() < target_size) {
+    uint64_t op, off;
+    if (!delta_get_varint(delta, delta_size, &pos, &op))
+      return false;
+    uint64_t len = op >> 1;
+    if (op & 1) {
+      if (!delta_get_varint(delta, delta_size, &pos, &off) || off + len > base_size)
+        return false;
+      out->insert(out->end(), base + off, base + off + len);
+    } else {
+      if (pos + len > delta_size)
+        return false;
+      out->insert(out->end(), delta + pos, delta + pos + len);
+      pos += len;
+    }
+  }
+  return out->size() == target_size && pos == delta_size;
+}
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * Parser of Java class files (JVM spec, chapter 4): constant pool,
+ * methods and their Code attributes, and a decoder of bytecode
+ * instructions. Used by the enum-method-instrs tool and by the agent.
+ *
+ * The parser works on a caller-owned buffer (e.g. a memory-mapped
+ * file) and does not copy the code arrays. Malformed input makes
+ * parse() return false with a message in get_error().
+ */
+
+#ifndef CLASS_FILE_HPP
+#define CLASS_FILE_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+/** Constant pool tags. */
+enum CP_TAG {
+  CP_UTF8 = 1, CP_INTEGER = 3, CP_FLOAT = 4, CP_LONG = 5, CP_DOUBLE = 6,
+  CP_CLASS = 7, CP_STRING = 8, CP_FIELDREF = 9, CP_METHODREF = 10,
+  CP_INTERFACE_METHODREF = 11, CP_NAME_AND_TYPE = 12, CP_METHOD_HANDLE = 15,
+  CP_METHOD_TYPE = 16, CP_DYNAMIC = 17, CP_INVOKE_DYNAMIC = 18,
+  CP_MODULE = 19, CP_PACKAGE = 20
+};
+
+/** Opcodes referenced by name in the code. */
+enum OPCODE {
+  OP_LDC = 18, OP_LDC_W = 19, OP_LDC2_W = 20,
+  OP_TABLESWITCH = 170, OP_LOOKUPSWITCH = 171,
+  OP_GETSTATIC = 178, OP_PUTSTATIC = 179, OP_GETFIELD = 180, OP_PUTFIELD = 181,
+  OP_INVOKEVIRTUAL = 182, OP_INVOKESPECIAL = 183, OP_INVOKESTATIC = 184,
+  OP_INVOKEINTERFACE = 185, OP_INVOKEDYNAMIC = 186, OP_NEW = 187,
+  OP_ANEWARRAY = 189, OP_CHECKCAST = 192, OP_INSTANCEOF = 193,
+  OP_WIDE = 196, OP_MULTIANEWARRAY = 197
+};
+
+/** Mnemonic of an opcode, or NULL for unassigned opcodes. */
+inline const char* opcode_name(int op) {
+  static const char* const names[] = {
+    "nop", "aconst_null", "iconst_m1", "iconst_0", "iconst_1", "iconst_2",
+    "iconst_3", "iconst_4", "iconst_5", "lconst_0", "lconst_1", "fconst_0",
+    "fconst_1", "fconst_2", "dconst_0", "dconst_1", "bipush", "sipush", "ldc",
+    "ldc_w", "ldc2_w", "iload", "lload", "fload", "dload", "aload", "iload_0",
+    "iload_1", "iload_2", "iload_3", "lload_0", "lload_1", "lload_2", "lload_3",
+    "fload_0", "fload_1", "fload_2", "fload_3", "dload_0", "dload_1", "dload_2",
+    "dload_3", "aload_0", "aload_1", "aload_2", "aload_3", "iaload", "laload",
+    "faload", "daload", "aaload", "baload", "caload", "saload", "istore",
+    "lstore", "fstore", "dstore", "astore", "istore_0", "istore_1", "istore_2",
+    "istore_3", "lstore_0", "lstore_1", "lstore_2", "lstore_3", "fstore_0",
+    "fstore_1", "fstore_2", "fstore_3", "dstore_0", "dstore_1", "dstore_2",
+    "dstore_3", "astore_0", "astore_1", "astore_2", "astore_3", "iastore",
+    "lastore", "fastore", "dastore", "aastore", "bastore", "castore", "sastore",
+    "pop", "pop2", "dup", "dup_x1", "dup_x2", "dup2", "dup2_x1", "dup2_x2",
+    "swap", "iadd", "ladd", "fadd", "dadd", "isub", "lsub", "fsub", "dsub",
+    "imul", "lmul", "fmul", "dmul", "idiv", "ldiv", "fdiv", "ddiv", "irem",
+    "lrem", "frem", "drem", "ineg", "lneg", "fneg", "dneg", "ishl", "lshl",
+    "ishr", "lshr", "iushr", "lushr", "iand", "land", "ior", "lor", "ixor",
+    "lxor", "iinc", "i2l", "i2f", "i2d", "l2i", "l2f", "l2d", "f2i", "f2l",
+    "f2d", "d2i", "d2l", "d2f", "i2b", "i2c", "i2s", "lcmp", "fcmpl", "fcmpg",
+    "dcmpl", "dcmpg", "ifeq", "ifne", "iflt", "ifge", "ifgt", "ifle",
+    "if_icmpeq", "if_icmpne", "if_icmplt", "if_icmpge", "if_icmpgt",
+    "if_icmple", "if_acmpeq", "if_acmpne", "goto", "jsr", "ret", "tableswitch",
+    "lookupswitch", "ireturn", "lreturn", "freturn", "dreturn", "areturn",
+    "return", "getstatic", "putstatic", "getfield", "putfield",
+    "invokevirtual", "invokespecial", "invokestatic", "invokeinterface",
+    "invokedynamic", "new", "newarray", "anewarray", "arraylength", "athrow",
+    "checkcast", "instanceof", "monitorenter", "monitorexit", "wide",
+    "multianewarray", "ifnull", "ifnonnull", "goto_w", "jsr_w"
+  };
+  return (op >= 0 && op < (int)(sizeof(names) / sizeof(names[0]))) ? names[op] : NULL;
+}
+
+/** Length of the instruction at pc, or -1 if it is malformed or runs
+    past the end of the code. */
+inline int instruction_length(const unsigned char* code, uint32_t code_len, uint32_t pc) {
+  // Operand bytes of the fixed-length instructions (-1: unassigned,
+  // -2: variable length).
+  static const signed char operands[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x00
+    1, 2, 1, 2, 2, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,   // 0x10
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x20
+    0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,   // 0x30
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x40
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x50
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x60
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x70
+    0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 0x80
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2,   // 0x90
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 1, -2, -2, 0, 0, 0, 0, // 0xa0
+    0, 0, 2, 2, 2, 2, 2, 2, 2, 4, 4, 2, 1, 2, 0, 0,   // 0xb0
+    2, 2, 0, 0, -2, 3, 2, 2, 4, 4                     // 0xc0
+  };
+  if (pc >= code_len)
+    return -1;
+  int op = code[pc];
+  if (op >= (int)sizeof(operands))
+    return -1;
+  int len;
+  if (op == OP_TABLESWITCH || op == OP_LOOKUPSWITCH) {
+    // Operands are 4-byte aligned relative to the start of the code.
+    uint32_t p = (pc + 4) & ~3u;
+    if (p + 12 > code_len)
+      return -1;
+    int32_t a = (int32_t)((code[p + 4] << 24) | (code[p + 5] << 16) | (code[p + 6] << 8) | code[p + 7]);
+    int32_t b = (int32_t)((code[p + 8] << 24) | (code[p + 9] << 16) | (code[p + 10] << 8) | code[p + 11]);
+    int64_t entries;
+    if (op == OP_TABLESWITCH)
+      entries = (int64_t)b - a + 1;               // low, high: jump offsets
+    else
+      entries = 2 * (int64_t)a;                   // npairs: match-offset pairs
+    if (entries < 0 || entries > (int64_t)code_len)
+      return -1;
+    int64_t end = (op == OP_TABLESWITCH) ? p + 12 + 4 * entries : p + 8 + 4 * entries;
+    len = (int)(end - pc);
+  } else if (op == OP_WIDE) {
+    if (pc + 1 >= code_len)
+      return -1;
+    len = (code[pc + 1] == 0x84) ? 6 : 4;         // wide iinc, or wide load/store/ret
+  } else if (operands[op] < 0)
+    return -1;
+  else
+    len = 1 + operands[op];
+  return (pc + (uint64_t)len <= code_len) ? len : -1;
+}
+
+/** Converts a field descriptor to its Java source form, e.g.
+    "[Ljava/lang/String;" to "java.lang.String[]". Advances pos past it. */
+inline std::string descriptor_to_java(const std::string& desc, size_t* pos) {
+  int dims = 0;
+  while (*pos < desc.size() && desc[*pos] == '[') {
+    dims++;
+    (*pos)++;
+  }
+  std::string type;
+  if (*pos < desc.size()) {
+    switch (desc[(*pos)++]) {
+    case 'B': type = "byte"; break;
+    case 'C': type = "char"; break;
+    case 'D': type = "double"; break;
+    case 'F': type = "float"; break;
+    case 'I': type = "int"; break;
+    case 'J': type = "long"; break;
+    case 'S': type = "short"; break;
+    case 'Z': type = "boolean"; break;
+    case 'V': type = "void"; break;
+    case 'L': {
+      size_t end = desc.find(';', *pos);
+      if (end == std::string::npos)
+        end = desc.size();
+      type = desc.substr(*pos, end - *pos);
+      for (size_t i = 0; i < type.size(); i++)
+        if (type[i] == '/')
+          type[i] = '.';
+      *pos = end + 1;
+      break;
+    }
+    default: type = "?";
+    }
+  }
+  for (int i = 0; i < dims; i++)
+    type += "[]";
+  return type;
+}
+
+/** Parameter list of a method descriptor in Java source form, as
+    printed by javap, e.g. "(java.lang.String[], int)". */
+inline std::string java_parameters(const std::string& method_desc) {
+  std::string params = "(";
+  size_t pos = 1;
+  while (pos < method_desc.size() && method_desc[pos] != ')') {
+    if (params.size() > 1)
+      params += ", ";
+    params += descriptor_to_java(method_desc, &pos);
+  }
+  return params + ")";
+}
+
+class ClassFile {
+public:
+  struct CpEntry {
+    uint8_t tag;
+    uint16_t ref1;     // class/string/name index, or first reference
+    uint16_t ref2;     // second reference (member refs, name-and-type, ...)
+    uint32_t offset;   // offset of the entry's data (after the tag)
+    uint16_t length;   // UTF8 length
+  };
+
+  struct Method {
+    uint16_t access_flags;
+    std::string name;
+    std::string descriptor;
+    /** Code attribute; code is NULL for abstract and native methods. */
+    const unsigned char* code;
+    uint32_t code_length;
+    uint16_t max_stack;
+    uint16_t max_locals;
+  };
+
+private:
+  const unsigned char* data;
+  size_t size;
+  size_t pos;
+  bool failed;
+  std::string error;
+
+  std::vector<CpEntry> cp;
+  std::vector<Method> methods;
+  uint16_t major;
+  uint16_t access_flags;
+  uint16_t this_class;
+  uint16_t super_class;
+
+  bool fail(const std::string& message) {
+    if (!failed) {
+      failed = true;
+      error = message + " (at offset " + std::to_string(pos) + ")";
+    }
+    return false;
+  }
+
+  bool need(size_t n) {
+    return (pos + n <= size) || fail("truncated class file");
+  }
+
+  uint8_t u1() { return need(1) ? data[pos++] : 0; }
+
+  uint16_t u2() {
+    if (!need(2))
+      return 0;
+    uint16_t v = (data[pos] << 8) | data[pos + 1];
+    pos += 2;
+    return v;
+  }
+
+  uint32_t u4() {
+    if (!need(4))
+      return 0;
+    uint32_t v = ((uint32_t)data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+    pos += 4;
+    return v;
+  }
+
+  void skip(size_t n) {
+    if (need(n))
+      pos += n;
+  }
+
+  bool parse_constant_pool(uint16_t count) {
+    cp.assign(count, CpEntry());
+    for (uint16_t i = 1; i < count && !failed; i++) {
+      CpEntry& e = cp[i];
+      e.tag = u1();
+      e.offset = pos;
+      e.ref1 = e.ref2 = e.length = 0;
+      switch (e.tag) {
+      case CP_UTF8:
+        e.length = u2();
+        e.offset = pos;
+        skip(e.length);
+        break;
+      case CP_INTEGER: case CP_FLOAT:
+        skip(4);
+        break;
+      case CP_LONG: case CP_DOUBLE:
+        skip(8);
+        i++;            // takes two entries
+        break;
+      case CP_CLASS: case CP_STRING: case CP_METHOD_TYPE: case CP_MODULE: case CP_PACKAGE:
+        e.ref1 = u2();
+        break;
+      case CP_FIELDREF: case CP_METHODREF: case CP_INTERFACE_METHODREF:
+      case CP_NAME_AND_TYPE: case CP_DYNAMIC: case CP_INVOKE_DYNAMIC:
+        e.ref1 = u2();
+        e.ref2 = u2();
+        break;
+      case CP_METHOD_HANDLE:
+        e.ref1 = u1();  // reference kind
+        e.ref2 = u2();
+        break;
+      default:
+        return fail("unknown constant pool tag " + std::to_string(e.tag) +
+                    " at index " + std::to_string(i));
+      }
+    }
+    return !failed;
+  }
+
+  void skip_attributes() {
+    uint16_t count = u2();
+    for (uint16_t i = 0; i < count && !failed; i++) {
+      u2();
+      skip(u4());
+    }
+  }
+
+public:
+  ClassFile() : data(NULL), size(0), pos(0), failed(false), major(0),
+                access_flags(0), this_class(0), super_class(0) { }
+
+  /** Parses a class file. The buffer must outlive this object. */
+  bool parse(const unsigned char* class_data, size_t class_size) {
+    data = class_data;
+    size = class_size;
+    pos = 0;
+    failed = false;
+    cp.clear();
+    methods.clear();
+    if (u4() != 0xcafebabe)
+      return fail("bad magic number");
+    u2();
+    major = u2();
+    if (!parse_constant_pool(u2()))
+      return false;
+    access_flags = u2();
+    this_class = u2();
+    super_class = u2();
+    skip(2 * (size_t)u2());           // interfaces
+    uint16_t field_count = u2();
+    for (uint16_t i = 0; i < field_count && !failed; i++) {
+      skip(6);
+      skip_attributes();
+    }
+    uint16_t method_count = u2();
+    for (uint16_t i = 0; i < method_count && !failed; i++) {
+      Method m;
+      m.access_flags = u2();
+      m.name = utf8(u2());
+      m.descriptor = utf8(u2());
+      m.code = NULL;
+      m.code_length = 0;
+      m.max_stack = m.max_locals = 0;
+      uint16_t attribute_count = u2();
+      for (uint16_t a = 0; a < attribute_count && !failed; a++) {
+        std::string attribute_name = utf8(u2());
+        uint32_t attribute_length = u4();
+        size_t attribute_end = pos + attribute_length;
+        if (attribute_name == "Code" && need(attribute_length) && attribute_length >= 8) {
+          m.max_stack = u2();
+          m.max_locals = u2();
+          m.code_length = u4();
+          if (need(m.code_length) && pos + m.code_length <= attribute_end)
+            m.code = data + pos;
+          else
+            return fail("bad Code attribute in method " + m.name);
+        }
+        pos = attribute_end;
+      }
+      methods.push_back(m);
+    }
+    return !failed && need(0);
+  }
+
+  /** Parses a bare constant pool of count - 1 entries, as returned by
+      JVMTI GetConstantPool. The buffer must outlive this object. */
+  bool parse_pool(const unsigned char* pool_data, size_t pool_size, uint16_t count) {
+    data = pool_data;
+    size = pool_size;
+    pos = 0;
+    failed = false;
+    cp.clear();
+    methods.clear();
+    this_class = super_class = 0;
+    return parse_constant_pool(count);
+  }
+
+  const std::string& get_error() const { return error; }
+  uint16_t get_major_version() const { return major; }
+  const std::vector<Method>& get_methods() const { return methods; }
+  size_t get_constant_pool_count() const { return cp.size(); }
+
+  const CpEntry* entry(uint16_t index, int tag) const {
+    if (index == 0 || index >= cp.size() || cp[index].tag != tag)
+      return NULL;
+    return &cp[index];
+  }
+
+  /** A UTF8 constant (modified UTF-8, returned as is), or "" if the
+      index is not a UTF8 constant. */
+  std::string utf8(uint16_t index) const {
+    const CpEntry* e = entry(index, CP_UTF8);
+    return e ? std::string((const char*)data + e->offset, e->length) : std::string();
+  }
+
+  /** Internal name of a CONSTANT_Class, e.g. "java/lang/String". */
+  std::string class_name(uint16_t index) const {
+    const CpEntry* e = entry(index, CP_CLASS);
+    return e ? utf8(e->ref1) : std::string();
+  }
+
+  std::string get_class_name() const { return class_name(this_class); }
+  std::string get_super_class_name() const { return class_name(super_class); }
+
+  int tag_at(uint16_t index) const {
+    return (index > 0 && index < cp.size()) ? cp[index].tag : 0;
+  }
+
+  /** Resolves a field/method/interface method reference. */
+  bool member_ref(uint16_t index, std::string* owner, std::string* name, std::string* desc) const {
+    int tag = tag_at(index);
+    if (tag != CP_FIELDREF && tag != CP_METHODREF && tag != CP_INTERFACE_METHODREF)
+      return false;
+    const CpEntry* nat = entry(cp[index].ref2, CP_NAME_AND_TYPE);
+    if (nat == NULL)
+      return false;
+    *owner = class_name(cp[index].ref1);
+    *name = utf8(nat->ref1);
+    *desc = utf8(nat->ref2);
+    return true;
+  }
+
+  /** Resolves an invokedynamic (or dynamic constant) reference; the
+      bootstrap method index is returned in bootstrap. */
+  bool dynamic_ref(uint16_t index, uint16_t* bootstrap, std::string* name, std::string* desc) const {
+    int tag = tag_at(index);
+    if (tag != CP_INVOKE_DYNAMIC && tag != CP_DYNAMIC)
+      return false;
+    const CpEntry* nat = entry(cp[index].ref2, CP_NAME_AND_TYPE);
+    if (nat == NULL)
+      return false;
+    *bootstrap = cp[index].ref1;
+    *name = utf8(nat->ref1);
+    *desc = utf8(nat->ref2);
+    return true;
+  }
+
+  /** The constant pool operand of the instruction at pc, resolved:
+      "owner.name:desc" for field and method references,
+      "#bootstrap:name:desc" for invokedynamic and dynamic constants,
+      the class for class operands (new, checkcast, ldc of a class,
+      ...). Names are internal ("java/lang/String"). Returns "" if the
+      instruction has no such operand or it cannot be resolved. */
+  std::string instruction_target(const unsigned char* code, uint32_t code_length, uint32_t pc) const {
+    if (instruction_length(code, code_length, pc) <= 0)
+      return std::string();
+    int op = code[pc];
+    uint16_t index;
+    if (op == OP_LDC)
+      index = code[pc + 1];
+    else if (op == OP_LDC_W || op == OP_LDC2_W || (op >= OP_GETSTATIC && op <= OP_NEW) ||
+             op == OP_ANEWARRAY || op == OP_CHECKCAST || op == OP_INSTANCEOF ||
+             op == OP_MULTIANEWARRAY)
+      index = (code[pc + 1] << 8) | code[pc + 2];
+    else
+      return std::string();
+    std::string owner, name, desc;
+    uint16_t bootstrap;
+    if (member_ref(index, &owner, &name, &desc))
+      return owner + "." + name + ":" + desc;
+    if (dynamic_ref(index, &bootstrap, &name, &desc))
+      return "#" + std::to_string(bootstrap) + ":" + name + ":" + desc;
+    return class_name(index);
+  }
+
+  /** Method name as javap prints it in declarations: the class name
+      for constructors, "static {}" for the class initializer, else
+      the name and the Java parameter types. */
+  std::string javap_method_name(const Method& m) const {
+    if (m.name == "<clinit>")
+      return "static {}";
+    std::string name = m.name;
+    if (name == "<init>") {
+      name = get_class_name();
+      for (size_t i = 0; i < name.size(); i++)
+        if (name[i] == '/')
+          name[i] = '.';
+    }
+    return name + java_parameters(m.descriptor);
+  }
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Include/exclude filter of class names (or loader class names),
+ * compiled once from the agent options into a prefix trie.
+ *
+ * A pattern is either a package/class prefix ("com/foo/", "sun/") or a
+ * glob matched against the whole name (e.g. "com/foo/Test*"), where
+ * '*' does not cross '/', '**' does, and '?' matches one character.
+ * Dots are accepted in place of slashes. A glob hangs off the trie
+ * node of its literal prefix, so only the globs along the path of a
+ * name are tried.
+ *
+ * The most specific pattern wins: the one whose literal prefix is the
+ * longest, or the one given last among equally long ones. A name that
+ * matches no pattern is accepted unless there are include patterns.
+ * For example, "include=com/acme/,exclude=com/acme/gen/" accepts the
+ * classes of com/acme/ except those of com/acme/gen/, and nothing
+ * else. Matching does not allocate.
+ */
+
+#ifndef CLASS_FILTER_HPP
+#define CLASS_FILTER_HPP
+
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+class ClassFilter {
+  struct Rule {
+    bool include;
+    /** Whole-name glob, or empty for a prefix rule. */
+    std::string glob;
+  };
+
+  struct Node {
+    /** Outgoing edges, sorted by character. */
+    std::vector<std::pair<char, int> > edges;
+    /** Rules ending here, in the order they were given. */
+    std::vector<Rule> rules;
+  };
+
+  std::vector<Node> nodes;
+  int include_count;
+  int rule_count;
+
+  int child(int node, char c) const {
+    const std::vector<std::pair<char, int> >& edges = nodes[node].edges;
+    for (size_t i = 0; i < edges.size() && edges[i].first <= c; i++)
+      if (edges[i].first == c)
+        return edges[i].second;
+    return -1;
+  }
+
+  int add_child(int node, char c) {
+    int existing = child(node, c);
+    if (existing != -1)
+      return existing;
+    int added = nodes.size();
+    nodes.push_back(Node());
+    std::vector<std::pair<char, int> >& edges = nodes[node].edges;
+    size_t pos = 0;
+    while (pos < edges.size() && edges[pos].first < c)
+      pos++;
+    edges.insert(edges.begin() + pos, std::make_pair(c, added));
+    return added;
+  }
+
+public:
+  ClassFilter() : nodes(1), include_count(0), rule_count(0) { }
+
+  /** Adds a pattern; later patterns win over earlier ones with the
+      same literal prefix. */
+  void add(const std::string& pattern, bool include) {
+    std::string normalized(pattern);
+    for (size_t i = 0; i < normalized.size(); i++)
+      if (normalized[i] == '.')
+        normalized[i] = '/';
+    size_t wildcard = normalized.find_first_of("*?");
+    size_t literal_len = (wildcard == std::string::npos) ? normalized.size() : wildcard;
+
+    int node = 0;
+    for (size_t i = 0; i < literal_len; i++)
+      node = add_child(node, normalized[i]);
+    Rule rule;
+    rule.include = include;
+    if (wildcard != std::string::npos)
+      rule.glob = normalized;
+    nodes[node].rules.push_back(rule);
+    rule_count++;
+    if (include)
+      include_count++;
+  }
+
+  bool empty() const { return rule_count == 0; }
+
+  /** Matches a name against a glob pattern. */
+  static bool glob_match(const char* pattern, const char* s) {
+    while (*pattern) {
+      if (pattern[0] == '*') {
+        bool any_depth = (pattern[1] == '*');
+        const char* rest = pattern + (any_depth ? 2 : 1);
+        for (const char* p = s; ; p++) {
+          if (glob_match(rest, p))
+            return true;
+          if (*p == 0 || (*p == '/' && !any_depth))
+            return false;
+        }
+      }
+      if (*s == 0 || (*pattern != '?' && *pattern != *s))
+        return false;
+      pattern++;
+      s++;
+    }
+    return *s == 0;
+  }
+
+  /** Returns true if the name passes the filter. */
+  bool accepts(const char* name) const {
+    int matched = -1;   // -1: no match, 0: exclude, 1: include
+    int node = 0;
+    for (const char* p = name; node != -1; p++) {
+      const std::vector<Rule>& rules = nodes[node].rules;
+      for (size_t i = 0; i < rules.size(); i++)
+        if (rules[i].glob.empty() || glob_match(rules[i].glob.c_str(), name))
+          matched = rules[i].include;
+      if (*p == 0)
+        break;
+      char c = (*p == '.') ? '/' : *p;
+      node = child(node, c);
+    }
+    if (matched == -1)
+      return include_count == 0;
+    return matched == 1;
+  }
+};
+
+#endif
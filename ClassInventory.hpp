@@ -0,0 +1,222 @@
+/*
+ * Live inventory of the classes of the JVM, kept from the ClassPrepare
+ * and class unload notifications.
+ *
+ * Every prepared class is recorded with its name, loader id, field and
+ * method counts, and what the class load hook did with it: captured,
+ * ignored (filtered out or sampled out), missed (prepared without
+ * going through the hook), or preloaded (already prepared when the
+ * inventory started). The hook reports its outcome per class before
+ * the class is prepared; the outcomes that are never matched by a
+ * prepared class (failed definitions, renamed classes) are the other
+ * half of the cross-check.
+ *
+ * Changes are journaled, so that an export only writes what changed
+ * since the previous one: "+" lines for prepared classes and "-" lines
+ * for unloaded ones. Replaying the exports in order gives the
+ * inventory at any snapshot.
+ */
+
+#ifndef CLASS_INVENTORY_HPP
+#define CLASS_INVENTORY_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/** What the class load hook did with a class. */
+enum CLASS_OUTCOME { CLASS_CAPTURED, CLASS_IGNORED, CLASS_SAMPLED_OUT, CLASS_MISSED,
+                     CLASS_PRELOADED, CLASS_OUTCOME_COUNT };
+
+inline const char* class_outcome_name(int outcome) {
+  switch (outcome) {
+  case CLASS_CAPTURED    : return "captured";
+  case CLASS_IGNORED     : return "ignored";
+  case CLASS_SAMPLED_OUT : return "sampled_out";
+  case CLASS_MISSED      : return "missed";
+  case CLASS_PRELOADED   : return "preloaded";
+  default                : return "?";
+  }
+}
+
+/** The name of a class without the suffix of a hidden class: the hook
+    and JVMTI may name one differently ("Foo/0x1234" in the class
+    file, "Foo.0x1234" in its signature). */
+inline std::string_view class_base_name(std::string_view name) {
+  size_t slash = name.find_last_of('/');
+  size_t dot = name.find('.', slash == std::string_view::npos ? 0 : slash);
+  return dot == std::string_view::npos ? name : name.substr(0, dot);
+}
+
+struct InventoryClass {
+  /** Internal name, e.g. "java/lang/Object". */
+  std::string name;
+  int loader_id;
+  /** Field and method counts, -1 if they could not be read. */
+  int fields;
+  int methods;
+  int outcome;
+};
+
+class ClassInventory {
+public:
+  struct Counters {
+    unsigned long live;
+    unsigned long prepared;
+    unsigned long unloaded;
+    unsigned long snapshots;
+    unsigned long unprepared;
+    unsigned long outcomes[CLASS_OUTCOME_COUNT];
+  };
+
+private:
+  struct Change {
+    bool added;
+    int64_t key;
+    InventoryClass cls;
+  };
+
+  pthread_mutex_t lock;
+  /** Live classes, by class tag. */
+  std::unordered_map<int64_t, InventoryClass> classes;
+  /** Hook outcomes not matched by a prepared class yet, by "<loader
+      id>/<class name>". */
+  std::unordered_map<std::string, int> hook_outcomes;
+  /** Changes since the last export. */
+  std::vector<Change> journal;
+  /** Keys of the prepared classes the hook never saw, for the
+      cross-check. */
+  std::vector<std::string> missed;
+  /** Keys given to classes without a tag (no can_tag_objects). */
+  int64_t untagged_keys;
+  Counters counters;
+
+  /** The matching key of a class, without a hidden class suffix. */
+  static std::string key_of(int loader_id, std::string_view name) {
+    name = class_base_name(name);
+    std::string key = std::to_string(loader_id);
+    key += '/';
+    key.append(name.data(), name.size());
+    return key;
+  }
+
+  static void write_class(FILE* out, char change, int64_t key, const InventoryClass& cls) {
+    fprintf(out, "%c\t%lld\t%d\t%s\t%d\t%d\t%s\n", change, (long long)key, cls.loader_id,
+            cls.name.c_str(), cls.fields, cls.methods, class_outcome_name(cls.outcome));
+  }
+
+public:
+  ClassInventory() : untagged_keys(0) {
+    pthread_mutex_init(&lock, NULL);
+    counters = Counters();
+  }
+
+  /** Records the outcome of the hook for a class about to be defined. */
+  void hook_outcome(int loader_id, std::string_view name, int outcome) {
+    std::string key = key_of(loader_id, name);
+    pthread_mutex_lock(&lock);
+    hook_outcomes[key] = outcome;
+    pthread_mutex_unlock(&lock);
+  }
+
+  /** Adds a prepared class, matching it with the outcome the hook
+      reported for it. Without one, its outcome is the given one (missed
+      or preloaded). tag is 0 if the class could not be tagged. Returns
+      false if the class is already in the inventory. */
+  bool prepared(int64_t tag, InventoryClass cls, int unmatched_outcome) {
+    std::string key = key_of(cls.loader_id, cls.name);
+    pthread_mutex_lock(&lock);
+    if (tag == 0)
+      tag = -(++untagged_keys);
+    else if (classes.count(tag) != 0) {
+      pthread_mutex_unlock(&lock);
+      return false;
+    }
+    auto it = hook_outcomes.find(key);
+    if (it != hook_outcomes.end()) {
+      cls.outcome = it->second;
+      hook_outcomes.erase(it);
+    } else {
+      cls.outcome = unmatched_outcome;
+      if (unmatched_outcome == CLASS_MISSED)
+        missed.push_back(key);
+    }
+    counters.prepared++;
+    counters.outcomes[cls.outcome]++;
+    journal.push_back(Change{ true, tag, cls });
+    classes.emplace(tag, std::move(cls));
+    pthread_mutex_unlock(&lock);
+    return true;
+  }
+
+  /** Removes an unloaded class. Tags of other objects are ignored. */
+  void unloaded(int64_t tag) {
+    pthread_mutex_lock(&lock);
+    auto it = classes.find(tag);
+    if (it != classes.end()) {
+      counters.unloaded++;
+      journal.push_back(Change{ false, tag, std::move(it->second) });
+      classes.erase(it);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  Counters get_counters() {
+    pthread_mutex_lock(&lock);
+    Counters c = counters;
+    c.live = classes.size();
+    c.unprepared = hook_outcomes.size();
+    pthread_mutex_unlock(&lock);
+    return c;
+  }
+
+  /** Appends the changes since the last export to out, after a
+      "# snapshot" line with the counters. Does nothing if nothing
+      changed, unless forced. Returns the number of changes written. */
+  size_t export_changes(FILE* out, uint64_t elapsed_ms, bool force) {
+    std::vector<Change> changes;
+    pthread_mutex_lock(&lock);
+    if (journal.empty() && !force) {
+      pthread_mutex_unlock(&lock);
+      return 0;
+    }
+    changes.swap(journal);
+    Counters c = counters;
+    c.live = classes.size();
+    c.snapshots = ++counters.snapshots;
+    pthread_mutex_unlock(&lock);
+
+    fprintf(out, "# snapshot %lu elapsed_ms=%llu live=%lu prepared=%lu unloaded=%lu",
+            c.snapshots, (unsigned long long)elapsed_ms, c.live, c.prepared, c.unloaded);
+    for (int i = 0; i < CLASS_OUTCOME_COUNT; i++)
+      fprintf(out, " %s=%lu", class_outcome_name(i), c.outcomes[i]);
+    fprintf(out, "\n");
+    for (size_t i = 0; i < changes.size(); i++)
+      write_class(out, changes[i].added ? '+' : '-', changes[i].key, changes[i].cls);
+    return changes.size();
+  }
+
+  /** Writes the cross-check of the hook against the prepared classes:
+      the classes prepared without going through the hook, then the
+      classes the hook saw that were never prepared, one "<check> TAB
+      <loader id>/<class> TAB <hook outcome>" line each. */
+  void write_crosscheck(FILE* out) {
+    pthread_mutex_lock(&lock);
+    std::vector<std::string> missed_keys(missed);
+    std::map<std::string, int> unprepared(hook_outcomes.begin(), hook_outcomes.end());
+    pthread_mutex_unlock(&lock);
+    fprintf(out, "check\tclass\thook\n");
+    for (size_t i = 0; i < missed_keys.size(); i++)
+      fprintf(out, "missed\t%s\t-\n", missed_keys[i].c_str());
+    for (auto it = unprepared.begin(); it != unprepared.end(); ++it)
+      fprintf(out, "not_prepared\t%s\t%s\n", it->first.c_str(), class_outcome_name(it->second));
+  }
+};
+
+#endif
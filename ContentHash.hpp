@@ -0,0 +1,114 @@
+/*
+ * 128-bit content hash of captured class files (MurmurHash3_x64_128,
+ * public domain, by Austin Appleby). Used as the key of the
+ * content-addressed class store and of the class manifests.
+ */
+
+#ifndef CONTENT_HASH_HPP
+#define CONTENT_HASH_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <string>
+
+struct Hash128 {
+  uint64_t h1;
+  uint64_t h2;
+
+  bool operator==(const Hash128& o) const { return h1 == o.h1 && h2 == o.h2; }
+  bool operator!=(const Hash128& o) const { return !(*this == o); }
+  bool operator<(const Hash128& o) const {
+    return h1 < o.h1 || (h1 == o.h1 && h2 < o.h2);
+  }
+
+  /** 32 lowercase hex digits. */
+  std::string to_hex() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(32, '0');
+    for (int i = 0; i < 16; i++) {
+      s[15 - i] = digits[(h1 >> (4 * i)) & 0xf];
+      s[31 - i] = digits[(h2 >> (4 * i)) & 0xf];
+    }
+    return s;
+  }
+
+  /** Parses the output of to_hex(). Returns false on malformed input. */
+  static bool from_hex(const std::string& s, Hash128* h) {
+    if (s.size() != 32 || s.find_first_not_of("0123456789abcdef") != std::string::npos)
+      return false;
+    h->h1 = strtoull(s.substr(0, 16).c_str(), NULL, 16);
+    h->h2 = strtoull(s.substr(16).c_str(), NULL, 16);
+    return true;
+  }
+};
+
+/** Lets Hash128 be used as a key of unordered containers. */
+struct Hash128Hasher {
+  size_t operator()(const Hash128& h) const { return (size_t)(h.h1 ^ h.h2); }
+};
+
+inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+inline Hash128 hash128(const unsigned char* data, size_t len, uint32_t seed = 0) {
+  const size_t nblocks = len / 16;
+  uint64_t h1 = seed, h2 = seed;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+  for (size_t i = 0; i < nblocks; i++) {
+    uint64_t k1, k2;
+    memcpy(&k1, data + i * 16, 8);
+    memcpy(&k2, data + i * 16 + 8, 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const unsigned char* tail = data + nblocks * 16;
+  uint64_t k1 = 0, k2 = 0;
+  switch (len & 15) {
+  case 15: k2 ^= ((uint64_t)tail[14]) << 48; // fall through
+  case 14: k2 ^= ((uint64_t)tail[13]) << 40; // fall through
+  case 13: k2 ^= ((uint64_t)tail[12]) << 32; // fall through
+  case 12: k2 ^= ((uint64_t)tail[11]) << 24; // fall through
+  case 11: k2 ^= ((uint64_t)tail[10]) << 16; // fall through
+  case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;  // fall through
+  case  9: k2 ^= ((uint64_t)tail[ 8]) << 0;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    // fall through
+  case  8: k1 ^= ((uint64_t)tail[ 7]) << 56; // fall through
+  case  7: k1 ^= ((uint64_t)tail[ 6]) << 48; // fall through
+  case  6: k1 ^= ((uint64_t)tail[ 5]) << 40; // fall through
+  case  5: k1 ^= ((uint64_t)tail[ 4]) << 32; // fall through
+  case  4: k1 ^= ((uint64_t)tail[ 3]) << 24; // fall through
+  case  3: k1 ^= ((uint64_t)tail[ 2]) << 16; // fall through
+  case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;  // fall through
+  case  1: k1 ^= ((uint64_t)tail[ 0]) << 0;
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+
+  Hash128 h = { h1, h2 };
+  return h;
+}
+
+#endif
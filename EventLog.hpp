@@ -0,0 +1,613 @@
+/*
+ * The execution context of a captured class and its binary event log
+ * format. Shared by the agent (which captures contexts and appends
+ * them to out/events.bin) and decode-events (which turns the log back
+ * into .info text or JSON).
+ *
+ * Loading stacks are interned in a calling-context tree: a node is a
+ * frame (method, bytecode index and what was read about it) under
+ * the node of its caller, and the root is above the outermost frames.
+ * Most classes are loaded from a few distinct stacks, so a class event
+ * only refers to the node of its innermost frame.
+ *
+ * The log starts with the magic "BCCEVT02" and is followed by records,
+ * each introduced by a tag byte. Integers are LEB128 varints (signed
+ * ones zigzag-encoded). Strings, methods and nodes are interned: a
+ * STRING, METHOD or NODE record defines an id the first time it is
+ * used, and later records refer to those ids. Node ids start at 1; 0
+ * is the root (an empty stack).
+ *
+ *   STRING: id, length, bytes
+ *   METHOD: id, name string, signature string, declaring class string
+ *   NODE:   id, parent node, method, location (signed), location
+ *           status, bytecode (signed), line (signed), line error,
+ *           declaring class status
+ *   CLASS:  class id, name string, loader hash (signed), loader status,
+ *           loader class string, thread string, timestamp (ns),
+ *           top kind, stack status, node
+ */
+
+#ifndef EVENT_LOG_HPP
+#define EVENT_LOG_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ClassFile.hpp"
+
+#define EVENT_LOG_MAGIC "BCCEVT02"
+
+enum EVENT_TAG { TAG_STRING = 1, TAG_METHOD = 2, TAG_CLASS = 3, TAG_NODE = 4 };
+
+/** How the topmost frame of the loading stack looked. */
+enum TOP_KIND { TOP_DEFINE_CLASS, TOP_DEFINE_ANONYMOUS_CLASS, TOP_UNKNOWN, TOP_UNNAMED, TOP_NONE };
+enum STACK_STATUS { STACK_OK, STACK_ERROR, STACK_EMPTY, STACK_SKIPPED };
+enum LOCATION_STATUS { LOCATION_OK, LOCATION_ERROR, LOCATION_UNSUPPORTED };
+enum DECLARING_CLASS_STATUS { DECL_OK = 0, DECL_ERROR_2 = 2, DECL_ERROR_3 = 3 };
+enum LOADER_STATUS { LOADER_OK, LOADER_NULL, LOADER_ERROR_1, LOADER_ERROR_2 };
+
+/** Bytecode field values besides opcodes. */
+#define BC_NONE  (-1)
+#define BC_ERROR (-2)
+/** Line field value when no line could be determined. */
+#define LINE_NONE (-1)
+
+struct FrameContext {
+  int index;
+  std::string method_name;
+  std::string method_sig;
+  std::string declaring_class;
+  int64_t location;
+  int loc_status;
+  int bytecode;
+  int line;
+  int line_error;
+  int decl_status;
+};
+
+struct ExecContext {
+  uint64_t class_id;
+  std::string class_name;
+  int loader_hash;
+  int loader_status;
+  std::string loader_class;
+  std::string thread_name;
+  uint64_t timestamp;
+  int top_kind;
+  int stack_status;
+  /** Node of the innermost frame in the calling-context tree (0 if
+      the stack is empty). */
+  uint32_t context_node;
+  /** The frames, innermost first. The agent only expands them from
+      the tree for the .info text; the log reader always does. */
+  std::vector<FrameContext> frames;
+};
+
+/** A method of the calling-context tree. */
+struct ContextMethod {
+  std::string name;
+  std::string sig;
+  std::string declaring_class;
+};
+
+/** A node of the calling-context tree: a frame without its index,
+    which is its distance from the innermost frame of a stack. */
+struct ContextNode {
+  uint32_t parent;
+  uint32_t method;
+  int64_t location;
+  int loc_status;
+  int bytecode;
+  int line;
+  int line_error;
+  int decl_status;
+};
+
+/** The calling-context tree of the loading stacks. Methods and nodes
+    are only added by one thread at a time (the agent does it under
+    its context_lock); any thread may read them. */
+class ContextTree {
+  struct NodeKey {
+    ContextNode node;
+    bool operator==(const NodeKey& o) const {
+      return node.parent == o.node.parent && node.method == o.node.method &&
+        node.location == o.node.location && node.loc_status == o.node.loc_status &&
+        node.bytecode == o.node.bytecode && node.line == o.node.line &&
+        node.line_error == o.node.line_error && node.decl_status == o.node.decl_status;
+    }
+  };
+  struct NodeKeyHasher {
+    size_t operator()(const NodeKey& k) const {
+      uint64_t h = ((uint64_t)k.node.parent << 32) ^ k.node.method;
+      h = h * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.node.location;
+      h = h * 0x9e3779b97f4a7c15ULL ^ (uint64_t)(uint32_t)k.node.bytecode;
+      h = h * 0x9e3779b97f4a7c15ULL ^ ((uint64_t)(uint32_t)k.node.line << 8 ^
+                                        k.node.loc_status << 4 ^ k.node.decl_status);
+      return (size_t)(h ^ (h >> 29));
+    }
+  };
+
+  /** Guards the vectors against the readers while they grow. */
+  mutable pthread_rwlock_t lock;
+  std::vector<ContextNode> nodes;
+  std::vector<ContextMethod> methods;
+  /** Only used by the adding thread. */
+  std::unordered_map<NodeKey, uint32_t, NodeKeyHasher> children;
+
+public:
+  ContextTree() {
+    pthread_rwlock_init(&lock, NULL);
+    ContextNode root;
+    memset(&root, 0, sizeof(root));
+    nodes.push_back(root);
+  }
+
+  ContextTree(const ContextTree&) = delete;
+  ContextTree& operator=(const ContextTree&) = delete;
+
+  /** Adds a method and returns its id. The caller remembers it. */
+  uint32_t add_method(const std::string& name, const std::string& sig,
+                      const std::string& declaring_class) {
+    ContextMethod m;
+    m.name = name;
+    m.sig = sig;
+    m.declaring_class = declaring_class;
+    pthread_rwlock_wrlock(&lock);
+    methods.push_back(m);
+    uint32_t id = methods.size() - 1;
+    pthread_rwlock_unlock(&lock);
+    return id;
+  }
+
+  /** Returns the id of the child of frame.parent for frame, adding it
+      if it is new. */
+  uint32_t child(const ContextNode& frame) {
+    NodeKey key = { frame };
+    auto it = children.find(key);
+    if (it != children.end())
+      return it->second;
+    pthread_rwlock_wrlock(&lock);
+    nodes.push_back(frame);
+    uint32_t id = nodes.size() - 1;
+    pthread_rwlock_unlock(&lock);
+    children[key] = id;
+    return id;
+  }
+
+  ContextNode node(uint32_t id) const {
+    pthread_rwlock_rdlock(&lock);
+    ContextNode n = nodes[id];
+    pthread_rwlock_unlock(&lock);
+    return n;
+  }
+
+  ContextMethod method(uint32_t id) const {
+    pthread_rwlock_rdlock(&lock);
+    ContextMethod m = methods[id];
+    pthread_rwlock_unlock(&lock);
+    return m;
+  }
+
+  /** Number of nodes, the root included. */
+  size_t size() const {
+    pthread_rwlock_rdlock(&lock);
+    size_t n = nodes.size();
+    pthread_rwlock_unlock(&lock);
+    return n;
+  }
+
+  /** Expands the stack ending at a node into frames, innermost first. */
+  void frames(uint32_t leaf, std::vector<FrameContext>* out) const {
+    out->clear();
+    pthread_rwlock_rdlock(&lock);
+    for (uint32_t id = leaf; id != 0; id = nodes[id].parent) {
+      const ContextNode& n = nodes[id];
+      const ContextMethod& m = methods[n.method];
+      FrameContext f;
+      f.index = out->size();
+      f.method_name = m.name;
+      f.method_sig = m.sig;
+      f.declaring_class = m.declaring_class;
+      f.location = n.location;
+      f.loc_status = n.loc_status;
+      f.bytecode = n.bytecode;
+      f.line = n.line;
+      f.line_error = n.line_error;
+      f.decl_status = n.decl_status;
+      out->push_back(f);
+    }
+    pthread_rwlock_unlock(&lock);
+  }
+};
+
+/** Writes the mnemonic of an opcode. */
+inline void print_bc(std::ostream* stream, const unsigned char c) {
+  const char* name = opcode_name(c);
+  if (name != NULL)
+    *stream << name;
+  else
+    *stream << "bytecode-" << (int)c;
+}
+
+/** Writes a context in the text format of the .info files. */
+inline void format_exec_context(std::ostream* context_stream, const ExecContext& ctx) {
+  using std::endl;
+  if (ctx.stack_status == STACK_ERROR)
+    *context_stream << "[error reading stack trace]";
+  for (size_t i = 0; i < ctx.frames.size(); i++) {
+    const FrameContext& f = ctx.frames[i];
+    *context_stream << "{ Frame " << f.index << ": ";
+    *context_stream << "* In method: " << f.method_name << " (signature: " <<
+                       (f.method_sig.empty() ? "no signature" : f.method_sig) << ") " << endl;
+    if (f.index == 0) {
+      if (ctx.top_kind == TOP_UNKNOWN)
+        *context_stream << "[Unknown top method!]";
+      else if (ctx.top_kind == TOP_UNNAMED)
+        *context_stream << "[Unnamed top method!]";
+    }
+    if (f.location == -1)
+      *context_stream << "(native method) ";
+    else if (f.loc_status == LOCATION_ERROR)
+      *context_stream << "(error reading location) ";
+    else if (f.loc_status == LOCATION_UNSUPPORTED)
+      *context_stream << "(unsupported location type) ";
+    else {
+      *context_stream << "(bytecode @ position " << f.location <<  ") ";
+      if (f.bytecode >= 0) {
+        *context_stream << "[bc:"; print_bc(context_stream, f.bytecode); *context_stream << "]";
+      } else if (f.bytecode == BC_ERROR)
+        *context_stream << "(error reading bytecode)";
+      if (f.line_error != 0)
+        *context_stream << "(source location: error " << f.line_error << ") ";
+      else if (f.line != LINE_NONE)
+        *context_stream << "(candidate line number: " << f.line << ") ";
+      else
+        *context_stream << "(could not determine source location) ";
+    }
+    if (f.decl_status == DECL_OK)
+      *context_stream << "[declaring class: " << f.declaring_class << "]";
+    else
+      *context_stream << "[declaring class not found (err" << f.decl_status << ").]";
+    *context_stream << " }" << endl;
+  }
+  if (ctx.stack_status == STACK_EMPTY)
+    *context_stream << "[empty stack trace]" << endl;
+  else if (ctx.stack_status == STACK_SKIPPED)
+    *context_stream << "[stack trace not read]" << endl;
+
+  switch (ctx.loader_status) {
+  case LOADER_NULL:
+    *context_stream << "[Null classloader (bootstrap?)]" << endl; break;
+  case LOADER_ERROR_1:
+    *context_stream << "[Error retrieving classloader " << ctx.loader_hash << " (#1).]" << endl; break;
+  case LOADER_ERROR_2:
+    *context_stream << "[Error retrieving classloader " << ctx.loader_hash << " (#2).]" << endl; break;
+  default:
+    *context_stream << "[classloader " << ctx.loader_hash << " class: " << ctx.loader_class << "]" << endl;
+  }
+}
+
+/** Appends class events to a log through a large buffer. Not
+    thread-safe: the agent serializes appends. */
+class EventLogWriter {
+  FILE* file;
+  std::vector<unsigned char> buf;
+  size_t buffer_size;
+  uint64_t bytes_written;
+  std::unordered_map<std::string, uint32_t> strings;
+  std::unordered_map<std::string, uint32_t> methods;
+  /** Log id of each node of the tree written so far (0 = not yet). */
+  std::vector<uint32_t> node_ids;
+  uint32_t node_count;
+
+  void put_u8(unsigned char v) { buf.push_back(v); }
+
+  void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+      buf.push_back((unsigned char)(v | 0x80));
+      v >>= 7;
+    }
+    buf.push_back((unsigned char)v);
+  }
+
+  void put_svarint(int64_t v) {
+    put_varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+  }
+
+  uint32_t intern(const std::string& s) {
+    auto it = strings.find(s);
+    if (it != strings.end())
+      return it->second;
+    uint32_t id = strings.size();
+    strings[s] = id;
+    put_u8(TAG_STRING);
+    put_varint(id);
+    put_varint(s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+    return id;
+  }
+
+  uint32_t intern_method(const ContextMethod& m) {
+    std::string key = m.name + '\0' + m.sig + '\0' + m.declaring_class;
+    auto it = methods.find(key);
+    if (it != methods.end())
+      return it->second;
+    uint32_t name = intern(m.name);
+    uint32_t sig = intern(m.sig);
+    uint32_t decl = intern(m.declaring_class);
+    uint32_t id = methods.size();
+    methods[key] = id;
+    put_u8(TAG_METHOD);
+    put_varint(id);
+    put_varint(name);
+    put_varint(sig);
+    put_varint(decl);
+    return id;
+  }
+
+  /** Writes the nodes of a stack that are not in the log yet, callers
+      first, and returns the log id of its innermost node. */
+  uint32_t intern_node(const ContextTree& tree, uint32_t leaf) {
+    std::vector<std::pair<uint32_t, ContextNode> > missing;
+    uint32_t id = leaf;
+    while (id != 0 && (id >= node_ids.size() || node_ids[id] == 0)) {
+      ContextNode n = tree.node(id);
+      missing.push_back(std::make_pair(id, n));
+      id = n.parent;
+    }
+    uint32_t parent = (id == 0) ? 0 : node_ids[id];
+    for (size_t i = missing.size(); i-- > 0; ) {
+      const ContextNode& n = missing[i].second;
+      uint32_t method = intern_method(tree.method(n.method));
+      uint32_t log_id = ++node_count;
+      put_u8(TAG_NODE);
+      put_varint(log_id);
+      put_varint(parent);
+      put_varint(method);
+      put_svarint(n.location);
+      put_u8(n.loc_status);
+      put_svarint(n.bytecode);
+      put_svarint(n.line);
+      put_varint(n.line_error);
+      put_u8(n.decl_status);
+      if (node_ids.size() <= missing[i].first)
+        node_ids.resize(missing[i].first + 1, 0);
+      node_ids[missing[i].first] = log_id;
+      parent = log_id;
+    }
+    return parent;
+  }
+
+public:
+  EventLogWriter() : file(NULL), buffer_size(0), bytes_written(0), node_count(0) { }
+
+  /** Starts a log. A closed writer can be opened again: the new log
+      interns its strings and methods from scratch. */
+  bool open(const std::string& path, size_t buffer_size) {
+    file = fopen(path.c_str(), "wb");
+    if (file == NULL)
+      return false;
+    this->buffer_size = buffer_size;
+    bytes_written = 0;
+    strings.clear();
+    methods.clear();
+    node_ids.clear();
+    node_count = 0;
+    buf.clear();
+    buf.reserve(buffer_size);
+    buf.insert(buf.end(), EVENT_LOG_MAGIC, EVENT_LOG_MAGIC + 8);
+    return true;
+  }
+
+  bool is_open() const { return file != NULL; }
+
+  uint64_t get_bytes_written() const { return bytes_written + buf.size(); }
+
+  bool flush() {
+    if (file == NULL)
+      return false;
+    bool ok = buf.empty() || fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+    bytes_written += buf.size();
+    buf.clear();
+    return (fflush(file) == 0) && ok;
+  }
+
+  /** Appends a class event. Its stack is ctx.context_node in tree. */
+  void append(const ExecContext& ctx, const ContextTree& tree) {
+    if (file == NULL)
+      return;
+    uint32_t name = intern(ctx.class_name);
+    uint32_t loader_class = intern(ctx.loader_class);
+    uint32_t thread = intern(ctx.thread_name);
+    uint32_t node = intern_node(tree, ctx.context_node);
+
+    put_u8(TAG_CLASS);
+    put_varint(ctx.class_id);
+    put_varint(name);
+    put_svarint(ctx.loader_hash);
+    put_u8(ctx.loader_status);
+    put_varint(loader_class);
+    put_varint(thread);
+    put_varint(ctx.timestamp);
+    put_u8(ctx.top_kind);
+    put_u8(ctx.stack_status);
+    put_varint(node);
+    if (buf.size() >= buffer_size)
+      flush();
+  }
+
+  bool close() {
+    bool ok = flush();
+    if (file != NULL)
+      ok = (fclose(file) == 0) && ok;
+    file = NULL;
+    return ok;
+  }
+};
+
+/** Reads the class events of a log, resolving interned strings and
+    methods. */
+class EventLogReader {
+  FILE* file;
+  std::vector<std::string> strings;
+  struct Method { uint32_t name, sig, decl; };
+  std::vector<Method> methods;
+  /** Nodes by id; nodes[0] is the root. */
+  std::vector<ContextNode> nodes;
+  bool error;
+
+  int get_u8() {
+    int c = getc(file);
+    if (c == EOF)
+      error = true;
+    return c;
+  }
+
+  uint64_t get_varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      int c = get_u8();
+      if (c == EOF)
+        return 0;
+      v |= (uint64_t)(c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+        break;
+    }
+    return v;
+  }
+
+  int64_t get_svarint() {
+    uint64_t v = get_varint();
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+
+  const std::string& get_string() {
+    static const std::string invalid("<invalid string>");
+    uint64_t id = get_varint();
+    if (id >= strings.size()) {
+      error = true;
+      return invalid;
+    }
+    return strings[id];
+  }
+
+public:
+  EventLogReader() : file(NULL), error(false) { }
+
+  ~EventLogReader() {
+    if (file != NULL)
+      fclose(file);
+  }
+
+  /** Opens a log and checks its magic. */
+  bool open(const std::string& path) {
+    file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+      return false;
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8)
+      return false;
+    nodes.assign(1, ContextNode());
+    return memcmp(magic, EVENT_LOG_MAGIC, 8) == 0;
+  }
+
+  /** Number of calling-context nodes read so far, the root included. */
+  size_t node_count() const { return nodes.size(); }
+
+  /** True if the log was truncated or malformed. */
+  bool failed() const { return error; }
+
+  /** Reads the next class event. Returns false at the end of the log
+      or on error. */
+  bool next(ExecContext* ctx) {
+    for (;;) {
+      int tag = getc(file);
+      if (tag == EOF)
+        return false;
+      if (tag == TAG_STRING) {
+        uint64_t id = get_varint();
+        uint64_t len = get_varint();
+        std::string s(len, '\0');
+        if (id != strings.size() || (len > 0 && fread(&s[0], 1, len, file) != len)) {
+          error = true;
+          return false;
+        }
+        strings.push_back(s);
+      } else if (tag == TAG_METHOD) {
+        uint64_t id = get_varint();
+        Method m;
+        m.name = get_varint();
+        m.sig = get_varint();
+        m.decl = get_varint();
+        if (id != methods.size() || m.name >= strings.size() ||
+            m.sig >= strings.size() || m.decl >= strings.size()) {
+          error = true;
+          return false;
+        }
+        methods.push_back(m);
+      } else if (tag == TAG_NODE) {
+        uint64_t id = get_varint();
+        ContextNode n;
+        n.parent = get_varint();
+        n.method = get_varint();
+        n.location = get_svarint();
+        n.loc_status = get_u8();
+        n.bytecode = get_svarint();
+        n.line = get_svarint();
+        n.line_error = get_varint();
+        n.decl_status = get_u8();
+        if (id != nodes.size() || n.parent >= nodes.size() || n.method >= methods.size()) {
+          error = true;
+          return false;
+        }
+        nodes.push_back(n);
+      } else if (tag == TAG_CLASS) {
+        ctx->class_id = get_varint();
+        ctx->class_name = get_string();
+        ctx->loader_hash = get_svarint();
+        ctx->loader_status = get_u8();
+        ctx->loader_class = get_string();
+        ctx->thread_name = get_string();
+        ctx->timestamp = get_varint();
+        ctx->top_kind = get_u8();
+        ctx->stack_status = get_u8();
+        ctx->frames.clear();
+        uint64_t node = get_varint();
+        if (node >= nodes.size()) {
+          error = true;
+          return false;
+        }
+        ctx->context_node = node;
+        for (uint64_t id = node; id != 0; id = nodes[id].parent) {
+          const ContextNode& n = nodes[id];
+          FrameContext f;
+          f.index = ctx->frames.size();
+          f.method_name = strings[methods[n.method].name];
+          f.method_sig = strings[methods[n.method].sig];
+          f.declaring_class = strings[methods[n.method].decl];
+          f.location = n.location;
+          f.loc_status = n.loc_status;
+          f.bytecode = n.bytecode;
+          f.line = n.line;
+          f.line_error = n.line_error;
+          f.decl_status = n.decl_status;
+          ctx->frames.push_back(f);
+        }
+        return !error;
+      } else {
+        error = true;
+        return false;
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * Overhead governor: measures the wall time spent in the class load
+ * hook, per thread and in total, and lowers the capture level when a
+ * budget is exceeded.
+ *
+ * The budget is either milliseconds of hook time (summed over the
+ * threads) per second of wall time, or a share of the time of the
+ * threads that run the hook: their hook time over the time since each
+ * of them first ran it, so that N threads loading classes side by side
+ * count as N times the wall time. It is checked about once per second:
+ * over budget, the level goes down one step (full context, top frame
+ * only, bytes only, sampled bytes); under half the budget, it goes
+ * back up one step. Every change is recorded with the id of the first
+ * class captured at the new level.
+ *
+ * Each thread only adds to its own record; the totals are summed when
+ * the budget is checked. The time of a thread that exits is added to a
+ * total of the exited threads, and its record is reused by the next new
+ * thread.
+ */
+
+#ifndef GOVERNOR_HPP
+#define GOVERNOR_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "HookStats.hpp"
+
+/** Capture levels, from the most to the least detailed. */
+enum CAPTURE_LEVEL { LEVEL_FULL, LEVEL_TOP_FRAME, LEVEL_BYTES, LEVEL_SAMPLED, LEVEL_COUNT };
+
+inline const char* capture_level_name(int level) {
+  switch (level) {
+  case LEVEL_FULL      : return "full context";
+  case LEVEL_TOP_FRAME : return "top frame only";
+  case LEVEL_BYTES     : return "bytes only";
+  case LEVEL_SAMPLED   : return "sampled bytes";
+  default              : return "?";
+  }
+}
+
+class OverheadGovernor {
+public:
+  /** Hook time of one thread. Only that thread updates it. */
+  struct ThreadTime {
+    /** Empty until the thread captures a class. Guarded by lock. */
+    std::string name;
+    /** Set once name is; only read by the owning thread. */
+    bool named;
+    /** Start of the first hook call of the thread. */
+    uint64_t first_hook;
+    std::atomic<uint64_t> nanos;
+    std::atomic<unsigned long> hooks;
+    OverheadGovernor* owner;
+  };
+
+  struct Transition {
+    uint64_t at_nanos;          // since the agent started
+    unsigned long first_class;  // id of the first class at the new level
+    int level;
+  };
+
+private:
+  static const uint64_t WINDOW_NANOS = 1000000000ULL;
+
+  uint64_t budget_nanos_per_sec;  // 0 = no such budget
+  double budget_share;            // 0 = no such budget
+  unsigned long sample_every;
+  uint64_t start;
+  std::atomic<int> level;
+  std::atomic<uint64_t> window_end;
+  std::atomic<unsigned long> sample_counter;
+  std::atomic<unsigned long> classes_at[LEVEL_COUNT];
+  std::atomic<unsigned long> sampled_out;
+  /** Guards threads, free_times, the exited totals, checked_nanos and
+      transitions. */
+  pthread_mutex_t lock;
+  std::vector<ThreadTime*> threads;
+  /** Records of exited threads, for the next new threads. */
+  std::vector<ThreadTime*> free_times;
+  unsigned long exited_threads;
+  uint64_t exited_nanos;
+  unsigned long exited_hooks;
+  /** Time from the first hook call to the exit of the exited threads. */
+  uint64_t exited_span;
+  /** Hook time of all the threads at the last budget check. */
+  uint64_t checked_nanos;
+  std::vector<Transition> transitions;
+  /** Holds the record of each thread, to release it when the thread exits. */
+  pthread_key_t thread_key;
+
+  static inline thread_local ThreadTime* local_time = NULL;
+
+  /** Key destructor: adds the time of an exiting thread to the exited
+      totals and frees its record. */
+  static void thread_exited(void* time) {
+    ThreadTime* t = (ThreadTime*)time;
+    OverheadGovernor* owner = t->owner;
+    pthread_mutex_lock(&owner->lock);
+    owner->exited_threads++;
+    owner->exited_nanos += t->nanos.load();
+    owner->exited_hooks += t->hooks.load();
+    owner->exited_span += monotonic_nanos() - t->first_hook;
+    owner->threads.erase(std::find(owner->threads.begin(), owner->threads.end(), t));
+    owner->free_times.push_back(t);
+    pthread_mutex_unlock(&owner->lock);
+    local_time = NULL;
+  }
+
+  /** Moves one level down (more_detail == false) or up. */
+  void change_level(bool more_detail, uint64_t now, unsigned long next_class) {
+    int current = level.load();
+    int next = current + (more_detail ? -1 : 1);
+    if (next < LEVEL_FULL || next >= LEVEL_COUNT)
+      return;
+    level.store(next);
+    Transition t = { now - start, next_class, next };
+    pthread_mutex_lock(&lock);
+    transitions.push_back(t);
+    pthread_mutex_unlock(&lock);
+  }
+
+  /** Sums the hook time and calls of the live and exited threads, and
+      the time since each of them first ran the hook. Called with lock
+      held. */
+  void sum_threads(uint64_t now, uint64_t* nanos, unsigned long* hooks, uint64_t* span) {
+    *nanos = exited_nanos;
+    *hooks = exited_hooks;
+    *span = exited_span;
+    for (size_t i = 0; i < threads.size(); i++) {
+      *nanos += threads[i]->nanos.load(std::memory_order_relaxed);
+      *hooks += threads[i]->hooks.load(std::memory_order_relaxed);
+      *span += now - threads[i]->first_hook;
+    }
+  }
+
+  /** Checks the budget at the end of a window. */
+  void check_budget(uint64_t now, uint64_t window_len, unsigned long next_class) {
+    uint64_t total, span;
+    unsigned long hooks;
+    pthread_mutex_lock(&lock);
+    sum_threads(now, &total, &hooks, &span);
+    uint64_t used = total - checked_nanos;
+    checked_nanos = total;
+    pthread_mutex_unlock(&lock);
+    bool over = false, under = true;
+    if (budget_nanos_per_sec > 0) {
+      double allowed = (double)budget_nanos_per_sec * window_len / WINDOW_NANOS;
+      over = over || used > allowed;
+      under = under && used < allowed / 2;
+    }
+    if (budget_share > 0) {
+      double share = span == 0 ? 0 : (double)total / span;
+      over = over || share > budget_share;
+      under = under && share < budget_share / 2;
+    }
+    if (over)
+      change_level(false, now, next_class);
+    else if (under)
+      change_level(true, now, next_class);
+  }
+
+public:
+  OverheadGovernor() : budget_nanos_per_sec(0), budget_share(0), sample_every(10),
+                       start(monotonic_nanos()), level(LEVEL_FULL),
+                       window_end(start + WINDOW_NANOS), sample_counter(0), sampled_out(0),
+                       exited_threads(0), exited_nanos(0), exited_hooks(0), exited_span(0),
+                       checked_nanos(0) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_key_create(&thread_key, thread_exited);
+    for (int i = 0; i < LEVEL_COUNT; i++)
+      classes_at[i] = 0;
+  }
+
+  /** Sets the budget: hook milliseconds per second of wall time, and/or
+      a share (0..1) of the time of the threads that run the hook. */
+  void set_budget(uint64_t ms_per_sec, double share) {
+    budget_nanos_per_sec = ms_per_sec * 1000000ULL;
+    budget_share = share;
+  }
+
+  /** At the sampled level, one class in every n is captured. */
+  void set_sample_every(unsigned long n) { sample_every = (n == 0) ? 1 : n; }
+
+  bool has_budget() const { return budget_nanos_per_sec > 0 || budget_share > 0; }
+
+  int get_level() const { return level.load(std::memory_order_relaxed); }
+
+  /** The record of the calling thread, NULL until it is registered. */
+  ThreadTime* current_thread() const { return local_time; }
+
+  /** Registers the calling thread, once per thread, at the start of
+      its first hook call. Makes no JVMTI call: the thread is named
+      later, with name_thread(). */
+  ThreadTime* register_thread(uint64_t hook_start) {
+    pthread_mutex_lock(&lock);
+    ThreadTime* t;
+    if (free_times.empty())
+      t = new ThreadTime;
+    else {
+      t = free_times.back();
+      free_times.pop_back();
+    }
+    t->name.clear();
+    t->named = false;
+    t->first_hook = hook_start;
+    t->nanos = 0;
+    t->hooks = 0;
+    t->owner = this;
+    threads.push_back(t);
+    pthread_mutex_unlock(&lock);
+    local_time = t;
+    pthread_setspecific(thread_key, t);
+    return t;
+  }
+
+  /** Names the calling thread in the report. */
+  void name_thread(ThreadTime* thread, const std::string& name) {
+    pthread_mutex_lock(&lock);
+    thread->name = name;
+    pthread_mutex_unlock(&lock);
+    thread->named = true;
+  }
+
+  /** Returns true if a class should be captured at the sampled level. */
+  bool sample() {
+    if (sample_counter++ % sample_every == 0)
+      return true;
+    sampled_out++;
+    return false;
+  }
+
+  /** Counts a class captured at the given level. */
+  void count_class(int captured_level) { classes_at[captured_level]++; }
+
+  /** Accounts the time of one hook call. next_class is the id the
+      next captured class will get. */
+  void hook_done(ThreadTime* thread, uint64_t hook_start, unsigned long next_class) {
+    uint64_t now = monotonic_nanos();
+    uint64_t elapsed = now - hook_start;
+    thread->nanos.store(thread->nanos.load(std::memory_order_relaxed) + elapsed,
+                        std::memory_order_relaxed);
+    thread->hooks.store(thread->hooks.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+    if (!has_budget())
+      return;
+    uint64_t end = window_end.load(std::memory_order_relaxed);
+    // The thread that moves the window on checks the budget.
+    if (now >= end && window_end.compare_exchange_strong(end, now + WINDOW_NANOS))
+      check_budget(now, now - (end - WINDOW_NANOS), next_class);
+  }
+
+  /** Prints the hook times and the classes captured at each level. */
+  void report(std::ostream& out) {
+    using std::endl;
+    out << std::fixed << std::setprecision(1);
+    uint64_t total, span;
+    unsigned long hooks;
+    pthread_mutex_lock(&lock);
+    sum_threads(monotonic_nanos(), &total, &hooks, &span);
+    out << "Time in class load hook: " << total / 1e6 << " ms in " << hooks << " calls, " <<
+      (span == 0 ? 0 : 100.0 * total / span) << "% of the time of the hooking threads" << endl;
+    for (size_t i = 0; i < threads.size(); i++)
+      out << "  thread \"" << (threads[i]->name.empty() ? "?" : threads[i]->name) << "\": " <<
+        threads[i]->nanos.load() / 1e6 << " ms in " << threads[i]->hooks.load() << " calls" << endl;
+    if (exited_threads > 0)
+      out << "  " << exited_threads << " exited threads: " << exited_nanos / 1e6 <<
+        " ms in " << exited_hooks << " calls" << endl;
+    if (has_budget()) {
+      out << "Classes per capture level:" << endl;
+      for (int i = 0; i < LEVEL_COUNT; i++)
+        out << "  " << capture_level_name(i) << ": " << classes_at[i].load() << endl;
+      out << "  not sampled: " << sampled_out.load() << endl;
+      if (transitions.empty())
+        out << "Capture level was not changed." << endl;
+      else
+        out << "Capture level changes:" << endl;
+      for (size_t i = 0; i < transitions.size(); i++)
+        out << "  at " << transitions[i].at_nanos / 1e6 << " ms: " <<
+          capture_level_name(transitions[i].level) << " from class #" <<
+          transitions[i].first_class << endl;
+    }
+    pthread_mutex_unlock(&lock);
+    out.unsetf(std::ios::floatfield);
+    out << std::setprecision(6);
+  }
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Memory management of the class load hook.
+ *
+ * HookArena is a bump allocator for the scratch strings of one hook
+ * call (output paths, generated names): every thread has its own, and
+ * it is reset when the hook returns, so a hook call does no heap work
+ * for them once the arena has grown to its working size. Arena
+ * strings are NUL-terminated string_views, valid until the reset.
+ *
+ * JvmtiBuffer and JvmtiThreadInfo own the memory that JVMTI functions
+ * allocate for their results, and Deallocate it when they go out of
+ * scope, on every path.
+ */
+
+#ifndef HOOK_MEMORY_HPP
+#define HOOK_MEMORY_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <initializer_list>
+#include <string>
+#include <string_view>
+
+#include <jvmti.h>
+
+class HookArena {
+  struct Block {
+    Block* next;
+    size_t size;
+    size_t used;
+    char* data() { return (char*)(this + 1); }
+  };
+
+  static const size_t BLOCK_SIZE = 16 * 1024;
+
+  /** Current block; earlier ones follow through next. */
+  Block* head;
+
+  static Block* new_block(size_t size, Block* next) {
+    Block* b = (Block*)malloc(sizeof(Block) + size);
+    if (b == NULL)
+      abort();
+    b->next = next;
+    b->size = size;
+    b->used = 0;
+    return b;
+  }
+
+public:
+  HookArena() : head(NULL) {}
+  HookArena(const HookArena&) = delete;
+  HookArena& operator=(const HookArena&) = delete;
+
+  ~HookArena() {
+    while (head != NULL) {
+      Block* next = head->next;
+      free(head);
+      head = next;
+    }
+  }
+
+  char* alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (head == NULL || head->size - head->used < size)
+      head = new_block(size > BLOCK_SIZE ? size : BLOCK_SIZE, head);
+    char* p = head->data() + head->used;
+    head->used += size;
+    return p;
+  }
+
+  /** Frees everything allocated since the last reset. Keeps the
+      largest block, so that a steady workload stops allocating. */
+  void reset() {
+    if (head == NULL)
+      return;
+    Block* keep = head;
+    for (Block* b = head->next; b != NULL; b = b->next)
+      if (b->size > keep->size)
+        keep = b;
+    for (Block* b = head; b != NULL; ) {
+      Block* next = b->next;
+      if (b != keep)
+        free(b);
+      b = next;
+    }
+    keep->next = NULL;
+    keep->used = 0;
+    head = keep;
+  }
+
+  /** Concatenates parts into a NUL-terminated arena string. */
+  std::string_view concat(std::initializer_list<std::string_view> parts) {
+    size_t size = 0;
+    for (std::string_view part : parts)
+      size += part.size();
+    char* p = alloc(size + 1);
+    size_t pos = 0;
+    for (std::string_view part : parts) {
+      memcpy(p + pos, part.data(), part.size());
+      pos += part.size();
+    }
+    p[size] = '\0';
+    return std::string_view(p, size);
+  }
+
+  /** The decimal form of a number, as an arena string. */
+  std::string_view number(long n) {
+    char* p = alloc(24);
+    int len = snprintf(p, 24, "%ld", n);
+    return std::string_view(p, len);
+  }
+};
+
+/** A JVMTI result buffer, Deallocated on destruction. Pass out() to
+    the JVMTI function that fills it in. */
+template <typename T>
+class JvmtiBuffer {
+  jvmtiEnv* env;
+  T* ptr;
+
+public:
+  explicit JvmtiBuffer(jvmtiEnv* env) : env(env), ptr(NULL) {}
+  JvmtiBuffer(const JvmtiBuffer&) = delete;
+  JvmtiBuffer& operator=(const JvmtiBuffer&) = delete;
+  ~JvmtiBuffer() { reset(); }
+
+  void reset() {
+    if (ptr != NULL)
+      env->Deallocate((unsigned char*)ptr);
+    ptr = NULL;
+  }
+
+  T** out() {
+    reset();
+    return &ptr;
+  }
+
+  T* get() const { return ptr; }
+  T& operator[](size_t i) const { return ptr[i]; }
+};
+
+/** The result of GetThreadInfo: its name buffer and its local
+    references are released on destruction. */
+class JvmtiThreadInfo {
+  jvmtiEnv* env;
+  JNIEnv* jni;
+
+public:
+  jvmtiThreadInfo info;
+
+  JvmtiThreadInfo(jvmtiEnv* env, JNIEnv* jni) : env(env), jni(jni) {
+    memset(&info, 0, sizeof(info));
+  }
+  JvmtiThreadInfo(const JvmtiThreadInfo&) = delete;
+  JvmtiThreadInfo& operator=(const JvmtiThreadInfo&) = delete;
+
+  ~JvmtiThreadInfo() {
+    if (info.name != NULL)
+      env->Deallocate((unsigned char*)info.name);
+    if (jni != NULL && info.thread_group != NULL)
+      jni->DeleteLocalRef(info.thread_group);
+    if (jni != NULL && info.context_class_loader != NULL)
+      jni->DeleteLocalRef(info.context_class_loader);
+  }
+};
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Per-phase latency histograms and class counters of the agent's hot
+ * path.
+ *
+ * Every thread that runs an instrumented phase gets its own set of
+ * histograms and counters, so recording is a few relaxed atomic
+ * stores with no lock and no shared cache line. Readers (the stats
+ * file writer) sum the threads' values; a reading taken during the
+ * run may be a few samples behind. When a thread exits, its values
+ * are merged into a retired total and its set is reused by the next
+ * new thread, so the sets never outnumber the live threads.
+ *
+ * Buckets are logarithmic with 4 sub-buckets per power of two (at
+ * most 25% error), from 1ns up to 2^64ns.
+ */
+
+#ifndef HOOK_STATS_HPP
+#define HOOK_STATS_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <ostream>
+#include <vector>
+
+inline uint64_t monotonic_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Instrumented phases. PHASE_HOOK is the whole ClassFileLoadHook. */
+enum HOOK_PHASE {
+  PHASE_HOOK, PHASE_FILTER, PHASE_LOADER, PHASE_MAKE_DIRS, PHASE_WRITE_CLASS,
+  PHASE_STACK_WALK, PHASE_SYMBOLIZE, PHASE_SERIALIZE_WAIT, PHASE_CONTEXT_WAIT,
+  PHASE_COUNT
+};
+
+inline const char* hook_phase_name(int phase) {
+  switch (phase) {
+  case PHASE_HOOK           : return "hook";
+  case PHASE_FILTER         : return "filter";
+  case PHASE_LOADER         : return "loader_id";
+  case PHASE_MAKE_DIRS      : return "make_dirs";
+  case PHASE_WRITE_CLASS    : return "write_class";
+  case PHASE_STACK_WALK     : return "stack_walk";
+  case PHASE_SYMBOLIZE      : return "symbolize";
+  case PHASE_SERIALIZE_WAIT : return "serialize_lock_wait";
+  case PHASE_CONTEXT_WAIT   : return "context_lock_wait";
+  default                   : return "?";
+  }
+}
+
+/** Class counters. Every class seen by the hook counts as defined,
+    and as ignored (by the filters), sampled out (by the sampled capture
+    level) or in exactly one of the classifications by its loading
+    stack. */
+enum CLASS_COUNTER {
+  COUNT_DEFINED, COUNT_IGNORED, COUNT_SAMPLED_OUT, COUNT_BY_DEFINE_CLASS, COUNT_BY_DEFINE_ANONYMOUS_CLASS,
+  COUNT_BY_UNKNOWN, COUNT_IN_OTHER_METHODS, COUNT_UNCLASSIFIED,
+  COUNTER_COUNT
+};
+
+inline const char* class_counter_name(int counter) {
+  switch (counter) {
+  case COUNT_DEFINED                   : return "defined";
+  case COUNT_IGNORED                   : return "ignored";
+  case COUNT_SAMPLED_OUT               : return "sampled_out";
+  case COUNT_BY_DEFINE_CLASS           : return "by_defineClass";
+  case COUNT_BY_DEFINE_ANONYMOUS_CLASS : return "by_defineAnonymousClass";
+  case COUNT_BY_UNKNOWN                : return "by_unknown";
+  case COUNT_IN_OTHER_METHODS          : return "in_other_methods";
+  case COUNT_UNCLASSIFIED              : return "not_classified";
+  default                              : return "?";
+  }
+}
+
+class LatencyHistogram {
+public:
+  static const int BUCKETS = 256;
+
+  /** Bucket of a value: values below 4 have their own bucket, then 4
+      buckets per power of two. */
+  static int bucket_of(uint64_t v) {
+    if (v < 4)
+      return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return 4 * (e - 1) + (int)((v >> (e - 2)) & 3);
+  }
+
+  /** Smallest value of a bucket. */
+  static uint64_t bucket_start(int b) {
+    if (b < 4)
+      return b;
+    int e = b / 4 + 1;
+    return (uint64_t)(4 + b % 4) << (e - 2);
+  }
+
+private:
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> max;
+
+  /** Single writer: a relaxed load and store, no read-modify-write. */
+  static void add(std::atomic<uint64_t>& a, uint64_t v) {
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+public:
+  LatencyHistogram() : count(0), total(0), max(0) {
+    for (int i = 0; i < BUCKETS; i++)
+      buckets[i] = 0;
+  }
+
+  /** Moves the values of another histogram into this one. Neither
+      may be recorded into meanwhile. */
+  void take(LatencyHistogram& other) {
+    for (int i = 0; i < BUCKETS; i++)
+      add(buckets[i], other.buckets[i].exchange(0, std::memory_order_relaxed));
+    add(count, other.count.exchange(0, std::memory_order_relaxed));
+    add(total, other.total.exchange(0, std::memory_order_relaxed));
+    uint64_t m = other.max.exchange(0, std::memory_order_relaxed);
+    if (m > max.load(std::memory_order_relaxed))
+      max.store(m, std::memory_order_relaxed);
+  }
+
+  /** Records a value. Only the owning thread may call it. */
+  void record(uint64_t v) {
+    add(buckets[bucket_of(v)], 1);
+    add(count, 1);
+    add(total, v);
+    if (v > max.load(std::memory_order_relaxed))
+      max.store(v, std::memory_order_relaxed);
+  }
+
+  /** Adds this histogram into a plain summary. */
+  void merge_into(std::vector<uint64_t>* sum_buckets, uint64_t* sum_count,
+                  uint64_t* sum_total, uint64_t* sum_max) const {
+    for (int i = 0; i < BUCKETS; i++)
+      (*sum_buckets)[i] += buckets[i].load(std::memory_order_relaxed);
+    *sum_count += count.load(std::memory_order_relaxed);
+    *sum_total += total.load(std::memory_order_relaxed);
+    uint64_t m = max.load(std::memory_order_relaxed);
+    if (m > *sum_max)
+      *sum_max = m;
+  }
+};
+
+class HookStats {
+  /** Aligned so that two threads never share a cache line. */
+  struct alignas(64) ThreadStats {
+    LatencyHistogram phases[PHASE_COUNT];
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    /** Opcodes at the call sites of lazily loaded classes. */
+    std::atomic<uint64_t> opcodes[256];
+    HookStats* owner;
+
+    explicit ThreadStats(HookStats* owner) : owner(owner) {
+      for (int i = 0; i < COUNTER_COUNT; i++)
+        counters[i] = 0;
+      for (int i = 0; i < 256; i++)
+        opcodes[i] = 0;
+    }
+
+    /** Moves the values of an exited thread into this set. */
+    void take(ThreadStats& other) {
+      for (int p = 0; p < PHASE_COUNT; p++)
+        phases[p].take(other.phases[p]);
+      for (int i = 0; i < COUNTER_COUNT; i++)
+        counters[i] += other.counters[i].exchange(0, std::memory_order_relaxed);
+      for (int i = 0; i < 256; i++)
+        opcodes[i] += other.opcodes[i].exchange(0, std::memory_order_relaxed);
+    }
+  };
+
+  /** Single writer: a relaxed load and store, no read-modify-write. */
+  static void increment(std::atomic<uint64_t>& a) {
+    a.store(a.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  /** Guards threads, free_stats and retired; held by the readers, so
+      that they never count the values of an exiting thread twice. */
+  pthread_mutex_t lock;
+  /** Every set ever allocated, in use or free, and retired. */
+  std::vector<ThreadStats*> threads;
+  /** Sets of exited threads, emptied, for the next new threads. */
+  std::vector<ThreadStats*> free_stats;
+  /** Values of the exited threads. */
+  ThreadStats* retired;
+  /** Holds the set of each thread, to release it when the thread exits. */
+  pthread_key_t thread_key;
+
+  // One HookStats per process, so one slot per thread is enough.
+  static inline thread_local ThreadStats* local_stats = NULL;
+
+  ThreadStats* thread_stats() {
+    if (local_stats == NULL) {
+      pthread_mutex_lock(&lock);
+      if (free_stats.empty()) {
+        local_stats = new ThreadStats(this);
+        threads.push_back(local_stats);
+      } else {
+        local_stats = free_stats.back();
+        free_stats.pop_back();
+      }
+      pthread_mutex_unlock(&lock);
+      pthread_setspecific(thread_key, local_stats);
+    }
+    return local_stats;
+  }
+
+  /** Key destructor: retires the set of an exiting thread. */
+  static void thread_exited(void* stats) {
+    ThreadStats* s = (ThreadStats*)stats;
+    HookStats* owner = s->owner;
+    pthread_mutex_lock(&owner->lock);
+    owner->retired->take(*s);
+    owner->free_stats.push_back(s);
+    pthread_mutex_unlock(&owner->lock);
+    // Recorded again by a later destructor, the thread takes a new set.
+    local_stats = NULL;
+  }
+
+  /** Upper end of the bucket holding the given quantile. */
+  static uint64_t quantile(const std::vector<uint64_t>& buckets, uint64_t count, double q) {
+    if (count == 0)
+      return 0;
+    uint64_t rank = (uint64_t)(q * (count - 1)) + 1, seen = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= rank)
+        return (i + 1 < LatencyHistogram::BUCKETS) ?
+          LatencyHistogram::bucket_start(i + 1) - 1 : UINT64_MAX;
+    }
+    return 0;
+  }
+
+public:
+  HookStats() {
+    pthread_mutex_init(&lock, NULL);
+    pthread_key_create(&thread_key, thread_exited);
+    retired = new ThreadStats(this);
+    threads.push_back(retired);
+  }
+
+  void record(int phase, uint64_t nanos) {
+    thread_stats()->phases[phase].record(nanos);
+  }
+
+  /** Records the time since start in a phase and returns the current
+      time, to chain consecutive phases. */
+  uint64_t phase_done(int phase, uint64_t start) {
+    uint64_t now = monotonic_nanos();
+    record(phase, now - start);
+    return now;
+  }
+
+  void count(int counter) {
+    increment(thread_stats()->counters[counter]);
+  }
+
+  void count_opcode(int opcode) {
+    increment(thread_stats()->opcodes[opcode & 0xff]);
+  }
+
+  /** Sum of a counter over the threads. */
+  uint64_t counter(int c) {
+    pthread_mutex_lock(&lock);
+    uint64_t sum = 0;
+    for (size_t t = 0; t < threads.size(); t++)
+      sum += threads[t]->counters[c].load(std::memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+    return sum;
+  }
+
+  /** Sums of all the counters, indexed by CLASS_COUNTER. */
+  void counters(uint64_t sums[COUNTER_COUNT]) {
+    pthread_mutex_lock(&lock);
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+      sums[c] = 0;
+      for (size_t t = 0; t < threads.size(); t++)
+        sums[c] += threads[t]->counters[c].load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  /** Sums of the opcode counts, indexed by opcode. */
+  void opcode_counts(uint64_t sums[256]) {
+    pthread_mutex_lock(&lock);
+    for (int op = 0; op < 256; op++) {
+      sums[op] = 0;
+      for (size_t t = 0; t < threads.size(); t++)
+        sums[op] += threads[t]->opcodes[op].load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  /** Locks a mutex, recording the wait in a phase. */
+  void lock_timed(pthread_mutex_t* mutex, int phase) {
+    uint64_t start = monotonic_nanos();
+    pthread_mutex_lock(mutex);
+    phase_done(phase, start);
+  }
+
+  /** Writes the phases as a JSON object: count, total and quantiles
+      in nanoseconds. */
+  void write_json(std::ostream& out) {
+    out << "{";
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      std::vector<uint64_t> buckets(LatencyHistogram::BUCKETS, 0);
+      uint64_t count = 0, total = 0, max = 0;
+      pthread_mutex_lock(&lock);
+      for (size_t t = 0; t < threads.size(); t++)
+        threads[t]->phases[p].merge_into(&buckets, &count, &total, &max);
+      pthread_mutex_unlock(&lock);
+      out << (p == 0 ? "\n" : ",\n") << "    \"" << hook_phase_name(p) << "\": { " <<
+        "\"count\": " << count << ", \"total_ns\": " << total <<
+        ", \"p50_ns\": " << quantile(buckets, count, 0.50) <<
+        ", \"p90_ns\": " << quantile(buckets, count, 0.90) <<
+        ", \"p99_ns\": " << quantile(buckets, count, 0.99) <<
+        ", \"max_ns\": " << max << " }";
+    }
+    out << "\n  }";
+  }
+};
+
+#endif
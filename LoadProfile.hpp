@@ -0,0 +1,368 @@
+/*
+ * Class-loading latency profile: where the time goes while classes
+ * are defined and linked, e.g. during startup.
+ *
+ * Every class seen by the class load hook is timestamped when the
+ * hook is called and when it returns, at its ClassLoad event (the
+ * class is created) and at its ClassPrepare event (it is linked):
+ *
+ *   define  from the end of the hook to ClassLoad: parsing the class
+ *           and loading its supertypes. The self define time leaves
+ *           out the classes loaded meanwhile on the same thread.
+ *   link    from ClassLoad to ClassPrepare. HotSpot links a class
+ *           lazily, so this includes the wait for its first use.
+ *   hook    the time of the agent itself, kept apart.
+ *
+ * The slowest loads are ranked by their self define and hook times,
+ * the time the load itself costs its thread: the link time, mostly
+ * idle on HotSpot, is shown but left out of the ranking.
+ *
+ * The hook and ClassLoad run on the defining thread, which defines
+ * the supertypes of a class while defining it: the classes in
+ * between are kept in a per-thread stack and matched innermost
+ * first. ClassPrepare may come from another thread, so loaded
+ * classes wait for it in a map by class tag.
+ *
+ * Captured classes also carry their capture context (loading stack
+ * and loader), from which the report takes the call site that
+ * triggered the load: the innermost frame outside the JDK.
+ */
+
+#ifndef LOAD_PROFILE_HPP
+#define LOAD_PROFILE_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ClassInventory.hpp"
+#include "EventLog.hpp"
+
+/** Timestamps (monotonic ns) and context of a class load. */
+struct ClassLoadTime {
+  /** Name given to the hook, "" for an unnamed class. */
+  std::string name;
+  int loader_id;
+  /** Class id of the capture (its event in out/events.bin), -1 if the
+      class was not captured. */
+  int64_t class_id;
+  uint32_t context_node;
+  int top_kind;
+  int stack_status;
+  int loader_status;
+  uint64_t hook_start;
+  uint64_t hook_end;
+  uint64_t loaded;
+  uint64_t prepared;
+  /** Time spent loading other classes on the thread while this one
+      was defined, hooks included. */
+  uint64_t nested;
+
+  uint64_t hook_ns() const { return hook_end - hook_start; }
+  uint64_t define_ns() const { return loaded - hook_end; }
+  uint64_t self_define_ns() const { return define_ns() > nested ? define_ns() - nested : 0; }
+  uint64_t link_ns() const { return prepared - loaded; }
+  /** Define-to-prepare latency. */
+  uint64_t latency_ns() const { return define_ns() + link_ns(); }
+  /** Time the load itself takes on its thread: self define and hook. */
+  uint64_t cost_ns() const { return self_define_ns() + hook_ns(); }
+};
+
+class LoadProfile {
+public:
+  struct Counters {
+    unsigned long completed;
+    unsigned long in_flight;
+    /** ClassLoad events without a hook call for their class. */
+    unsigned long unmatched;
+    /** Hook calls never followed by a ClassLoad (failed definitions). */
+    unsigned long abandoned;
+  };
+
+private:
+  /** Hook calls kept per thread; older ones are dropped as abandoned. */
+  static const size_t MAX_PENDING = 256;
+
+  pthread_mutex_t lock;
+  /** Loaded classes waiting for ClassPrepare, by class tag. */
+  std::unordered_map<int64_t, ClassLoadTime> in_flight;
+  std::vector<ClassLoadTime> completed;
+  std::atomic<unsigned long> unmatched;
+  std::atomic<unsigned long> abandoned;
+
+  /** The classes of this thread between the hook and ClassLoad,
+      innermost last. */
+  static std::vector<ClassLoadTime>& pending() {
+    static thread_local std::vector<ClassLoadTime> loads;
+    return loads;
+  }
+
+  void complete(ClassLoadTime&& load) {
+    pthread_mutex_lock(&lock);
+    completed.push_back(std::move(load));
+    pthread_mutex_unlock(&lock);
+  }
+
+  static bool is_jdk_class(const std::string& sig) {
+    const char* prefixes[] = { "Ljava/", "Ljavax/", "Ljdk/", "Lsun/", "Lcom/sun/" };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+      if (sig.compare(0, strlen(prefixes[i]), prefixes[i]) == 0)
+        return true;
+    return false;
+  }
+
+  /** The call site that triggered a load: the innermost frame of its
+      stack outside the JDK (else the innermost one), as
+      "<class>.<method><descriptor>@<bci>", or "-" without a stack. */
+  static std::string call_site(const ContextTree& tree, uint32_t node) {
+    std::vector<FrameContext> frames;
+    tree.frames(node, &frames);
+    if (frames.empty())
+      return "-";
+    const FrameContext* site = &frames[0];
+    for (size_t i = 0; i < frames.size(); i++)
+      if (!is_jdk_class(frames[i].declaring_class)) {
+        site = &frames[i];
+        break;
+      }
+    return site->declaring_class + "." + site->method_name + site->method_sig + "@" +
+      std::to_string(site->location);
+  }
+
+  static std::string package_of(const std::string& name) {
+    size_t slash = name.find_last_of('/');
+    return slash == std::string::npos ? "-" : name.substr(0, slash);
+  }
+
+  static const std::string& loader_name(const std::map<int, std::string>& loader_names, int id) {
+    static const std::string unknown("?");
+    auto it = loader_names.find(id);
+    return it == loader_names.end() ? unknown : it->second;
+  }
+
+  std::vector<ClassLoadTime> completed_loads() {
+    pthread_mutex_lock(&lock);
+    std::vector<ClassLoadTime> loads(completed);
+    pthread_mutex_unlock(&lock);
+    return loads;
+  }
+
+public:
+  LoadProfile() : unmatched(0), abandoned(0) {
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  /** The hook is called for a class (not a redefinition). */
+  void hooked(int loader_id, const char* name, uint64_t now) {
+    std::vector<ClassLoadTime>& loads = pending();
+    if (loads.size() >= MAX_PENDING) {
+      loads.erase(loads.begin());
+      abandoned++;
+    }
+    ClassLoadTime load = ClassLoadTime();
+    load.name = (name == NULL) ? "" : name;
+    load.loader_id = loader_id;
+    load.class_id = -1;
+    load.top_kind = TOP_NONE;
+    load.stack_status = STACK_SKIPPED;
+    load.loader_status = LOADER_OK;
+    load.hook_start = now;
+    load.hook_end = now;
+    loads.push_back(std::move(load));
+  }
+
+  /** The hook captured the class it was called for, with ctx. */
+  void captured(const ExecContext& ctx) {
+    std::vector<ClassLoadTime>& loads = pending();
+    if (loads.empty())
+      return;
+    ClassLoadTime& load = loads.back();
+    load.class_id = ctx.class_id;
+    load.context_node = ctx.context_node;
+    load.top_kind = ctx.top_kind;
+    load.stack_status = ctx.stack_status;
+    load.loader_status = ctx.loader_status;
+  }
+
+  /** The hook returns (after hooked()). */
+  void hook_returned(uint64_t now) {
+    std::vector<ClassLoadTime>& loads = pending();
+    if (!loads.empty())
+      loads.back().hook_end = now;
+  }
+
+  /** ClassLoad of a class, on its defining thread. tag is 0 if the
+      class could not be tagged: it is then taken as linked at once. */
+  void loaded(int64_t tag, int loader_id, std::string_view name, uint64_t now) {
+    std::vector<ClassLoadTime>& loads = pending();
+    std::string_view base = class_base_name(name);
+    size_t i = loads.size();
+    while (i-- > 0)
+      if (loads[i].loader_id == loader_id &&
+          (loads[i].name.empty() || class_base_name(loads[i].name) == base))
+        break;
+    if (i == (size_t)-1) {
+      unmatched++;
+      return;
+    }
+    // The classes hooked after this one and not loaded have failed.
+    abandoned += loads.size() - i - 1;
+    ClassLoadTime load = std::move(loads[i]);
+    loads.resize(i);
+    load.loaded = now;
+    if (!loads.empty())
+      loads.back().nested += now - load.hook_start;
+    if (tag == 0) {
+      load.prepared = now;
+      complete(std::move(load));
+      return;
+    }
+    pthread_mutex_lock(&lock);
+    in_flight[tag] = std::move(load);
+    pthread_mutex_unlock(&lock);
+  }
+
+  /** ClassPrepare of a class, on any thread. */
+  void prepared(int64_t tag, uint64_t now) {
+    pthread_mutex_lock(&lock);
+    auto it = in_flight.find(tag);
+    if (it != in_flight.end()) {
+      it->second.prepared = now;
+      completed.push_back(std::move(it->second));
+      in_flight.erase(it);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  /** A class was unloaded, maybe before being prepared. */
+  void unloaded(int64_t tag) {
+    pthread_mutex_lock(&lock);
+    in_flight.erase(tag);
+    pthread_mutex_unlock(&lock);
+  }
+
+  Counters get_counters() {
+    Counters c;
+    pthread_mutex_lock(&lock);
+    c.completed = completed.size();
+    c.in_flight = in_flight.size();
+    pthread_mutex_unlock(&lock);
+    c.unmatched = unmatched.load();
+    c.abandoned = abandoned.load();
+    return c;
+  }
+
+  /** Writes one row per class, in the order they were prepared, with
+      the start relative to origin and the times in microseconds. */
+  void write_times(std::ostream& out, uint64_t origin, const ContextTree& tree) {
+    std::vector<ClassLoadTime> loads = completed_loads();
+    std::unordered_map<uint32_t, std::string> sites;
+    out << "class\tloader\tstart_us\thook_us\tdefine_us\tself_define_us\tlink_us\tclass_id\tcall_site\n";
+    for (size_t i = 0; i < loads.size(); i++) {
+      const ClassLoadTime& l = loads[i];
+      auto site = sites.find(l.context_node);
+      if (site == sites.end())
+        site = sites.emplace(l.context_node, call_site(tree, l.context_node)).first;
+      out << (l.name.empty() ? "-" : l.name) << "\t" << l.loader_id << "\t" <<
+        (l.hook_start > origin ? l.hook_start - origin : 0) / 1000 << "\t" <<
+        l.hook_ns() / 1000 << "\t" << l.define_ns() / 1000 << "\t" <<
+        l.self_define_ns() / 1000 << "\t" << l.link_ns() / 1000 << "\t" << l.class_id << "\t" <<
+        site->second << "\n";
+    }
+  }
+
+  /** Writes the breakdown of the load times by package, by loader and
+      by call site, heaviest first in each: one "<by> TAB <key> TAB
+      <classes> TAB <self define us> TAB <link us> TAB <hook us> TAB
+      <max latency us>" row per key. The self define times add up to
+      the time spent defining classes. */
+  void write_breakdown(std::ostream& out, const ContextTree& tree,
+                       const std::map<int, std::string>& loader_names) {
+    struct Sum {
+      unsigned long classes;
+      uint64_t self_define, link, hook, max_latency;
+    };
+    std::vector<ClassLoadTime> loads = completed_loads();
+    std::map<std::string, Sum> by[3];
+    const char* by_names[3] = { "package", "loader", "call_site" };
+    std::unordered_map<uint32_t, std::string> sites;
+    for (size_t i = 0; i < loads.size(); i++) {
+      const ClassLoadTime& l = loads[i];
+      auto site = sites.find(l.context_node);
+      if (site == sites.end())
+        site = sites.emplace(l.context_node, call_site(tree, l.context_node)).first;
+      std::string keys[3] = { package_of(l.name),
+                              std::to_string(l.loader_id) + " " + loader_name(loader_names, l.loader_id),
+                              site->second };
+      for (int b = 0; b < 3; b++) {
+        Sum& s = by[b].emplace(keys[b], Sum()).first->second;
+        s.classes++;
+        s.self_define += l.self_define_ns();
+        s.link += l.link_ns();
+        s.hook += l.hook_ns();
+        s.max_latency = std::max(s.max_latency, l.latency_ns());
+      }
+    }
+    out << "by\tkey\tclasses\tself_define_us\tlink_us\thook_us\tmax_latency_us\n";
+    for (int b = 0; b < 3; b++) {
+      std::vector<std::pair<std::string, Sum> > rows(by[b].begin(), by[b].end());
+      std::sort(rows.begin(), rows.end(),
+                [](const std::pair<std::string, Sum>& x, const std::pair<std::string, Sum>& y) {
+                  return x.second.self_define + x.second.link > y.second.self_define + y.second.link;
+                });
+      for (size_t i = 0; i < rows.size(); i++) {
+        const Sum& s = rows[i].second;
+        out << by_names[b] << "\t" << rows[i].first << "\t" << s.classes << "\t" <<
+          s.self_define / 1000 << "\t" << s.link / 1000 << "\t" << s.hook / 1000 << "\t" <<
+          s.max_latency / 1000 << "\n";
+      }
+    }
+  }
+
+  /** Writes the n slowest loads (by self define and hook time), each
+      with its loading stack in the text format of the .info files. */
+  void write_slowest(std::ostream& out, size_t n, const ContextTree& tree,
+                     const std::map<int, std::string>& loader_names) {
+    std::vector<ClassLoadTime> loads = completed_loads();
+    n = std::min(n, loads.size());
+    std::partial_sort(loads.begin(), loads.begin() + n, loads.end(),
+                      [](const ClassLoadTime& x, const ClassLoadTime& y) {
+                        return x.cost_ns() > y.cost_ns();
+                      });
+    for (size_t i = 0; i < n; i++) {
+      const ClassLoadTime& l = loads[i];
+      out << "#" << (i + 1) << " " << l.loader_id << "/" << (l.name.empty() ? "-" : l.name) <<
+        ": " << l.cost_ns() / 1000 << " us (self define " << l.self_define_ns() / 1000 <<
+        ", hook " << l.hook_ns() / 1000 << "; define " << l.define_ns() / 1000 << ", link " <<
+        l.link_ns() / 1000 << ")";
+      if (l.class_id >= 0)
+        out << ", class id " << l.class_id;
+      out << std::endl;
+      if (l.class_id < 0) {
+        out << "[not captured, no stack]" << std::endl << std::endl;
+        continue;
+      }
+      ExecContext ctx;
+      ctx.class_name = l.name;
+      ctx.loader_hash = l.loader_id;
+      ctx.loader_status = l.loader_status;
+      ctx.loader_class = loader_name(loader_names, l.loader_id);
+      ctx.top_kind = l.top_kind;
+      ctx.stack_status = l.stack_status;
+      tree.frames(l.context_node, &ctx.frames);
+      format_exec_context(&out, ctx);
+      out << std::endl;
+    }
+  }
+};
+
+#endif
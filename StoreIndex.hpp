@@ -0,0 +1,205 @@
+/*
+ * Index of the objects of a content-addressed class store, shared by
+ * all the processes that capture into the store.
+ *
+ * The index is a fixed-size open-addressing hash table of 128-bit
+ * content hashes in a file of the store, mapped MAP_SHARED by every
+ * process, so that an object written by one JVM is not written again
+ * by the others. An object is only added once its file is in place,
+ * so the index never lists an object that a crashed or failed writer
+ * left missing; processes that look an object up while it is being
+ * written may write it too, which the renames make harmless.
+ * Insertion takes no lock: a slot is claimed with a
+ * compare-and-swap of its first word, then its second word is
+ * published. A reader that finds the first word of its hash waits
+ * (briefly) for the second one. Entries are never removed; when the
+ * table is nearly full, insertions fail and the callers fall back to
+ * checking the file system.
+ */
+
+#ifndef STORE_INDEX_HPP
+#define STORE_INDEX_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "ContentHash.hpp"
+
+/** Result of StoreIndex::insert() and lookup(). */
+enum INDEX_RESULT { INDEX_INSERTED, INDEX_PRESENT, INDEX_ABSENT, INDEX_FULL };
+
+class StoreIndex {
+  static const uint64_t MAGIC = 0x3178646e49534342ULL;  // "BCSIndx1"
+  /** Reads of a slot whose second word is not published yet before
+      giving up on it (its writer died between the two stores). */
+  static const int PUBLISH_SPINS = 1000;
+
+  struct Header {
+    uint64_t magic;
+    /** Number of slots, a power of 2. */
+    uint64_t capacity;
+    std::atomic<uint64_t> entries;
+    uint64_t reserved[5];
+  };
+  struct Slot {
+    /** 0 while the slot is free; the halves of a hash are never 0. */
+    std::atomic<uint64_t> h1;
+    std::atomic<uint64_t> h2;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "the index needs address-free 64-bit atomics");
+
+  Header* header;
+  Slot* slots;
+  size_t mapped_size;
+
+  static size_t file_size(uint64_t capacity) {
+    return sizeof(Header) + capacity * sizeof(Slot);
+  }
+
+  /** Creates the index file under a temporary name and links it into
+      place, so that a process never maps a file without a header. If
+      another process won the race, its file is kept. */
+  static bool create(const std::string& path, uint64_t capacity, std::string* error) {
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      *error = tmp_path + ": " + strerror(errno);
+      return false;
+    }
+    Header h;
+    memset((void*)&h, 0, sizeof(h));
+    h.magic = MAGIC;
+    h.capacity = capacity;
+    // The slots are left as a hole, read back as zeros.
+    bool ok = ftruncate(fd, file_size(capacity)) == 0 &&
+      pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    if (!ok)
+      *error = tmp_path + ": " + strerror(errno);
+    close(fd);
+    if (ok && link(tmp_path.c_str(), path.c_str()) != 0 && errno != EEXIST) {
+      *error = path + ": " + strerror(errno);
+      ok = false;
+    }
+    unlink(tmp_path.c_str());
+    return ok;
+  }
+
+public:
+  StoreIndex() : header(NULL), slots(NULL), mapped_size(0) { }
+
+  ~StoreIndex() { close_index(); }
+
+  /** Maps the index at path, creating it with the given number of
+      slots (rounded up to a power of 2) if it does not exist. An
+      existing index keeps its own capacity. */
+  bool open_index(const std::string& path, uint64_t capacity, std::string* error) {
+    uint64_t slot_count = 1024;
+    while (slot_count < capacity)
+      slot_count <<= 1;
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+      if (!create(path, slot_count, error))
+        return false;
+      fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    }
+    if (fd == -1) {
+      *error = path + ": " + strerror(errno);
+      return false;
+    }
+    struct stat st;
+    Header h;
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        h.magic != MAGIC || (h.capacity & (h.capacity - 1)) != 0 ||
+        (uint64_t)st.st_size < file_size(h.capacity)) {
+      *error = path + ": not an object index";
+      close(fd);
+      return false;
+    }
+    void* mem = mmap(NULL, file_size(h.capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+      *error = path + ": " + strerror(errno);
+      return false;
+    }
+    mapped_size = file_size(h.capacity);
+    header = (Header*)mem;
+    slots = (Slot*)((char*)mem + sizeof(Header));
+    return true;
+  }
+
+  void close_index() {
+    if (header != NULL)
+      munmap(header, mapped_size);
+    header = NULL;
+    slots = NULL;
+  }
+
+  bool is_open() const { return header != NULL; }
+
+  /** Looks a hash up. INDEX_PRESENT: the object is stored;
+      INDEX_ABSENT: not as far as the index knows; INDEX_FULL: the
+      index cannot tell. */
+  INDEX_RESULT lookup(const Hash128& hash) { return probe(hash, false); }
+
+  /** Adds the hash of an object once it is stored. INDEX_INSERTED:
+      this caller added it; INDEX_PRESENT: it was added before, by any
+      process; INDEX_FULL: the index has no room left. */
+  INDEX_RESULT insert(const Hash128& hash) { return probe(hash, true); }
+
+private:
+  INDEX_RESULT probe(const Hash128& hash, bool insert) {
+    if (header == NULL)
+      return INDEX_FULL;
+    uint64_t mask = header->capacity - 1;
+    // Keep 1/8 of the slots free, so that probe sequences stay short.
+    bool full = header->entries.load(std::memory_order_relaxed) >=
+      header->capacity - header->capacity / 8;
+    uint64_t k1 = hash.h1 != 0 ? hash.h1 : 1;
+    uint64_t k2 = hash.h2 != 0 ? hash.h2 : 1;
+    for (uint64_t probes = 0, i = k1 & mask; probes <= mask; probes++, i = (i + 1) & mask) {
+      Slot& slot = slots[i];
+      uint64_t h1 = slot.h1.load(std::memory_order_acquire);
+      if (h1 == 0) {
+        if (!insert)
+          return INDEX_ABSENT;
+        if (full)
+          return INDEX_FULL;
+        if (slot.h1.compare_exchange_strong(h1, k1, std::memory_order_acq_rel)) {
+          slot.h2.store(k2, std::memory_order_release);
+          header->entries.fetch_add(1, std::memory_order_relaxed);
+          return INDEX_INSERTED;
+        }
+        // Lost the slot; h1 is now the key of the winner.
+      }
+      if (h1 != k1)
+        continue;
+      uint64_t h2 = slot.h2.load(std::memory_order_acquire);
+      for (int spins = 0; h2 == 0 && spins < PUBLISH_SPINS; spins++) {
+        sched_yield();
+        h2 = slot.h2.load(std::memory_order_acquire);
+      }
+      if (h2 == k2)
+        return INDEX_PRESENT;
+    }
+    return INDEX_FULL;
+  }
+
+public:
+  uint64_t entries() const {
+    return header == NULL ? 0 : header->entries.load(std::memory_order_relaxed);
+  }
+
+  uint64_t capacity() const { return header == NULL ? 0 : header->capacity; }
+};
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Reader of ZIP/JAR archives, memory-mapped. Reads the central
+ * directory (including the ZIP64 end records written by ZipWriter for
+ * large archives) and gives access to the raw or inflated data of
+ * each entry.
+ *
+ * After open(), the reader is immutable, so several threads may read
+ * entries concurrently.
+ */
+
+#ifndef ZIP_READER_HPP
+#define ZIP_READER_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+class ZipReader {
+public:
+  struct Entry {
+    std::string name;
+    uint16_t method;
+    uint16_t dos_time;
+    uint16_t dos_date;
+    uint32_t crc;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t header_offset;
+  };
+
+private:
+  const unsigned char* map;
+  size_t map_size;
+  std::vector<Entry> entries;
+  std::string error;
+
+  uint16_t get16(uint64_t off) const { return map[off] | (map[off + 1] << 8); }
+  uint32_t get32(uint64_t off) const { return get16(off) | ((uint32_t)get16(off + 2) << 16); }
+  uint64_t get64(uint64_t off) const { return get32(off) | ((uint64_t)get32(off + 4) << 32); }
+
+  bool fail(const std::string& message) {
+    error = message;
+    return false;
+  }
+
+  bool read_central_directory() {
+    // The end record is in the last 64KB + 22 bytes (comment).
+    if (map_size < 22)
+      return fail("not a ZIP file");
+    uint64_t end = 0;
+    bool found = false;
+    uint64_t lowest = (map_size > 65557) ? map_size - 65557 : 0;
+    for (uint64_t off = map_size - 22; ; off--) {
+      if (get32(off) == 0x06054b50) {
+        end = off;
+        found = true;
+        break;
+      }
+      if (off == lowest)
+        break;
+    }
+    if (!found)
+      return fail("no end of central directory record");
+    uint64_t count = get16(end + 10);
+    uint64_t cd_size = get32(end + 12);
+    uint64_t cd_offset = get32(end + 16);
+    if ((count == 0xffff || cd_offset == 0xffffffff) && end >= 20 &&
+        get32(end - 20) == 0x07064b50) {
+      uint64_t zip64_end = get64(end - 20 + 8);
+      if (zip64_end + 56 > map_size || get32(zip64_end) != 0x06064b50)
+        return fail("bad ZIP64 end record");
+      count = get64(zip64_end + 32);
+      cd_size = get64(zip64_end + 40);
+      cd_offset = get64(zip64_end + 48);
+    }
+    if (cd_offset + cd_size > map_size)
+      return fail("central directory out of bounds");
+
+    uint64_t off = cd_offset;
+    entries.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+      if (off + 46 > map_size || get32(off) != 0x02014b50)
+        return fail("bad central directory entry");
+      Entry e;
+      e.method = get16(off + 10);
+      e.dos_time = get16(off + 12);
+      e.dos_date = get16(off + 14);
+      e.crc = get32(off + 16);
+      e.compressed_size = get32(off + 20);
+      e.size = get32(off + 24);
+      uint16_t name_len = get16(off + 28);
+      uint16_t extra_len = get16(off + 30);
+      uint16_t comment_len = get16(off + 32);
+      e.header_offset = get32(off + 42);
+      if (off + 46 + name_len + extra_len + comment_len > map_size)
+        return fail("bad central directory entry");
+      e.name.assign((const char*)map + off + 46, name_len);
+      // ZIP64 extended information: the fields set to 0xffffffff, in order.
+      for (uint64_t x = off + 46 + name_len; x + 4 <= off + 46 + name_len + extra_len; ) {
+        uint16_t id = get16(x), len = get16(x + 2);
+        if (id == 0x0001) {
+          uint64_t f = x + 4;
+          if (e.size == 0xffffffff && f + 8 <= x + 4 + len) { e.size = get64(f); f += 8; }
+          if (e.compressed_size == 0xffffffff && f + 8 <= x + 4 + len) { e.compressed_size = get64(f); f += 8; }
+          if (e.header_offset == 0xffffffff && f + 8 <= x + 4 + len) { e.header_offset = get64(f); f += 8; }
+        }
+        x += 4 + len;
+      }
+      entries.push_back(e);
+      off += 46 + name_len + extra_len + comment_len;
+    }
+    return true;
+  }
+
+public:
+  ZipReader() : map(NULL), map_size(0) { }
+  ZipReader(const ZipReader&) = delete;
+  ZipReader& operator=(const ZipReader&) = delete;
+
+  ~ZipReader() {
+    if (map != NULL)
+      munmap((void*)map, map_size);
+  }
+
+  /** Maps an archive and reads its central directory. */
+  bool open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return fail("cannot open " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return fail("cannot read " + path);
+    }
+    map_size = st.st_size;
+    void* m = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED)
+      return fail("cannot map " + path + ": " + strerror(errno));
+    map = (const unsigned char*)m;
+    return read_central_directory();
+  }
+
+  const std::string& get_error() const { return error; }
+  const std::vector<Entry>& get_entries() const { return entries; }
+
+  /** The entry's data as stored (compressed with e.method), pointing
+      into the mapping. Returns NULL if the local header is bad. */
+  const unsigned char* raw_data(const Entry& e) const {
+    uint64_t off = e.header_offset;
+    if (off + 30 > map_size || get32(off) != 0x04034b50)
+      return NULL;
+    uint64_t data = off + 30 + get16(off + 26) + get16(off + 28);
+    if (data + e.compressed_size > map_size)
+      return NULL;
+    return map + data;
+  }
+
+  /** Reads an entry, inflating it if needed. */
+  bool read(const Entry& e, std::vector<unsigned char>* out) const {
+    const unsigned char* raw = raw_data(e);
+    if (raw == NULL)
+      return false;
+    if (e.method == 0) {
+      out->assign(raw, raw + e.compressed_size);
+      return true;
+    }
+    if (e.method != 8)
+      return false;
+    out->resize(e.size);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+      return false;
+    zs.next_in = (Bytef*)raw;
+    zs.avail_in = e.compressed_size;
+    zs.next_out = out->data();
+    zs.avail_out = out->size();
+    int rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END && zs.total_out == e.size;
+  }
+};
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * Streaming ZIP/JAR writer used by the agent to save captured classes
+ * directly into archives.
+ *
+ * Entries are written as soon as they are added (local header
+ * followed by the data); only the central directory records are kept
+ * in memory and written by close(). ZIP64 end records are emitted
+ * when the archive has more than 65535 entries or grows past 4GB.
+ */
+
+#ifndef ZIP_WRITER_HPP
+#define ZIP_WRITER_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+/** Compression methods, as stored in the ZIP headers. */
+enum ZIP_METHOD { ZIP_STORED = 0, ZIP_DEFLATED = 8 };
+
+class ZipWriter {
+public:
+  /** Central directory information of a written entry. */
+  struct Entry {
+    std::string name;
+    uint16_t method;
+    uint16_t dos_time;
+    uint16_t dos_date;
+    uint32_t crc;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t offset;
+  };
+
+private:
+  FILE* file;
+  uint64_t offset;
+  std::vector<Entry> entries;
+  uint16_t dos_time;
+  uint16_t dos_date;
+
+  void put16(std::vector<unsigned char>& buf, uint16_t v) {
+    buf.push_back(v & 0xff);
+    buf.push_back((v >> 8) & 0xff);
+  }
+
+  void put32(std::vector<unsigned char>& buf, uint32_t v) {
+    put16(buf, v & 0xffff);
+    put16(buf, (v >> 16) & 0xffff);
+  }
+
+  void put64(std::vector<unsigned char>& buf, uint64_t v) {
+    put32(buf, v & 0xffffffff);
+    put32(buf, (v >> 32) & 0xffffffff);
+  }
+
+  bool emit(const void* data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, file) != len)
+      return false;
+    offset += len;
+    return true;
+  }
+
+  bool emit(const std::vector<unsigned char>& buf) {
+    return emit(buf.data(), buf.size());
+  }
+
+public:
+  ZipWriter() : file(NULL), offset(0) {
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+    dos_time = (t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec / 2);
+    dos_date = ((t.tm_year - 80) << 9) | ((t.tm_mon + 1) << 5) | t.tm_mday;
+  }
+
+  ~ZipWriter() {
+    if (file != NULL)
+      close();
+  }
+
+  /** Creates (truncates) the archive file. Returns false on error.
+      A closed writer can be opened again, for a new archive. */
+  bool open(const std::string& path) {
+    file = fopen(path.c_str(), "wb");
+    offset = 0;
+    entries.clear();
+    return file != NULL;
+  }
+
+  bool is_open() const { return file != NULL; }
+
+  const std::vector<Entry>& get_entries() const { return entries; }
+
+  /** Compresses data with raw deflate into out. Returns false if zlib
+      fails, in which case the caller should store the entry. */
+  static bool deflate_data(const unsigned char* data, size_t len,
+                           std::vector<unsigned char>& out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    out.resize(deflateBound(&zs, len));
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+  }
+
+  /** Appends an entry whose data is already in its final (possibly
+      compressed) form. Used to copy entries between archives without
+      recompressing them. */
+  bool add_raw(const std::string& name, uint16_t method, uint32_t crc,
+               uint64_t size, const unsigned char* data, uint64_t compressed_size,
+               uint16_t time = 0, uint16_t date = 0) {
+    if (file == NULL)
+      return false;
+    Entry e;
+    e.name = name;
+    e.method = method;
+    e.dos_time = (time == 0 && date == 0) ? dos_time : time;
+    e.dos_date = (time == 0 && date == 0) ? dos_date : date;
+    e.crc = crc;
+    e.compressed_size = compressed_size;
+    e.size = size;
+    e.offset = offset;
+
+    std::vector<unsigned char> hdr;
+    put32(hdr, 0x04034b50);
+    put16(hdr, 20);                    // version needed to extract
+    put16(hdr, 0x0800);                // flags: UTF-8 names
+    put16(hdr, e.method);
+    put16(hdr, e.dos_time);
+    put16(hdr, e.dos_date);
+    put32(hdr, e.crc);
+    put32(hdr, (uint32_t)e.compressed_size);
+    put32(hdr, (uint32_t)e.size);
+    put16(hdr, e.name.size());
+    put16(hdr, 0);                     // extra field length
+    if (!emit(hdr) || !emit(e.name.data(), e.name.size()) ||
+        !emit(data, compressed_size))
+      return false;
+    entries.push_back(e);
+    return true;
+  }
+
+  /** Appends an entry, compressing it with the given method. */
+  bool add(const std::string& name, const unsigned char* data, size_t len,
+           ZIP_METHOD method) {
+    uint32_t crc = crc32(crc32(0L, Z_NULL, 0), data, len);
+    if (method == ZIP_DEFLATED) {
+      std::vector<unsigned char> compressed;
+      if (deflate_data(data, len, compressed) && compressed.size() < len)
+        return add_raw(name, ZIP_DEFLATED, crc, len, compressed.data(), compressed.size());
+    }
+    return add_raw(name, ZIP_STORED, crc, len, data, len);
+  }
+
+  /** Writes the central directory and closes the archive. */
+  bool close() {
+    if (file == NULL)
+      return false;
+    bool ok = true;
+    uint64_t cd_offset = offset;
+    bool zip64 = entries.size() >= 0xffff;
+    for (size_t i = 0; i < entries.size(); i++) {
+      const Entry& e = entries[i];
+      bool big_offset = e.offset >= 0xffffffff;
+      zip64 = zip64 || big_offset;
+      std::vector<unsigned char> hdr;
+      put32(hdr, 0x02014b50);
+      put16(hdr, big_offset ? 45 : 20);  // version made by
+      put16(hdr, big_offset ? 45 : 20);  // version needed to extract
+      put16(hdr, 0x0800);
+      put16(hdr, e.method);
+      put16(hdr, e.dos_time);
+      put16(hdr, e.dos_date);
+      put32(hdr, e.crc);
+      put32(hdr, (uint32_t)e.compressed_size);
+      put32(hdr, (uint32_t)e.size);
+      put16(hdr, e.name.size());
+      put16(hdr, big_offset ? 12 : 0);   // extra field length
+      put16(hdr, 0);                     // comment length
+      put16(hdr, 0);                     // disk number
+      put16(hdr, 0);                     // internal attributes
+      put32(hdr, 0);                     // external attributes
+      put32(hdr, big_offset ? 0xffffffff : (uint32_t)e.offset);
+      ok = ok && emit(hdr) && emit(e.name.data(), e.name.size());
+      if (big_offset) {
+        std::vector<unsigned char> extra;
+        put16(extra, 0x0001);            // ZIP64 extended information
+        put16(extra, 8);
+        put64(extra, e.offset);
+        ok = ok && emit(extra);
+      }
+    }
+    uint64_t cd_size = offset - cd_offset;
+    zip64 = zip64 || cd_offset >= 0xffffffff;
+
+    std::vector<unsigned char> end;
+    if (zip64) {
+      uint64_t zip64_end_offset = offset;
+      put32(end, 0x06064b50);
+      put64(end, 44);                    // size of the remaining record
+      put16(end, 45);
+      put16(end, 45);
+      put32(end, 0);
+      put32(end, 0);
+      put64(end, entries.size());
+      put64(end, entries.size());
+      put64(end, cd_size);
+      put64(end, cd_offset);
+      put32(end, 0x07064b50);            // ZIP64 end locator
+      put32(end, 0);
+      put64(end, zip64_end_offset);
+      put32(end, 1);
+    }
+    put32(end, 0x06054b50);
+    put16(end, 0);
+    put16(end, 0);
+    put16(end, zip64 ? 0xffff : entries.size());
+    put16(end, zip64 ? 0xffff : entries.size());
+    put32(end, zip64 ? 0xffffffff : (uint32_t)cd_size);
+    put32(end, zip64 ? 0xffffffff : (uint32_t)cd_offset);
+    put16(end, 0);                       // comment length
+    ok = ok && emit(end);
+    ok = (fclose(file) == 0) && ok;
+    file = NULL;
+    return ok;
+  }
+};
+
+#endif
@@ -0,0 +1,592 @@
+/*
+ * Overhead benchmark of the agent over dacapo-bach workloads.
+ *
+ * Every workload is run N times in each configuration: without the
+ * agent ("none"), with the agent in each capture mode, and with the
+ * agent attached but every class filtered out ("filtered"). The runs
+ * are interleaved round by round, so that a drift of the machine is
+ * spread over all the configurations, and every run gets a fresh
+ * directory (the agent writes out/ and DaCapo scratch/ in the current
+ * directory).
+ *
+ * Usage: ./bench-dacapo [--runs N] [--iterations I] [--java PATH]
+ *                       [--jvm-options "OPTS"] [--dacapo JAR] [--agent SO]
+ *                       [--mode NAME=AGENT_OPTIONS]... [--out DIR]
+ *                       [--baseline SUMMARY.csv] [--threshold P] [--keep]
+ *                       WORKLOAD...
+ *
+ *   --iterations I : DaCapo iterations per run (-n I); the last one is
+ *                    the measured iteration (default: 3).
+ *   --mode         : a capture mode, e.g. --mode jar=output=jar,writers=2.
+ *                    Default: dirs, jar and loader-jars.
+ *   --out DIR      : where the runs and the report go (default:
+ *                    bench-dacapo-out).
+ *   --baseline F   : compares the medians with the summary.csv of an
+ *                    earlier report; exits with 3 if a time or the peak
+ *                    RSS grew by more than --threshold percent (default: 5).
+ *   --keep         : keeps the output directory of every run.
+ *
+ * For every run it records the startup time (until DaCapo starts its
+ * first iteration), the time of the measured iteration, the wall
+ * time, the peak RSS of the JVM, the classes captured (from
+ * out/stats.json) and the bytes written under out/. DIR/runs.csv has
+ * the runs; DIR/summary.csv has, per workload and configuration, the
+ * medians and the overhead against "none"; DIR/report.json has both,
+ * with the environment of the runs.
+ */
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** A configuration: no agent (agent == false) or the agent with
+    these options. */
+struct Config {
+  string name;
+  bool agent;
+  string options;
+};
+
+enum METRIC { STARTUP_MS, ITERATION_MS, WALL_MS, PEAK_RSS_KB, CLASSES_CAPTURED, BYTES_WRITTEN,
+              METRIC_COUNT };
+
+const char* metric_name(int metric) {
+  switch (metric) {
+  case STARTUP_MS       : return "startup_ms";
+  case ITERATION_MS     : return "iteration_ms";
+  case WALL_MS          : return "wall_ms";
+  case PEAK_RSS_KB      : return "peak_rss_kb";
+  case CLASSES_CAPTURED : return "classes_captured";
+  case BYTES_WRITTEN    : return "bytes_written";
+  default               : return "?";
+  }
+}
+
+/** The metrics compared against "none" and against the baseline. */
+bool is_cost_metric(int metric) {
+  return metric == STARTUP_MS || metric == ITERATION_MS || metric == WALL_MS ||
+    metric == PEAK_RSS_KB;
+}
+
+struct Run {
+  string workload;
+  const Config* config;
+  int round;
+  bool ok;
+  string error;
+  double metrics[METRIC_COUNT];
+};
+
+uint64_t monotonic_millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+string absolute_path(const string& path) {
+  if (path.empty() || path[0] == '/')
+    return path;
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    return path;
+  return string(cwd) + "/" + path;
+}
+
+vector<string> split(const string& s, char sep) {
+  vector<string> parts;
+  istringstream in(s);
+  string part;
+  while (getline(in, part, sep))
+    if (!part.empty())
+      parts.push_back(part);
+  return parts;
+}
+
+static uint64_t walked_bytes;
+static set<pair<dev_t, ino_t> > walked_inodes;
+
+/** Counts a file once, as the store links the class files. */
+int count_file(const char*, const struct stat* st, int type, struct FTW*) {
+  if (type == FTW_F && walked_inodes.insert(make_pair(st->st_dev, st->st_ino)).second)
+    walked_bytes += st->st_size;
+  return 0;
+}
+
+int remove_file(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+/** The value of a numeric key of a JSON file, e.g. "defined" in
+    out/stats.json; -1 if it is missing. */
+double json_number(const string& json, const string& key) {
+  size_t pos = json.find("\"" + key + "\":");
+  if (pos == string::npos)
+    return -1;
+  return strtod(json.c_str() + pos + key.size() + 3, NULL);
+}
+
+/** The "<n>" of "... in <n> msec" in a DaCapo line, -1 if none. */
+double dacapo_msec(const string& line) {
+  size_t in = line.rfind(" in ");
+  size_t msec = line.rfind(" msec");
+  if (in == string::npos || msec == string::npos || msec < in)
+    return -1;
+  return atof(line.substr(in + 4, msec - in - 4).c_str());
+}
+
+/** Runs one JVM in run_dir, with its output in run_dir/output.txt. */
+void run_jvm(const vector<string>& args, const string& run_dir, Run* run) {
+  int out_pipe[2];
+  if (pipe(out_pipe) != 0) {
+    run->error = "pipe failed";
+    return;
+  }
+  uint64_t start = monotonic_millis();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(out_pipe[0]);
+    dup2(out_pipe[1], 1);
+    dup2(out_pipe[1], 2);
+    close(out_pipe[1]);
+    if (chdir(run_dir.c_str()) != 0)
+      _exit(126);
+    vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++)
+      argv.push_back((char*)args[i].c_str());
+    argv.push_back(NULL);
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+  close(out_pipe[1]);
+  if (pid == -1) {
+    close(out_pipe[0]);
+    run->error = "fork failed";
+    return;
+  }
+
+  // DaCapo reports its iterations as lines like
+  // "===== DaCapo 9.12 h2 completed warmup 1 in 2345 msec =====" and
+  // "===== DaCapo 9.12 h2 PASSED in 1234 msec =====".
+  ofstream log(run_dir + "/output.txt");
+  FILE* out = fdopen(out_pipe[0], "r");
+  char buf[4096];
+  string line;
+  bool passed = false, failed = false;
+  while (fgets(buf, sizeof(buf), out) != NULL) {
+    line += buf;
+    if (line.empty() || line[line.size() - 1] != '\n')
+      continue;
+    log << line;
+    if (line.compare(0, 12, "===== DaCapo") == 0) {
+      if (line.find(" starting") != string::npos && run->metrics[STARTUP_MS] < 0)
+        run->metrics[STARTUP_MS] = monotonic_millis() - start;
+      else if (line.find(" PASSED in ") != string::npos) {
+        passed = true;
+        run->metrics[ITERATION_MS] = dacapo_msec(line);
+      } else if (line.find(" FAILED") != string::npos)
+        failed = true;
+    }
+    line.clear();
+  }
+  log << line;
+  fclose(out);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) == -1) {
+    run->error = "wait failed";
+    return;
+  }
+  run->metrics[WALL_MS] = monotonic_millis() - start;
+  run->metrics[PEAK_RSS_KB] = usage.ru_maxrss;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    run->error = WIFEXITED(status) ? "exit status " + to_string(WEXITSTATUS(status)) :
+      "killed by signal " + to_string(WTERMSIG(status));
+  else if (failed || !passed)
+    run->error = "no PASSED line";
+  else
+    run->ok = true;
+}
+
+/** Reads the classes captured and the bytes written by the agent. */
+void measure_output(const string& run_dir, Run* run) {
+  ifstream stats(run_dir + "/out/stats.json");
+  if (stats) {
+    string json((istreambuf_iterator<char>(stats)), istreambuf_iterator<char>());
+    double defined = json_number(json, "defined"), ignored = json_number(json, "ignored");
+    double sampled_out = json_number(json, "sampled_out");
+    double dropped = json_number(json, "dropped");
+    if (defined >= 0 && ignored >= 0)
+      run->metrics[CLASSES_CAPTURED] = defined - ignored - max(0.0, sampled_out) - max(0.0, dropped);
+  }
+  walked_bytes = 0;
+  walked_inodes.clear();
+  string out_dir = run_dir + "/out";
+  struct stat st;
+  if (stat(out_dir.c_str(), &st) == 0)
+    nftw(out_dir.c_str(), count_file, 64, FTW_PHYS);
+  run->metrics[BYTES_WRITTEN] = walked_bytes;
+}
+
+double median(vector<double> values) {
+  if (values.empty())
+    return -1;
+  sort(values.begin(), values.end());
+  size_t n = values.size();
+  return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/** Medians of the successful runs of a workload and configuration. */
+struct Summary {
+  string workload;
+  string config;
+  int runs;
+  double median[METRIC_COUNT];
+  double overhead[METRIC_COUNT];  // % against "none", -1000 if unknown
+  double baseline[METRIC_COUNT];  // median of the baseline, -1 if none
+};
+
+const double UNKNOWN_OVERHEAD = -1000;
+
+string format_number(double v, int precision = 1) {
+  ostringstream s;
+  s << fixed << setprecision(v == (long long)v ? 0 : precision) << v;
+  return s.str();
+}
+
+/** A metric, or the given placeholder if it was not measured. */
+string format_metric(double v, const char* missing) {
+  return v < 0 ? missing : format_number(v);
+}
+
+/** Reads the medians of an earlier summary.csv, by "workload,config". */
+bool read_baseline(const string& file, map<string, vector<double> >* baseline) {
+  ifstream in(file);
+  if (!in)
+    return false;
+  string line;
+  if (!getline(in, line))
+    return false;
+  vector<string> header;
+  istringstream header_in(line);
+  string column;
+  while (getline(header_in, column, ','))
+    header.push_back(column);
+  while (getline(in, line)) {
+    vector<string> fields;
+    istringstream fields_in(line);
+    while (getline(fields_in, column, ','))
+      fields.push_back(column);
+    if (fields.size() < 2)
+      continue;
+    vector<double> medians(METRIC_COUNT, -1);
+    for (size_t i = 2; i < fields.size() && i < header.size(); i++)
+      for (int m = 0; m < METRIC_COUNT; m++)
+        if (header[i] == metric_name(m))
+          medians[m] = fields[i].empty() ? -1 : atof(fields[i].c_str());
+    (*baseline)[fields[0] + "," + fields[1]] = medians;
+  }
+  return true;
+}
+
+string java_version(const string& java) {
+  string command = java + " -version 2>&1";
+  FILE* p = popen(command.c_str(), "r");
+  if (p == NULL)
+    return "";
+  char buf[256];
+  string version;
+  if (fgets(buf, sizeof(buf), p) != NULL)
+    version = buf;
+  pclose(p);
+  while (!version.empty() && (version.back() == '\n' || version.back() == '\r'))
+    version.pop_back();
+  return version;
+}
+
+string json_string(const string& s) {
+  string out = "\"";
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\')
+      out += '\\';
+    if ((unsigned char)s[i] >= 0x20)
+      out += s[i];
+  }
+  return out + "\"";
+}
+
+int main(int argc, char** argv) {
+  int runs = 5, iterations = 3;
+  double threshold = 5;
+  bool keep = false, bad_usage = false;
+  string java = "java", jvm_options, dacapo = "dacapo-bach/dacapo-9.12-bach.jar";
+  string agent = "./libBytecodeCapture.so", out_dir = "bench-dacapo-out", baseline_file;
+  vector<Config> modes;
+  vector<string> workloads;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--runs" && has_value)
+      runs = atoi(argv[++i]);
+    else if (arg == "--iterations" && has_value)
+      iterations = atoi(argv[++i]);
+    else if (arg == "--java" && has_value)
+      java = argv[++i];
+    else if (arg == "--jvm-options" && has_value)
+      jvm_options = argv[++i];
+    else if (arg == "--dacapo" && has_value)
+      dacapo = argv[++i];
+    else if (arg == "--agent" && has_value)
+      agent = argv[++i];
+    else if (arg == "--mode" && has_value) {
+      string mode = argv[++i];
+      size_t eq = mode.find('=');
+      if (eq == string::npos || eq == 0)
+        bad_usage = true;
+      else
+        modes.push_back(Config{ mode.substr(0, eq), true, mode.substr(eq + 1) });
+    } else if (arg == "--out" && has_value)
+      out_dir = argv[++i];
+    else if (arg == "--baseline" && has_value)
+      baseline_file = argv[++i];
+    else if (arg == "--threshold" && has_value)
+      threshold = atof(argv[++i]);
+    else if (arg == "--keep")
+      keep = true;
+    else if (arg.compare(0, 2, "--") == 0)
+      bad_usage = true;
+    else
+      workloads.push_back(arg);
+  }
+  if (bad_usage || workloads.empty() || runs < 1 || iterations < 1) {
+    cerr << "Usage: ./bench-dacapo [--runs N] [--iterations I] [--java PATH]" << endl <<
+      "                      [--jvm-options \"OPTS\"] [--dacapo JAR] [--agent SO]" << endl <<
+      "                      [--mode NAME=AGENT_OPTIONS]... [--out DIR]" << endl <<
+      "                      [--baseline SUMMARY.csv] [--threshold P] [--keep]" << endl <<
+      "                      WORKLOAD..." << endl;
+    return 1;
+  }
+  if (modes.empty()) {
+    modes.push_back(Config{ "dirs", true, "output=dirs" });
+    modes.push_back(Config{ "jar", true, "output=jar,writers=2" });
+    modes.push_back(Config{ "loader-jars", true, "output=loader-jars,writers=2" });
+  }
+  vector<Config> configs;
+  configs.push_back(Config{ "none", false, "" });
+  configs.insert(configs.end(), modes.begin(), modes.end());
+  // The hook is called for every class, and returns after the filter.
+  configs.push_back(Config{ "filtered", true, "exclude=**" });
+
+  map<string, vector<double> > baseline;
+  if (!baseline_file.empty() && !read_baseline(baseline_file, &baseline)) {
+    cerr << "Could not read the baseline " << baseline_file << endl;
+    return 1;
+  }
+  dacapo = absolute_path(dacapo);
+  agent = absolute_path(agent);
+  mkdir(out_dir.c_str(), 0755);
+  vector<string> jvm_args = split(jvm_options, ' ');
+
+  // Round-robin: every round runs every workload in every configuration.
+  vector<Run> results;
+  for (int round = 1; round <= runs; round++)
+    for (size_t w = 0; w < workloads.size(); w++)
+      for (size_t c = 0; c < configs.size(); c++) {
+        Run run;
+        run.workload = workloads[w];
+        run.config = &configs[c];
+        run.round = round;
+        run.ok = false;
+        for (int m = 0; m < METRIC_COUNT; m++)
+          run.metrics[m] = -1;
+        string run_dir = out_dir + "/" + run.workload + "-" + run.config->name + "-" + to_string(round);
+        nftw(run_dir.c_str(), remove_file, 64, FTW_DEPTH | FTW_PHYS);
+        mkdir(run_dir.c_str(), 0755);
+
+        vector<string> args;
+        args.push_back(java);
+        args.insert(args.end(), jvm_args.begin(), jvm_args.end());
+        if (run.config->agent)
+          args.push_back("-agentpath:" + agent +
+                         (run.config->options.empty() ? "" : "=" + run.config->options));
+        args.push_back("-jar");
+        args.push_back(dacapo);
+        args.push_back("-n");
+        args.push_back(to_string(iterations));
+        args.push_back(run.workload);
+        run_jvm(args, run_dir, &run);
+        if (run.config->agent)
+          measure_output(run_dir, &run);
+
+        cerr << "[" << round << "/" << runs << "] " << run.workload << " " << run.config->name << ": ";
+        if (run.ok)
+          cerr << "iteration " << format_number(run.metrics[ITERATION_MS]) << " ms, startup " <<
+            format_number(run.metrics[STARTUP_MS]) << " ms, peak RSS " <<
+            format_number(run.metrics[PEAK_RSS_KB] / 1024) << " MB" << endl;
+        else
+          cerr << "failed (" << run.error << "), see " << run_dir << "/output.txt" << endl;
+        if (run.ok && !keep)
+          nftw(run_dir.c_str(), remove_file, 64, FTW_DEPTH | FTW_PHYS);
+        results.push_back(run);
+      }
+
+  // Medians per workload and configuration, and overheads against "none".
+  vector<Summary> summaries;
+  for (size_t w = 0; w < workloads.size(); w++) {
+    size_t first = summaries.size();
+    for (size_t c = 0; c < configs.size(); c++) {
+      Summary s;
+      s.workload = workloads[w];
+      s.config = configs[c].name;
+      s.runs = 0;
+      for (int m = 0; m < METRIC_COUNT; m++) {
+        vector<double> values;
+        for (size_t r = 0; r < results.size(); r++)
+          if (results[r].ok && results[r].workload == s.workload && results[r].config == &configs[c] &&
+              results[r].metrics[m] >= 0)
+            values.push_back(results[r].metrics[m]);
+        s.median[m] = median(values);
+        s.baseline[m] = -1;
+        s.overhead[m] = UNKNOWN_OVERHEAD;
+      }
+      for (size_t r = 0; r < results.size(); r++)
+        if (results[r].ok && results[r].workload == s.workload && results[r].config == &configs[c])
+          s.runs++;
+      auto b = baseline.find(s.workload + "," + s.config);
+      if (b != baseline.end())
+        for (int m = 0; m < METRIC_COUNT; m++)
+          s.baseline[m] = b->second[m];
+      summaries.push_back(s);
+    }
+    const Summary& none = summaries[first];
+    for (size_t i = first; i < summaries.size(); i++)
+      for (int m = 0; m < METRIC_COUNT; m++)
+        if (is_cost_metric(m) && none.median[m] > 0 && summaries[i].median[m] >= 0)
+          summaries[i].overhead[m] = (summaries[i].median[m] - none.median[m]) * 100 / none.median[m];
+  }
+
+  // Runs and summary as CSV.
+  ofstream runs_csv(out_dir + "/runs.csv");
+  runs_csv << "workload,config,agent_options,round,ok";
+  for (int m = 0; m < METRIC_COUNT; m++)
+    runs_csv << "," << metric_name(m);
+  runs_csv << endl;
+  for (size_t r = 0; r < results.size(); r++) {
+    const Run& run = results[r];
+    runs_csv << run.workload << "," << run.config->name << ",\"" << run.config->options << "\"," <<
+      run.round << "," << (run.ok ? 1 : 0);
+    for (int m = 0; m < METRIC_COUNT; m++)
+      runs_csv << "," << format_metric(run.metrics[m], "");
+    runs_csv << endl;
+  }
+  ofstream summary_csv(out_dir + "/summary.csv");
+  summary_csv << "workload,config,runs";
+  for (int m = 0; m < METRIC_COUNT; m++)
+    summary_csv << "," << metric_name(m);
+  for (int m = 0; m < METRIC_COUNT; m++)
+    if (is_cost_metric(m))
+      summary_csv << "," << metric_name(m) << "_overhead_pct";
+  summary_csv << endl;
+  for (size_t i = 0; i < summaries.size(); i++) {
+    const Summary& s = summaries[i];
+    summary_csv << s.workload << "," << s.config << "," << s.runs;
+    for (int m = 0; m < METRIC_COUNT; m++)
+      summary_csv << "," << format_metric(s.median[m], "");
+    for (int m = 0; m < METRIC_COUNT; m++)
+      if (is_cost_metric(m))
+        summary_csv << "," << (s.overhead[m] == UNKNOWN_OVERHEAD ? "" : format_number(s.overhead[m], 2));
+    summary_csv << endl;
+  }
+
+  // The same, with the environment, as JSON.
+  struct utsname uts;
+  uname(&uts);
+  ofstream json(out_dir + "/report.json");
+  json << "{" << endl;
+  json << "  \"environment\": { \"java\": " << json_string(java_version(java)) <<
+    ", \"jvm_options\": " << json_string(jvm_options) << ", \"dacapo\": " << json_string(dacapo) <<
+    ", \"iterations\": " << iterations << ", \"runs\": " << runs <<
+    ", \"cpus\": " << sysconf(_SC_NPROCESSORS_ONLN) <<
+    ", \"kernel\": " << json_string(string(uts.sysname) + " " + uts.release) << " }," << endl;
+  json << "  \"runs\": [";
+  for (size_t r = 0; r < results.size(); r++) {
+    const Run& run = results[r];
+    json << (r == 0 ? "\n" : ",\n") << "    { \"workload\": " << json_string(run.workload) <<
+      ", \"config\": " << json_string(run.config->name) <<
+      ", \"agent_options\": " << json_string(run.config->options) <<
+      ", \"round\": " << run.round << ", \"ok\": " << (run.ok ? "true" : "false");
+    if (!run.ok)
+      json << ", \"error\": " << json_string(run.error);
+    for (int m = 0; m < METRIC_COUNT; m++)
+      json << ", \"" << metric_name(m) << "\": " << format_metric(run.metrics[m], "null");
+    json << " }";
+  }
+  json << "\n  ]," << endl;
+  json << "  \"summary\": [";
+  for (size_t i = 0; i < summaries.size(); i++) {
+    const Summary& s = summaries[i];
+    json << (i == 0 ? "\n" : ",\n") << "    { \"workload\": " << json_string(s.workload) <<
+      ", \"config\": " << json_string(s.config) << ", \"runs\": " << s.runs;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+      json << ", \"" << metric_name(m) << "\": " << format_metric(s.median[m], "null");
+      if (s.overhead[m] != UNKNOWN_OVERHEAD)
+        json << ", \"" << metric_name(m) << "_overhead_pct\": " << format_number(s.overhead[m], 2);
+      if (s.baseline[m] >= 0)
+        json << ", \"" << metric_name(m) << "_baseline\": " << format_number(s.baseline[m]);
+    }
+    json << " }";
+  }
+  json << "\n  ]" << endl << "}" << endl;
+
+  // Table of the medians, with the changes against the baseline.
+  int regressions = 0;
+  cout << left << setw(12) << "workload" << setw(14) << "config" << right;
+  for (int m = 0; m < METRIC_COUNT; m++)
+    cout << setw(18) << metric_name(m);
+  cout << endl;
+  for (size_t i = 0; i < summaries.size(); i++) {
+    const Summary& s = summaries[i];
+    cout << left << setw(12) << s.workload << setw(14) << s.config << right;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+      string cell = format_metric(s.median[m], "-");
+      if (s.overhead[m] != UNKNOWN_OVERHEAD && s.config != "none")
+        cell += " (" + string(s.overhead[m] >= 0 ? "+" : "") + format_number(s.overhead[m], 1) + "%)";
+      cout << setw(18) << cell;
+    }
+    cout << endl;
+    for (int m = 0; m < METRIC_COUNT; m++)
+      if (is_cost_metric(m) && s.baseline[m] > 0 && s.median[m] >= 0) {
+        double change = (s.median[m] - s.baseline[m]) * 100 / s.baseline[m];
+        if (change > threshold) {
+          cout << "  regression: " << metric_name(m) << " " << format_number(s.baseline[m]) <<
+            " -> " << format_number(s.median[m]) << " (+" << format_number(change, 1) << "%)" << endl;
+          regressions++;
+        }
+      }
+  }
+  cout << "Report: " << out_dir << "/report.json, " << out_dir << "/summary.csv, " <<
+    out_dir << "/runs.csv" << endl;
+  if (!baseline.empty())
+    cout << regressions << " regression(s) over " << threshold << "% against " << baseline_file << endl;
+  return regressions > 0 ? 3 : 0;
+}
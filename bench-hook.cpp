@@ -0,0 +1,679 @@
+/*
+ * Offline benchmark of the agent's class load hook, without a JVM.
+ *
+ * The agent is linked against stub jvmtiEnv/JNIEnv/JavaVM function
+ * tables that return synthetic stacks, method names, line tables,
+ * bytecodes and loaders. A stream of class loads (synthetic, or
+ * replayed from the output tree of an earlier capture) is fed to
+ * ClassFileLoadHook from N threads, and the throughput, the hook
+ * latency percentiles and the bytes written are reported.
+ *
+ * Usage: ./bench-hook [--classes N] [--threads T] [--depth D] [--seed S]
+ *                     [--replay FILE] [--redefine P] [--unload P] [--keep DIR]
+ *                     [--verbose] [--options AGENT_OPTIONS]
+ *
+ *   --replay FILE : replays the class loads listed in FILE, one
+ *                   "<loaderHash>/<class>.class <size>" line each, as
+ *                   printed by: cd out && find [0-9]* -name '*.class' -printf '%p %s\n'
+ *   --redefine P  : redefines this share of the classes once after
+ *                   loading them, with 32 changed bytes.
+ *   --unload P    : unloads this share of the classes after preparing
+ *                   them (with inventory=on or profile=on).
+ *   --keep DIR    : runs in DIR and keeps the agent output there
+ *                   (default: a temporary directory, removed at exit).
+ *   --verbose     : keeps the per-class messages of the agent.
+ */
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "libBytecodeCapture.cpp"
+
+#include <set>
+
+/** Synthetic class load. A NULL name is an anonymous class. */
+struct ClassLoadSpec {
+  string name;
+  bool anonymous;
+  int loader;
+  jint size;
+};
+
+/* == Stub JVM == */
+
+/** Fake Java object, for the classes and loaders the stubs hand out. */
+struct FakeObject {
+  atomic<jlong> tag;
+  string sig;
+  FakeObject* klass;
+  /** Defining loader of a class, NULL for the bootstrap loader. */
+  FakeObject* loader = NULL;
+};
+
+#define METHOD_POOL 5000
+#define CLASS_POOL 500
+/** Loading stacks share their outer frames (thread entry points,
+    frameworks, the class loader chain): they are taken from one of
+    ENTRY_STACKS stacks, and only the innermost LOCAL_FRAMES vary. */
+#define ENTRY_STACKS 64
+#define LOCAL_FRAMES 4
+#define LINES_PER_METHOD 16
+#define CODE_SIZE 256
+
+static vector<FakeObject*> declaring_classes;
+static vector<FakeObject*> fake_loaders;
+static FakeObject loader_class_object;
+static unsigned char method_code[CODE_SIZE];
+static int stack_frames = 30;
+static vector<vector<jvmtiFrameInfo> > entry_stacks;
+
+/** Share of the classes that are redefined after loading. */
+static double redefine_share = 0;
+/** Share of the prepared classes that are unloaded. */
+static double unload_share = 0;
+
+/** Stack of the class being loaded by the current thread. */
+static thread_local vector<jvmtiFrameInfo>* current_stack = NULL;
+static thread_local int bench_thread_id = 0;
+
+jmethodID method_of(int i) { return (jmethodID)(uintptr_t)((i + 1) * 8); }
+int method_index(jmethodID m) { return (int)((uintptr_t)m / 8) - 1; }
+
+char* jvm_string(const string& s) {
+  char* p = (char*)malloc(s.size() + 1);
+  memcpy(p, s.c_str(), s.size() + 1);
+  return p;
+}
+
+jvmtiError JNICALL stub_GetStackTrace(jvmtiEnv*, jthread, jint start_depth, jint max_frame_count,
+                                      jvmtiFrameInfo* frame_buffer, jint* count_ptr) {
+  jint n = 0;
+  for (jint i = start_depth; i < (jint)current_stack->size() && n < max_frame_count; i++)
+    frame_buffer[n++] = (*current_stack)[i];
+  *count_ptr = n;
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetMethodName(jvmtiEnv*, jmethodID method, char** name_ptr,
+                                      char** signature_ptr, char** generic_ptr) {
+  int i = method_index(method);
+  string name = (i == 0) ? "defineClass1" : (i == 1) ? "defineAnonymousClass" : "m" + to_string(i);
+  if (name_ptr)
+    *name_ptr = jvm_string(name);
+  if (signature_ptr)
+    *signature_ptr = jvm_string("(Ljava/lang/String;I)V");
+  // Every method has a generic signature, so that the agent
+  // classifies the top frames.
+  if (generic_ptr)
+    *generic_ptr = jvm_string("<T:Ljava/lang/Object;>(Ljava/lang/String;I)V");
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetMethodDeclaringClass(jvmtiEnv*, jmethodID method, jclass* klass) {
+  *klass = (jclass)declaring_classes[method_index(method) % CLASS_POOL];
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetClassSignature(jvmtiEnv*, jclass klass, char** sig, char** generic) {
+  *sig = jvm_string(((FakeObject*)klass)->sig);
+  if (generic)
+    *generic = NULL;
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetClassLoader(jvmtiEnv*, jclass klass, jobject* loader) {
+  *loader = (jobject)((FakeObject*)klass)->loader;
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetClassStatus(jvmtiEnv*, jclass, jint* status) {
+  *status = JVMTI_CLASS_STATUS_VERIFIED | JVMTI_CLASS_STATUS_PREPARED | JVMTI_CLASS_STATUS_INITIALIZED;
+  return JVMTI_ERROR_NONE;
+}
+
+/** Field and method counts follow the length of the class name. */
+jvmtiError JNICALL stub_GetClassFields(jvmtiEnv*, jclass klass, jint* count, jfieldID** fields) {
+  *count = ((FakeObject*)klass)->sig.size() % 7;
+  *fields = (jfieldID*)malloc(*count * sizeof(jfieldID) + 1);
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetClassMethods(jvmtiEnv*, jclass klass, jint* count, jmethodID** methods) {
+  *count = 1 + ((FakeObject*)klass)->sig.size() % 13;
+  *methods = (jmethodID*)malloc(*count * sizeof(jmethodID));
+  return JVMTI_ERROR_NONE;
+}
+
+/** The classes loaded before the agent are the declaring classes. */
+jvmtiError JNICALL stub_GetLoadedClasses(jvmtiEnv*, jint* count, jclass** classes) {
+  *count = declaring_classes.size();
+  *classes = (jclass*)malloc(declaring_classes.size() * sizeof(jclass));
+  for (size_t i = 0; i < declaring_classes.size(); i++)
+    (*classes)[i] = (jclass)declaring_classes[i];
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetLineNumberTable(jvmtiEnv*, jmethodID method, jint* count,
+                                           jvmtiLineNumberEntry** table) {
+  jvmtiLineNumberEntry* t = (jvmtiLineNumberEntry*)malloc(LINES_PER_METHOD * sizeof(jvmtiLineNumberEntry));
+  for (int i = 0; i < LINES_PER_METHOD; i++) {
+    t[i].start_location = i * (CODE_SIZE / LINES_PER_METHOD);
+    t[i].line_number = 10 + method_index(method) % 100 + i;
+  }
+  *count = LINES_PER_METHOD;
+  *table = t;
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetBytecodes(jvmtiEnv*, jmethodID, jint* count, unsigned char** code) {
+  *count = CODE_SIZE;
+  *code = (unsigned char*)malloc(CODE_SIZE);
+  memcpy(*code, method_code, CODE_SIZE);
+  return JVMTI_ERROR_NONE;
+}
+
+/** A constant pool with a method reference (#6) to org/bench/Target.run()V
+    and its class (#2), the operands of all the call sites. */
+static const unsigned char constant_pool[] = {
+  1, 0, 16, 'o', 'r', 'g', '/', 'b', 'e', 'n', 'c', 'h', '/', 'T', 'a', 'r', 'g', 'e', 't',
+  7, 0, 1,
+  1, 0, 3, 'r', 'u', 'n',
+  1, 0, 3, '(', ')', 'V',
+  12, 0, 3, 0, 4,
+  10, 0, 2, 0, 5
+};
+
+jvmtiError JNICALL stub_GetConstantPool(jvmtiEnv*, jclass, jint* count, jint* byte_count,
+                                        unsigned char** bytes) {
+  *count = 7;
+  *byte_count = sizeof(constant_pool);
+  *bytes = (unsigned char*)malloc(sizeof(constant_pool));
+  memcpy(*bytes, constant_pool, sizeof(constant_pool));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetJLocationFormat(jvmtiEnv*, jvmtiJlocationFormat* format) {
+  *format = JVMTI_JLOCATION_JVMBCI;
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetThreadInfo(jvmtiEnv*, jthread, jvmtiThreadInfo* info) {
+  memset(info, 0, sizeof(*info));
+  info->name = jvm_string("bench-" + to_string(bench_thread_id));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_Deallocate(jvmtiEnv*, unsigned char* mem) {
+  free(mem);
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetTag(jvmtiEnv*, jobject object, jlong* tag) {
+  *tag = ((FakeObject*)object)->tag.load();
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_SetTag(jvmtiEnv*, jobject object, jlong tag) {
+  ((FakeObject*)object)->tag.store(tag);
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_SetEventCallbacks(jvmtiEnv*, const jvmtiEventCallbacks*, jint) {
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_SetEventNotificationMode(jvmtiEnv*, jvmtiEventMode, jvmtiEvent, jthread, ...) {
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_AddCapabilities(jvmtiEnv*, const jvmtiCapabilities*) {
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL stub_GetPhase(jvmtiEnv*, jvmtiPhase* phase) {
+  *phase = JVMTI_PHASE_LIVE;
+  return JVMTI_ERROR_NONE;
+}
+
+jclass JNICALL stub_GetObjectClass(JNIEnv*, jobject object) {
+  return (jclass)((FakeObject*)object)->klass;
+}
+
+void JNICALL stub_DeleteLocalRef(JNIEnv*, jobject) { }
+
+static jvmtiInterface_1_ stub_jvmti_functions;
+static _jvmtiEnv stub_jvmti;
+static JNINativeInterface_ stub_jni_functions;
+static JNIEnv_ stub_jni;
+static JNIInvokeInterface_ stub_vm_functions;
+static JavaVM_ stub_vm;
+
+jint JNICALL stub_GetEnv(JavaVM*, void** penv, jint version) {
+  if (version == JNI_VERSION_1_6)
+    *penv = &stub_jni;
+  else
+    *penv = &stub_jvmti;
+  return JNI_OK;
+}
+
+jint JNICALL stub_AttachCurrentThread(JavaVM*, void** penv, void*) {
+  *penv = &stub_jni;
+  return JNI_OK;
+}
+
+jint JNICALL stub_DetachCurrentThread(JavaVM*) {
+  return JNI_OK;
+}
+
+void init_stub_jvm() {
+  stub_jvmti_functions.GetStackTrace = stub_GetStackTrace;
+  stub_jvmti_functions.GetMethodName = stub_GetMethodName;
+  stub_jvmti_functions.GetMethodDeclaringClass = stub_GetMethodDeclaringClass;
+  stub_jvmti_functions.GetClassSignature = stub_GetClassSignature;
+  stub_jvmti_functions.GetLineNumberTable = stub_GetLineNumberTable;
+  stub_jvmti_functions.GetBytecodes = stub_GetBytecodes;
+  stub_jvmti_functions.GetConstantPool = stub_GetConstantPool;
+  stub_jvmti_functions.GetJLocationFormat = stub_GetJLocationFormat;
+  stub_jvmti_functions.GetThreadInfo = stub_GetThreadInfo;
+  stub_jvmti_functions.Deallocate = stub_Deallocate;
+  stub_jvmti_functions.GetTag = stub_GetTag;
+  stub_jvmti_functions.SetTag = stub_SetTag;
+  stub_jvmti_functions.SetEventCallbacks = stub_SetEventCallbacks;
+  stub_jvmti_functions.SetEventNotificationMode = stub_SetEventNotificationMode;
+  stub_jvmti_functions.AddCapabilities = stub_AddCapabilities;
+  stub_jvmti_functions.GetPhase = stub_GetPhase;
+  stub_jvmti_functions.GetClassLoader = stub_GetClassLoader;
+  stub_jvmti_functions.GetClassStatus = stub_GetClassStatus;
+  stub_jvmti_functions.GetClassFields = stub_GetClassFields;
+  stub_jvmti_functions.GetClassMethods = stub_GetClassMethods;
+  stub_jvmti_functions.GetLoadedClasses = stub_GetLoadedClasses;
+  stub_jvmti.functions = &stub_jvmti_functions;
+  stub_jni_functions.GetObjectClass = stub_GetObjectClass;
+  stub_jni_functions.DeleteLocalRef = stub_DeleteLocalRef;
+  stub_jni.functions = &stub_jni_functions;
+  stub_vm_functions.GetEnv = stub_GetEnv;
+  stub_vm_functions.AttachCurrentThreadAsDaemon = stub_AttachCurrentThread;
+  stub_vm_functions.DetachCurrentThread = stub_DetachCurrentThread;
+  stub_vm.functions = &stub_vm_functions;
+
+  for (int i = 0; i < CLASS_POOL; i++) {
+    FakeObject* c = new FakeObject;
+    c->tag = 0;
+    c->sig = "Lorg/bench/lib" + to_string(i % 37) + "/Declaring" + to_string(i) + ";";
+    c->klass = NULL;
+    declaring_classes.push_back(c);
+  }
+  loader_class_object.tag = 0;
+  loader_class_object.sig = "Lorg/bench/BenchClassLoader;";
+  // Call sites: invokevirtual, invokestatic, new, getstatic, ...
+  const unsigned char call_sites[] = { 182, 184, 187, 178, 183, 185, 192, 189 };
+  for (int i = 0; i + 3 <= CODE_SIZE; i += 3) {
+    unsigned char op = call_sites[(i / 3) % sizeof(call_sites)];
+    method_code[i] = op;
+    method_code[i + 1] = 0;
+    method_code[i + 2] = (op == 187 || op == 192 || op == 189) ? 2 : 6;
+  }
+}
+
+/** Creates the loaders 1..count before the benchmark threads start. */
+void init_fake_loaders(int count) {
+  while ((int)fake_loaders.size() < count) {
+    FakeObject* l = new FakeObject;
+    l->tag = 0;
+    l->klass = &loader_class_object;
+    fake_loaders.push_back(l);
+  }
+}
+
+FakeObject* fake_loader(int loader) {
+  return (loader == 0) ? NULL : fake_loaders[loader - 1];
+}
+
+/* == Class load streams == */
+
+/** xorshift64*: fast and deterministic for a given seed. */
+struct Random {
+  uint64_t state;
+  explicit Random(uint64_t seed) : state(seed * 2685821657736338717ULL + 1) { }
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+  }
+  double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+  double normal() {
+    double u1 = uniform() + 1e-12, u2 = uniform();
+    return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+  }
+};
+
+/** Creates the shared outer parts of the loading stacks. */
+void init_entry_stacks(uint64_t seed) {
+  Random rnd(seed);
+  entry_stacks.resize(ENTRY_STACKS);
+  for (int e = 0; e < ENTRY_STACKS; e++) {
+    entry_stacks[e].resize(stack_frames);
+    for (int f = 0; f < stack_frames; f++) {
+      entry_stacks[e][f].method = method_of(2 + rnd.next() % (METHOD_POOL - 2));
+      entry_stacks[e][f].location = (rnd.next() % (CODE_SIZE / 3)) * 3;
+    }
+  }
+}
+
+/** Synthetic stream: a quarter of JDK classes (bootstrap loader),
+    application packages picked with a Zipf distribution, a few
+    anonymous classes, and log-normal class sizes (median 1.8KB). */
+vector<ClassLoadSpec> synthetic_stream(unsigned long n, uint64_t seed) {
+  Random rnd(seed);
+  const int packages = 400;
+  vector<double> zipf(packages);
+  double sum = 0;
+  for (int i = 0; i < packages; i++)
+    sum += (zipf[i] = 1.0 / pow(i + 1, 1.1));
+  for (int i = 0; i < packages; i++)
+    zipf[i] = (i == 0 ? 0 : zipf[i - 1]) + zipf[i] / sum;
+  const char* jdk_packages[] = { "java/lang/", "java/util/", "java/util/concurrent/",
+                                 "sun/reflect/", "jdk/internal/misc/", "javax/xml/parsers/" };
+
+  vector<ClassLoadSpec> stream;
+  for (unsigned long i = 0; i < n; i++) {
+    ClassLoadSpec c;
+    c.anonymous = false;
+    c.size = (jint)min(262144.0, max(200.0, 1800 * exp(rnd.normal())));
+    double kind = rnd.uniform();
+    if (kind < 0.25) {
+      c.loader = 0;
+      c.name = string(jdk_packages[rnd.next() % 6]) + "JdkClass" + to_string(i);
+    } else if (kind < 0.27) {
+      c.loader = 1;
+      c.anonymous = true;
+    } else {
+      int p = lower_bound(zipf.begin(), zipf.end(), rnd.uniform()) - zipf.begin();
+      c.loader = 1 + p % 4;
+      c.name = "org/bench/m" + to_string(p % 23) + "/p" + to_string(p) + "/Class" + to_string(i);
+    }
+    stream.push_back(c);
+  }
+  return stream;
+}
+
+/** Replays the output tree of a capture: "<loaderHash>/<class>.class <size>". */
+bool replay_stream(const string& file, vector<ClassLoadSpec>* stream) {
+  ifstream in(file);
+  if (!in)
+    return false;
+  string path;
+  long size;
+  map<string, int> loader_ids;
+  while (in >> path >> size) {
+    size_t slash = path.find('/');
+    if (slash == string::npos || path.size() < slash + 7)
+      continue;
+    string loader = path.substr(0, slash);
+    ClassLoadSpec c;
+    c.name = path.substr(slash + 1, path.size() - slash - 7);
+    c.anonymous = (c.name.compare(0, 19, "AnonGeneratedClass_") == 0);
+    c.size = (jint)size;
+    if (loader == "0")
+      c.loader = 0;
+    else {
+      int id = loader_ids.size() + 1;
+      c.loader = loader_ids.insert(make_pair(loader, id)).first->second;
+    }
+    stream->push_back(c);
+  }
+  return true;
+}
+
+/* == Benchmark == */
+
+struct BenchThread {
+  pthread_t thread;
+  int id;
+  const vector<ClassLoadSpec>* stream;
+  atomic<unsigned long>* next;
+  uint64_t seed;
+  vector<uint64_t> latencies;
+};
+
+void* bench_loop(void* arg) {
+  BenchThread* t = (BenchThread*)arg;
+  bench_thread_id = t->id;
+  Random rnd(t->seed);
+  vector<unsigned char> data;
+  vector<jvmtiFrameInfo> stack;
+  current_stack = &stack;
+  vector<FakeObject*> prepared;
+  JNIEnv* env = &stub_jni;
+  for (unsigned long i; (i = (*t->next)++) < t->stream->size(); ) {
+    const ClassLoadSpec& c = (*t->stream)[i];
+    // Class bytes: a class file header and per-class content.
+    data.resize(c.size);
+    Random content(i + 1);
+    for (jint b = 0; b < c.size; b += 8) {
+      uint64_t word = content.next();
+      memcpy(&data[b], &word, min(8, c.size - b));
+    }
+    if (c.size >= 4) {
+      data[0] = 0xca; data[1] = 0xfe; data[2] = 0xba; data[3] = 0xbe;
+    }
+    // Loading stack: defineClass1 for most classes, else a lazy load
+    // from application code.
+    stack.resize(stack_frames);
+    const vector<jvmtiFrameInfo>& entry = entry_stacks[rnd.next() % ENTRY_STACKS];
+    for (int f = 0; f < stack_frames; f++) {
+      if (f >= LOCAL_FRAMES) {
+        stack[f] = entry[f];
+        continue;
+      }
+      stack[f].method = method_of(2 + rnd.next() % (METHOD_POOL - 2));
+      stack[f].location = (rnd.next() % (CODE_SIZE / 3)) * 3;
+    }
+    if (stack_frames > 0) {
+      double top = rnd.uniform();
+      if (c.anonymous)
+        stack[0].method = method_of(1);
+      else if (top < 0.7)
+        stack[0].method = method_of(0);
+      if (stack[0].method == method_of(0) || stack[0].method == method_of(1))
+        stack[0].location = -1;
+    }
+
+    uint64_t start = monotonic_nanos();
+    callbacks.ClassFileLoadHook(&stub_jvmti, env, NULL, (jobject)fake_loader(c.loader),
+                                c.anonymous ? NULL : c.name.c_str(), NULL,
+                                c.size, data.data(), NULL, NULL);
+    t->latencies.push_back(monotonic_nanos() - start);
+
+    if (callbacks.ClassPrepare != NULL) {
+      FakeObject* k = new FakeObject;
+      k->tag = 0;
+      k->sig = "L" + (c.anonymous ? "org/bench/Anon$$Lambda$" + to_string(i) + "/" + to_string(i * 31)
+                                  : c.name) + ";";
+      k->klass = NULL;
+      k->loader = fake_loader(c.loader);
+      if (callbacks.ClassLoad != NULL)
+        callbacks.ClassLoad(&stub_jvmti, env, NULL, (jclass)k);
+      callbacks.ClassPrepare(&stub_jvmti, env, NULL, (jclass)k);
+      if (rnd.uniform() < unload_share)
+        callbacks.ObjectFree(&stub_jvmti, k->tag.load());
+      prepared.push_back(k);
+    }
+
+    if (!c.anonymous && c.size > 64 && rnd.uniform() < redefine_share) {
+      jint changed = 4 + rnd.next() % (c.size - 36);
+      for (jint b = changed; b < changed + 32; b++)
+        data[b] ^= 0x5a;
+      start = monotonic_nanos();
+      callbacks.ClassFileLoadHook(&stub_jvmti, env, (jclass)declaring_classes[0],
+                                  (jobject)fake_loader(c.loader), c.name.c_str(), NULL,
+                                  c.size, data.data(), NULL, NULL);
+      t->latencies.push_back(monotonic_nanos() - start);
+    }
+  }
+  for (size_t i = 0; i < prepared.size(); i++)
+    delete prepared[i];
+  return NULL;
+}
+
+static uint64_t walked_bytes;
+static set<pair<dev_t, ino_t> > walked_inodes;
+
+int count_file(const char*, const struct stat* st, int type, struct FTW*) {
+  if (type == FTW_F && walked_inodes.insert(make_pair(st->st_dev, st->st_ino)).second)
+    walked_bytes += st->st_size;
+  return 0;
+}
+
+int remove_file(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+uint64_t percentile(const vector<uint64_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+int main(int argc, char** argv) {
+  unsigned long class_count = 20000;
+  int thread_count = 4;
+  uint64_t seed = 42;
+  string replay_file, keep_dir, agent_options;
+  bool verbose = false;
+  bool bad_usage = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--classes" && has_value)
+      class_count = strtoul(argv[++i], NULL, 10);
+    else if (arg == "--threads" && has_value)
+      thread_count = atoi(argv[++i]);
+    else if (arg == "--depth" && has_value)
+      stack_frames = atoi(argv[++i]);
+    else if (arg == "--seed" && has_value)
+      seed = strtoull(argv[++i], NULL, 10);
+    else if (arg == "--replay" && has_value)
+      replay_file = argv[++i];
+    else if (arg == "--redefine" && has_value)
+      redefine_share = atof(argv[++i]);
+    else if (arg == "--unload" && has_value)
+      unload_share = atof(argv[++i]);
+    else if (arg == "--keep" && has_value)
+      keep_dir = argv[++i];
+    else if (arg == "--options" && has_value)
+      agent_options = argv[++i];
+    else if (arg == "--verbose")
+      verbose = true;
+    else
+      bad_usage = true;
+  }
+  if (bad_usage || thread_count < 1 || stack_frames < 0) {
+    cerr << "Usage: ./bench-hook [--classes N] [--threads T] [--depth D] [--seed S]" << endl <<
+      "                    [--replay FILE] [--redefine P] [--unload P] [--keep DIR]" << endl <<
+      "                    [--verbose] [--options AGENT_OPTIONS]" << endl;
+    return -1;
+  }
+
+  vector<ClassLoadSpec> stream;
+  if (replay_file.empty())
+    stream = synthetic_stream(class_count, seed);
+  else if (!replay_stream(replay_file, &stream)) {
+    cerr << "Could not read " << replay_file << endl;
+    return -2;
+  }
+  uint64_t bytes_in = 0;
+  int loader_count = 0;
+  for (size_t i = 0; i < stream.size(); i++) {
+    bytes_in += stream[i].size;
+    loader_count = max(loader_count, stream[i].loader);
+  }
+
+  char tmp_dir[] = "/tmp/bench-hook-XXXXXX";
+  string run_dir = keep_dir;
+  if (run_dir.empty())
+    run_dir = mkdtemp(tmp_dir) ? tmp_dir : "";
+  else
+    mkdir(run_dir.c_str(), 0755);
+  if (run_dir.empty() || chdir(run_dir.c_str()) != 0) {
+    cerr << "Could not use directory " << run_dir << endl;
+    return -3;
+  }
+  mkdir("out", 0755);
+
+  // The agent prints a line per class to stdout.
+  int saved_stdout = dup(1);
+  if (!verbose) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    close(null_fd);
+  }
+
+  init_stub_jvm();
+  init_entry_stacks(seed);
+  init_fake_loaders(loader_count);
+  vector<char> options(agent_options.begin(), agent_options.end());
+  options.push_back(0);
+  if (Agent_OnLoad(&stub_vm, agent_options.empty() ? NULL : options.data(), NULL) != JNI_OK) {
+    cerr << "Agent_OnLoad failed." << endl;
+    return -4;
+  }
+
+  atomic<unsigned long> next(0);
+  vector<BenchThread> threads(thread_count);
+  uint64_t start = monotonic_nanos();
+  for (int i = 0; i < thread_count; i++) {
+    threads[i].id = i;
+    threads[i].stream = &stream;
+    threads[i].next = &next;
+    threads[i].seed = seed + i + 1;
+    pthread_create(&threads[i].thread, NULL, bench_loop, &threads[i]);
+  }
+  for (int i = 0; i < thread_count; i++)
+    pthread_join(threads[i].thread, NULL);
+  uint64_t hooks_done = monotonic_nanos();
+  Agent_OnUnload(&stub_vm);
+  uint64_t unloaded = monotonic_nanos();
+
+  cout.flush();
+  fflush(stdout);
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+
+  vector<uint64_t> latencies;
+  for (int i = 0; i < thread_count; i++)
+    latencies.insert(latencies.end(), threads[i].latencies.begin(), threads[i].latencies.end());
+  sort(latencies.begin(), latencies.end());
+  // The output directory of the agent (out=) and its store (store=),
+  // which may be elsewhere or behind a symbolic link.
+  nftw(TOP_OUT_DIR.c_str(), count_file, 64, FTW_PHYS);
+  if (!STORE_DIR.empty())
+    nftw(STORE_DIR.c_str(), count_file, 64, FTW_PHYS);
+
+  double hook_secs = (hooks_done - start) / 1e9;
+  double total_secs = (unloaded - start) / 1e9;
+  cout << fixed << setprecision(1);
+  cout << "== bench-hook: " << stream.size() << " classes (" << bytes_in / 1e6 << " MB), " <<
+    thread_count << " threads, " << stack_frames << " frames, options \"" <<
+    agent_options << "\"" << endl;
+  cout << "Hook phase:    " << hook_secs * 1000 << " ms, " <<
+    stream.size() / hook_secs << " classes/s, " << bytes_in / 1e6 / hook_secs << " MB/s" << endl;
+  cout << "With unload:   " << total_secs * 1000 << " ms, " <<
+    stream.size() / total_secs << " classes/s" << endl;
+  cout << "Hook latency:  p50 " << percentile(latencies, 0.50) / 1e3 << " us, p99 " <<
+    percentile(latencies, 0.99) / 1e3 << " us, max " <<
+    (latencies.empty() ? 0 : latencies.back() / 1e3) << " us" << endl;
+  cout << "Bytes written: " << walked_bytes / 1e6 << " MB in " << walked_inodes.size() <<
+    " files under " <<
+    (TOP_OUT_DIR[0] == '/' ? TOP_OUT_DIR : run_dir + "/" + TOP_OUT_DIR);
+  if (!STORE_DIR.empty() && STORE_DIR != TOP_OUT_DIR + "/objects")
+    cout << " and " << STORE_DIR;
+  cout << endl;
+
+  if (keep_dir.empty())
+    nftw(run_dir.c_str(), remove_file, 64, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
@@ -5,17 +5,28 @@
 AGENT_NAME=libBytecodeCapture
 MANIFEST=dacapo-bach/tradebeans-skeleton/META-INF/MANIFEST.MF
 
+# Classes captured by all the runs so far, per benchmark. Every run
+# only writes the classes missing there, then merges them in.
+CAPTURES=captures
+
 function generateJar {
     echo Generating JAR with loaded classes for $1
     rm -rf out scratch
-    java -agentpath:./${AGENT_NAME}.so -jar dacapo-bach/dacapo-9.12-bach.jar $1 |& tee loaded-$1.txt
+    java -agentpath:./${AGENT_NAME}.so=base=${CAPTURES}/$1 -jar dacapo-bach/dacapo-9.12-bach.jar $1 |& tee loaded-$1.txt
+    ./merge-captures.sh ${CAPTURES}/$1 out
     # delete cglib code that crashes Soot
-    find out -name "*CGLIB\$\$*" -exec rm {} \;
+    find ${CAPTURES}/$1 -name "*CGLIB\$\$*" -not -path "*/objects/*" -exec rm {} \;
     # make jar_$1
     CAPTURE_JAR=$1-loaded-classes.jar
-    jar cfm ${CAPTURE_JAR} ${MANIFEST} -C out .
+    # only the per-loader class directories, not the store and manifests
+    LOADER_DIRS=""
+    for d in ${CAPTURES}/$1/[0-9]*/
+    do
+        LOADER_DIRS="${LOADER_DIRS} -C ${CAPTURES}/$1 $(basename ${d})"
+    done
+    jar cfm ${CAPTURE_JAR} ${MANIFEST} ${LOADER_DIRS}
     echo Finished capture [$1].
-    ./fuse-jars.sh ${HOME}/doop-benchmarks/dacapo-bach/$1.jar ${CAPTURE_JAR} $1-fused.jar
+    ./fuse-jars ${HOME}/doop-benchmarks/dacapo-bach/$1.jar ${CAPTURE_JAR} $1-fused.jar
     echo Finished fusion.
 }
 
@@ -23,7 +34,7 @@ function capture {
     generateJar ${1}
     echo Finished capture [${1}].
     FUSED_JAR="${1}-fused.jar"
-    ./fuse-jars.sh ${HOME}/doop-benchmarks/dacapo-bach/${1}.jar ${1}-loaded-classes.jar ${FUSED_JAR}
+    ./fuse-jars ${HOME}/doop-benchmarks/dacapo-bach/${1}.jar ${1}-loaded-classes.jar ${FUSED_JAR}
     echo Finished fusion: ${FUSED_JAR}
 }
 
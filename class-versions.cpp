@@ -0,0 +1,118 @@
+/*
+ * Reads back the versions of the classes in the store of a capture,
+ * including the redefined versions kept as deltas.
+ *
+ * Usage: ./class-versions OUT_DIR
+ *        ./class-versions OUT_DIR KEY VERSION > C.class
+ *
+ * The first form lists the redefinitions (out/redefinitions.index),
+ * with the size of every version and of its stored form. The second
+ * one writes a version of a class ("<loaderHash>/<class>", as in
+ * out/classes.manifest) to the standard output.
+ */
+
+#include <stdio.h>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ClassDelta.hpp"
+
+using namespace std;
+
+string out_dir;
+
+bool read_file(const string& file_name, vector<unsigned char>* data) {
+  ifstream in(file_name, ios::binary);
+  if (!in)
+    return false;
+  data->assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  return !in.bad();
+}
+
+/** Reads the contents of a hash from the store, applying the chain of
+    deltas that leads to it. Sets stored_size to the size of the stored
+    form. */
+bool read_object(const string& hex, vector<unsigned char>* data, size_t* stored_size) {
+  string prefix = out_dir + "/objects/" + hex.substr(0, 2) + "/" + hex.substr(2);
+  if (read_file(prefix + ".class", data)) {
+    *stored_size = data->size();
+    return true;
+  }
+  vector<unsigned char> delta, base;
+  size_t base_stored_size;
+  if (!read_file(prefix + ".delta", &delta)) {
+    cerr << "No object " << hex << " in " << out_dir << "/objects" << endl;
+    return false;
+  }
+  *stored_size = delta.size();
+  string base_hex = delta_base_hex(delta.data(), delta.size());
+  if (base_hex.empty() || !read_object(base_hex, &base, &base_stored_size))
+    return false;
+  if (!apply_delta(base.data(), base.size(), delta.data(), delta.size(), data)) {
+    cerr << "Bad delta " << prefix << ".delta" << endl;
+    return false;
+  }
+  return true;
+}
+
+int list_redefinitions() {
+  ifstream index(out_dir + "/redefinitions.index");
+  if (!index) {
+    cerr << "No redefinitions in " << out_dir << endl;
+    return 0;
+  }
+  cout << "key\tversion\tclass_id\tsize\tstored\tstorage" << endl;
+  string line;
+  while (getline(index, line)) {
+    istringstream fields(line);
+    string key, version, hash, class_id, storage;
+    fields >> key >> version >> hash >> class_id >> storage;
+    vector<unsigned char> data;
+    size_t stored_size = 0;
+    if (storage == "failed") {
+      // The agent could not write this version.
+      cout << key << "\t" << version << "\t" << class_id << "\t-\t-\t" << storage << endl;
+      continue;
+    }
+    if (!read_object(hash, &data, &stored_size))
+      return 2;
+    cout << key << "\t" << version << "\t" << class_id << "\t" << data.size() << "\t" <<
+      (storage == "full" || storage.compare(0, 6, "delta:") == 0 ? to_string(stored_size) : "-") <<
+      "\t" << storage << endl;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2 && argc != 4) {
+    cerr << "Usage: ./class-versions OUT_DIR" << endl <<
+      "       ./class-versions OUT_DIR KEY VERSION > C.class" << endl;
+    return 1;
+  }
+  out_dir = argv[1];
+  if (argc == 2)
+    return list_redefinitions();
+
+  ifstream manifest(out_dir + "/classes.manifest");
+  string line;
+  while (getline(manifest, line)) {
+    istringstream fields(line);
+    string key, version, hash;
+    fields >> key >> version >> hash;
+    if (key != argv[2] || version != argv[3])
+      continue;
+    vector<unsigned char> data;
+    size_t stored_size;
+    if (!read_object(hash, &data, &stored_size))
+      return 2;
+    fwrite(data.data(), 1, data.size(), stdout);
+    return 0;
+  }
+  cerr << "No version " << argv[3] << " of " << argv[2] << " in " << out_dir << "/classes.manifest" << endl;
+  return 2;
+}
@@ -0,0 +1,143 @@
+/*
+ * Decodes the binary event log written by the agent (out/events.bin)
+ * back into the .info text of each class, or into JSON.
+ *
+ * Usage: ./decode-events [--json | --info OUT_DIR] events.bin
+ *
+ *   (default)      : prints the .info text of every class, each
+ *                    preceded by a "=== <loaderHash>/<class> ===" line.
+ *   --json         : prints one JSON object per class (JSON lines).
+ *   --info OUT_DIR : recreates the .info files of the original layout,
+ *                    OUT_DIR/<loaderHash>/<class>.info
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "EventLog.hpp"
+
+using namespace std;
+
+/** Creates a directory and all its parents. */
+void make_dirs(const string& dir) {
+  for (size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+    string prefix = dir.substr(0, pos);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+      cerr << "Could not create directory " << prefix << ": " << strerror(errno) << endl;
+    if (pos == string::npos)
+      break;
+  }
+}
+
+void print_json_string(ostream& out, const string& s) {
+  out << '"';
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out << esc;
+    } else
+      out << c;
+  }
+  out << '"';
+}
+
+const char* top_kind_name(int kind) {
+  switch (kind) {
+  case TOP_DEFINE_CLASS          : return "defineClass";
+  case TOP_DEFINE_ANONYMOUS_CLASS: return "defineAnonymousClass";
+  case TOP_UNKNOWN               : return "unknown";
+  case TOP_UNNAMED               : return "unnamed";
+  default                        : return "none";
+  }
+}
+
+void print_json(ostream& out, const ExecContext& ctx) {
+  out << "{ \"classId\": " << ctx.class_id << ", \"class\": ";
+  print_json_string(out, ctx.class_name);
+  out << ", \"loaderHash\": " << ctx.loader_hash << ", \"loaderClass\": ";
+  print_json_string(out, ctx.loader_class);
+  out << ", \"thread\": ";
+  print_json_string(out, ctx.thread_name);
+  out << ", \"timestamp\": " << ctx.timestamp <<
+    ", \"top\": \"" << top_kind_name(ctx.top_kind) << "\"" <<
+    ", \"stackError\": " << (ctx.stack_status == STACK_ERROR ? "true" : "false") <<
+    ", \"frames\": [";
+  for (size_t i = 0; i < ctx.frames.size(); i++) {
+    const FrameContext& f = ctx.frames[i];
+    out << (i == 0 ? " " : ", ") << "{ \"index\": " << f.index << ", \"method\": ";
+    print_json_string(out, f.method_name);
+    out << ", \"signature\": ";
+    print_json_string(out, f.method_sig);
+    out << ", \"declaringClass\": ";
+    print_json_string(out, f.declaring_class);
+    out << ", \"bci\": " << f.location << ", \"line\": " << f.line;
+    if (f.bytecode >= 0)
+      out << ", \"bytecode\": " << f.bytecode;
+    out << " }";
+  }
+  out << (ctx.frames.empty() ? "] }" : " ] }") << endl;
+}
+
+int main(int argc, char** argv) {
+  bool json = false;
+  string info_dir;
+  string log_file;
+  bool bad_usage = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--json")
+      json = true;
+    else if (arg == "--info" && i + 1 < argc)
+      info_dir = argv[++i];
+    else if (log_file.empty() && arg[0] != '-')
+      log_file = arg;
+    else
+      bad_usage = true;
+  }
+  if (bad_usage || log_file.empty() || (json && !info_dir.empty())) {
+    cerr << "Usage: ./decode-events [--json | --info OUT_DIR] events.bin" << endl;
+    return -1;
+  }
+
+  EventLogReader reader;
+  if (!reader.open(log_file)) {
+    cerr << "Could not read event log " << log_file << endl;
+    return -2;
+  }
+
+  ExecContext ctx;
+  unsigned long events = 0;
+  while (reader.next(&ctx)) {
+    events++;
+    if (json)
+      print_json(cout, ctx);
+    else if (!info_dir.empty()) {
+      string base_dir = info_dir + "/" + to_string(ctx.loader_hash);
+      size_t last_slash_pos = ctx.class_name.find_last_of('/');
+      make_dirs(last_slash_pos == string::npos ? base_dir :
+                base_dir + "/" + ctx.class_name.substr(0, last_slash_pos));
+      ofstream info_file(base_dir + "/" + ctx.class_name + ".info", ios::app);
+      format_exec_context(&info_file, ctx);
+    } else {
+      cout << "=== " << ctx.loader_hash << "/" << ctx.class_name << " ===" << endl;
+      format_exec_context(&cout, ctx);
+    }
+  }
+  if (reader.failed()) {
+    cerr << "Event log " << log_file << " is truncated or corrupt (after " <<
+      events << " events)." << endl;
+    return -3;
+  }
+  cerr << events << " events." << endl;
+  return 0;
+}
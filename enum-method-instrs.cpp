@@ -0,0 +1,303 @@
+/*
+ * Enumerates the instructions of a given kind in the methods of class
+ * files, numbering every occurrence and pairing it with its bytecode
+ * position. This connects instructions from bytecode (e.g. the call
+ * sites in the .info files) to Jimple instructions for Doop.
+ *
+ * Usage: ./enum-method-instrs path/to/C.class METHOD INSTRUCTION
+ *        ./enum-method-instrs [-j THREADS] --all INSTRUCTION PATH...
+ *
+ * The first form prints the occurrences in one method, in the format
+ * of the old enum-method-instrs.py, e.g.
+ *
+ *   ./enum-method-instrs Main.class 'main(java.lang.String[])' invokevirtual
+ *   Occurences of invokevirtual in method main(java.lang.String[])
+ *   ('bytecode index: 1', 'instr: invokevirtual/0', 'doop: <Main: main(java.lang.String[])>/java.io.PrintStream.println:(Ljava.lang.String;)V/0')
+ *
+ * The second form covers all methods of all class files found in the
+ * PATHs (class files, directories, JARs), in parallel, and prints one
+ * "<doop id> TAB <bytecode index>" line per occurrence.
+ *
+ * Methods are named as in javap declarations ("main(java.lang.String[])",
+ * the class name for constructors). An INSTRUCTION matches every opcode
+ * that starts with it, e.g. "invoke" matches all invoke instructions.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ClassFile.hpp"
+#include "ZipReader.hpp"
+
+using namespace std;
+
+/** A class file to scan: a file on disk, or an entry of a JAR. */
+struct WorkItem {
+  string path;
+  const ZipReader* jar;
+  const ZipReader::Entry* entry;
+  string output;
+  bool failed;
+};
+
+string dotted(string name) {
+  for (size_t i = 0; i < name.size(); i++)
+    if (name[i] == '/')
+      name[i] = '.';
+  return name;
+}
+
+bool ends_with(const string& s, const string& suffix) {
+  return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/** What an instruction refers to, as javap shows it in its comment
+    (with dots for slashes): "owner.name:desc" for members (without
+    the owner if it is the current class), "#bsm:name:desc" for
+    invokedynamic, the class for class operands, else the opcode. */
+string instruction_target(const ClassFile& cf, const unsigned char* code, uint32_t pc) {
+  int op = code[pc];
+  uint16_t index = (code[pc + 1] << 8) | code[pc + 2];
+  string owner, name, desc;
+  switch (op) {
+  case OP_GETSTATIC: case OP_PUTSTATIC: case OP_GETFIELD: case OP_PUTFIELD:
+  case OP_INVOKEVIRTUAL: case OP_INVOKESPECIAL: case OP_INVOKESTATIC: case OP_INVOKEINTERFACE:
+    if (cf.member_ref(index, &owner, &name, &desc)) {
+      if (name[0] == '<')  // javap quotes "<init>"
+        name = "\"" + name + "\"";
+      return dotted((owner == cf.get_class_name() ? "" : owner + ".") + name + ":" + desc);
+    }
+    break;
+  case OP_INVOKEDYNAMIC: {
+    uint16_t bootstrap;
+    if (cf.dynamic_ref(index, &bootstrap, &name, &desc))
+      return dotted("#" + to_string(bootstrap) + ":" + name + ":" + desc);
+    break;
+  }
+  case OP_NEW: case OP_ANEWARRAY: case OP_CHECKCAST: case OP_INSTANCEOF: case OP_MULTIANEWARRAY:
+    return dotted(cf.class_name(index));
+  }
+  return opcode_name(op);
+}
+
+/** Appends the occurrences of an instruction kind in a method.
+    Returns false if the code cannot be decoded. */
+bool enum_instructions(const ClassFile& cf, const ClassFile::Method& m,
+                       const string& method_name, const string& kind,
+                       bool py_format, ostream& out) {
+  string class_name = dotted(cf.get_class_name());
+  int counter = 0;
+  for (uint32_t pc = 0; pc < m.code_length; ) {
+    int len = instruction_length(m.code, m.code_length, pc);
+    if (len <= 0)
+      return false;
+    const char* op_name = opcode_name(m.code[pc]);
+    if (op_name != NULL && strncmp(op_name, kind.c_str(), kind.size()) == 0) {
+      string doop_id = "<" + class_name + ": " + method_name + ">/" +
+        instruction_target(cf, m.code, pc) + "/" + to_string(counter);
+      if (py_format)
+        out << "('bytecode index: " << pc << "', 'instr: " << kind << "/" << counter <<
+          "', 'doop: " << doop_id << "')" << endl;
+      else
+        out << doop_id << "\t" << pc << endl;
+      counter++;
+    }
+    pc += len;
+  }
+  return true;
+}
+
+/** Maps a file read-only. Returns NULL on error. */
+const unsigned char* map_file(const string& path, size_t* size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  void* m = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    *size = st.st_size;
+    m = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  return (m == MAP_FAILED) ? NULL : (const unsigned char*)m;
+}
+
+/** Scans all methods of one class file into item->output. */
+void scan_item(WorkItem* item, const string& kind) {
+  vector<unsigned char> jar_data;
+  const unsigned char* data;
+  size_t size = 0;
+  if (item->jar != NULL) {
+    if (!item->jar->read(*item->entry, &jar_data)) {
+      item->output = "Could not read " + item->path + "\n";
+      item->failed = true;
+      return;
+    }
+    data = jar_data.data();
+    size = jar_data.size();
+  } else if ((data = map_file(item->path, &size)) == NULL) {
+    item->output = "Could not read " + item->path + "\n";
+    item->failed = true;
+    return;
+  }
+
+  ClassFile cf;
+  ostringstream out;
+  if (!cf.parse(data, size)) {
+    out << "Could not parse " << item->path << ": " << cf.get_error() << endl;
+    item->failed = true;
+  } else {
+    const vector<ClassFile::Method>& methods = cf.get_methods();
+    for (size_t i = 0; i < methods.size(); i++)
+      if (methods[i].code != NULL &&
+          !enum_instructions(cf, methods[i], cf.javap_method_name(methods[i]), kind, false, out)) {
+        out << "Bad code in " << item->path << ", method " << methods[i].name << endl;
+        item->failed = true;
+      }
+  }
+  item->output = out.str();
+  if (item->jar == NULL)
+    munmap((void*)data, size);
+}
+
+struct ScanShared {
+  vector<WorkItem>* items;
+  atomic<size_t> next;
+  string kind;
+};
+
+void* scan_loop(void* arg) {
+  ScanShared* shared = (ScanShared*)arg;
+  for (size_t i; (i = shared->next++) < shared->items->size(); )
+    scan_item(&(*shared->items)[i], shared->kind);
+  return NULL;
+}
+
+/** Collects the class files under a path: a class file, a JAR, or a
+    directory searched recursively (in name order). */
+bool collect(const string& path, vector<unique_ptr<ZipReader> >* jars, vector<WorkItem>* items) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    cerr << "Cannot access " << path << endl;
+    return false;
+  }
+  bool ok = true;
+  if (S_ISDIR(st.st_mode)) {
+    struct dirent** names;
+    int n = scandir(path.c_str(), &names, NULL, alphasort);
+    for (int i = 0; i < n; i++) {
+      string name = names[i]->d_name;
+      free(names[i]);
+      if (name == "." || name == "..")
+        continue;
+      string child = path + "/" + name;
+      struct stat child_st;
+      if (stat(child.c_str(), &child_st) == 0 &&
+          (S_ISDIR(child_st.st_mode) || ends_with(name, ".class") || ends_with(name, ".jar")))
+        ok = collect(child, jars, items) && ok;
+    }
+    if (n >= 0)
+      free(names);
+  } else if (ends_with(path, ".jar") || ends_with(path, ".zip")) {
+    jars->push_back(unique_ptr<ZipReader>(new ZipReader));
+    ZipReader* jar = jars->back().get();
+    if (!jar->open(path)) {
+      cerr << "Cannot read " << path << ": " << jar->get_error() << endl;
+      return false;
+    }
+    const vector<ZipReader::Entry>& entries = jar->get_entries();
+    for (size_t i = 0; i < entries.size(); i++)
+      if (ends_with(entries[i].name, ".class")) {
+        WorkItem item = { path + "!/" + entries[i].name, jar, &entries[i], "", false };
+        items->push_back(item);
+      }
+  } else {
+    WorkItem item = { path, NULL, NULL, "", false };
+    items->push_back(item);
+  }
+  return ok;
+}
+
+/** The single-method form, compatible with enum-method-instrs.py. */
+int enum_one_method(const string& class_file, const string& method, const string& kind) {
+  size_t size = 0;
+  const unsigned char* data = map_file(class_file, &size);
+  ClassFile cf;
+  if (data == NULL || !cf.parse(data, size)) {
+    cerr << "Could not read class file " << class_file <<
+      (data == NULL ? "" : ": " + cf.get_error()) << endl;
+    return -2;
+  }
+  const vector<ClassFile::Method>& methods = cf.get_methods();
+  for (size_t i = 0; i < methods.size(); i++) {
+    const ClassFile::Method& m = methods[i];
+    if (cf.javap_method_name(m) != method && m.name + m.descriptor != method)
+      continue;
+    cout << "Occurences of " << kind << " in method " << method << endl;
+    if (m.code == NULL)
+      continue;
+    if (!enum_instructions(cf, m, method, kind, true, cout)) {
+      cerr << "Error decoding the bytecode of " << method << endl;
+      return -3;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  bool all = false;
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-j" && i + 1 < argc)
+      thread_count = atoi(argv[++i]);
+    else if (arg == "--all")
+      all = true;
+    else
+      args.push_back(arg);
+  }
+  if ((!all && args.size() != 3) || (all && args.size() < 2) || thread_count < 1) {
+    cerr << "Usage: ./enum-method-instrs path/to/C.class METHOD INSTRUCTION" << endl <<
+      "       ./enum-method-instrs [-j THREADS] --all INSTRUCTION PATH..." << endl;
+    return -1;
+  }
+  if (!all)
+    return enum_one_method(args[0], args[1], args[2]);
+
+  vector<unique_ptr<ZipReader> > jars;
+  vector<WorkItem> items;
+  bool ok = true;
+  for (size_t i = 1; i < args.size(); i++)
+    ok = collect(args[i], &jars, &items) && ok;
+
+  ScanShared shared;
+  shared.items = &items;
+  shared.next = 0;
+  shared.kind = args[0];
+  vector<pthread_t> threads(min((size_t)thread_count, max((size_t)1, items.size())));
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_create(&threads[i], NULL, scan_loop, &shared);
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+
+  for (size_t i = 0; i < items.size(); i++) {
+    if (items[i].failed) {
+      cerr << items[i].output;
+      ok = false;
+    } else
+      cout << items[i].output;
+  }
+  return ok ? 0 : -2;
+}
@@ -0,0 +1,129 @@
+/*
+ * Fuses a dacapo-bach JAR with the extra classes that are observed
+ * when it runs. The result JAR contains the original JAR entries plus
+ * all entries only existing in the captured JAR, and the given
+ * manifest.
+ *
+ * Usage: ./fuse-jars [-m MANIFEST.MF] original.jar captured.jar result.jar
+ *
+ *   original.jar : original JAR from doop-benchmarks/dacapo-bach
+ *   captured.jar : result of running the agent recording loaded
+ *                  classes.
+ *   result.jar   : the name of the JAR to generate.
+ *   MANIFEST.MF  : manifest of the result (default:
+ *                  dacapo-bach/tradebeans-skeleton/META-INF/MANIFEST.MF;
+ *                  "" keeps the manifest of the original JAR).
+ *
+ * Both JARs are memory-mapped and their entries are copied as they
+ * are stored, without inflating and compressing them again.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "ZipReader.hpp"
+#include "ZipWriter.hpp"
+
+using namespace std;
+
+#define MANIFEST_NAME "META-INF/MANIFEST.MF"
+
+bool is_class_entry(const string& name) {
+  return name.size() > 6 && name.compare(name.size() - 6, 6, ".class") == 0;
+}
+
+/** Number of distinct class entries of an archive. */
+template <typename Entry>
+size_t count_classes(const vector<Entry>& entries) {
+  unordered_set<string> names;
+  for (size_t i = 0; i < entries.size(); i++)
+    if (is_class_entry(entries[i].name))
+      names.insert(entries[i].name);
+  return names.size();
+}
+
+/** Copies the entries of a JAR that are not in the result yet.
+    Returns false on error. */
+bool copy_entries(const string& jar_name, const ZipReader& jar, bool keep_manifest,
+                  unordered_set<string>* added, ZipWriter* result) {
+  const vector<ZipReader::Entry>& entries = jar.get_entries();
+  for (size_t i = 0; i < entries.size(); i++) {
+    const ZipReader::Entry& e = entries[i];
+    if ((e.name == MANIFEST_NAME && !keep_manifest) || added->count(e.name) != 0)
+      continue;
+    const unsigned char* data = jar.raw_data(e);
+    if (data == NULL) {
+      cerr << "Bad entry " << e.name << " in " << jar_name << endl;
+      return false;
+    }
+    if (!result->add_raw(e.name, e.method, e.crc, e.size, data, e.compressed_size,
+                         e.dos_time, e.dos_date))
+      return false;
+    added->insert(e.name);
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  string manifest = "dacapo-bach/tradebeans-skeleton/META-INF/MANIFEST.MF";
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-m" && i + 1 < argc)
+      manifest = argv[++i];
+    else
+      args.push_back(arg);
+  }
+  if (args.size() != 3) {
+    cerr << "Usage: ./fuse-jars [-m MANIFEST.MF] original.jar captured.jar result.jar" << endl;
+    return 1;
+  }
+
+  ZipReader original, captured;
+  if (!original.open(args[0])) {
+    cerr << "Cannot read " << args[0] << ": " << original.get_error() << endl;
+    return 1;
+  }
+  if (!captured.open(args[1])) {
+    cerr << "Cannot read " << args[1] << ": " << captured.get_error() << endl;
+    return 1;
+  }
+
+  ZipWriter result;
+  if (!result.open(args[2])) {
+    cerr << "Cannot create " << args[2] << endl;
+    return 1;
+  }
+  // Like jar cfm: the manifest comes first, then the entries of the
+  // original JAR, which take precedence over the captured ones.
+  unordered_set<string> added;
+  bool ok = true;
+  if (!manifest.empty()) {
+    ifstream in(manifest, ios::binary);
+    if (!in) {
+      cerr << "Cannot read " << manifest << endl;
+      return 1;
+    }
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    ok = result.add("META-INF/", NULL, 0, ZIP_STORED) &&
+      result.add(MANIFEST_NAME, (const unsigned char*)text.data(), text.size(), ZIP_DEFLATED);
+    added.insert("META-INF/");
+  }
+  ok = ok && copy_entries(args[0], original, manifest.empty(), &added, &result);
+  ok = ok && copy_entries(args[1], captured, manifest.empty(), &added, &result);
+  ok = result.close() && ok;
+  if (!ok) {
+    cerr << "Could not write " << args[2] << endl;
+    return 1;
+  }
+
+  cout << "Statistics (# of classes):" << endl;
+  cout << "Original: " << count_classes(original.get_entries()) << endl;
+  cout << "Captured: " << count_classes(captured.get_entries()) << endl;
+  cout << "Fused: " << count_classes(result.get_entries()) << endl;
+  return 0;
+}
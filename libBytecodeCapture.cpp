@@ -22,17 +22,49 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <jvmti.h>
 
+#include "ClassDelta.hpp"
+#include "ClassFile.hpp"
+#include "ClassInventory.hpp"
+#include "ClassFilter.hpp"
+#include "ContentHash.hpp"
+#include "EventLog.hpp"
+#include "Governor.hpp"
+#include "HookMemory.hpp"
+#include "HookStats.hpp"
+#include "LoadProfile.hpp"
+#include "StoreIndex.hpp"
+#include "ZipWriter.hpp"
+
 /** Serialize the execution of this agent to account for concurrent
     class loading. */
 #define SERIALIZE 1
@@ -40,109 +72,560 @@
 static jvmtiEnv *jvmti = NULL;
 static jvmtiEventCallbacks callbacks;
 static jvmtiCapabilities caps;
-static int bytecodes[256];
 
-static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t serialize_lock = PTHREAD_MUTEX_INITIALIZER;
-static int defined_sum;
-static int defined_by_defineClass;
-static int defined_by_defineAnonymousClass;
-static int defined_by_unknown;
-static int defined_missing;
-static int defined_but_ignored;
 
 /** Flags to control output in standard output (slow, must be
     serialized) or files (async). */
 enum OUTPUT_MODE { USE_STDOUT, USE_FILE };
 
+/** Where captured classes go: a directory tree per loader (the
+    original layout), one JAR for the whole run, or one JAR per
+    loader. */
+enum ARCHIVE_MODE { OUT_DIRS, OUT_JAR, OUT_LOADER_JARS };
+
+/** How execution contexts are saved: as events of the binary log
+    out/events.bin, or as one .info text file per class. */
+enum CONTEXT_MODE { CONTEXT_EVENTS, CONTEXT_INFO };
+
+/** What the hook does when the capture queue is full: wait for a
+    writer to free a slot, drop the class, or spill it to disk
+    directly from the loading thread. */
+enum QUEUE_FULL_POLICY { FULL_BLOCK, FULL_DROP, FULL_SPILL };
+
+/** How much of the loading stack is read: all of it (up to
+    stack_depth frames), or just the top frame, to classify the class,
+    plus the rest only when the top method is not a known class
+    definer. */
+enum STACK_MODE { STACK_FULL, STACK_CLASSIFY };
+
 using namespace std;
 
+/** Output root of this process (out=DIR, "%p" replaced by the pid). */
 static string TOP_OUT_DIR("out");
-static map<int, string> loaders;
+/** Content-addressed class store (store=DIR, default
+    TOP_OUT_DIR/objects). Several processes may share it. */
+static string STORE_DIR;
+/** Slots of the shared index of a new store (store_index=N). */
+static unsigned long store_index_slots = 1 << 20;
+
+/** Scratch memory of the current hook call or persisted record. */
+static thread_local HookArena hook_arena;
+
+/** Number of background writer threads (0 = write synchronously in
+    the hook, the original behavior). */
+static int writer_count = 0;
+/** Capacity of the capture queue (rounded up to a power of 2). */
+static unsigned long queue_capacity = 4096;
+static QUEUE_FULL_POLICY queue_full_policy = FULL_BLOCK;
+static ARCHIVE_MODE output_mode = OUT_DIRS;
+static ZIP_METHOD jar_compression = ZIP_DEFLATED;
+/** Optional MANIFEST.MF to embed in every JAR written. */
+static string jar_manifest;
+static CONTEXT_MODE context_mode = CONTEXT_EVENTS;
+/** Maximum number of frames read (0 = no stack, class bytes only). */
+static int stack_depth = 47;
+static STACK_MODE stack_mode = STACK_FULL;
+/** Measures the time spent in the hook and picks the capture level. */
+static OverheadGovernor governor;
+/** Latency histograms of the phases of the hook (and of the writers). */
+static HookStats hook_stats;
+/** Seconds between refreshes of out/stats.json (0 = only at unload). */
+static int stats_interval = 0;
+/** Sequence number of captured classes (the class id of events). */
+static atomic<unsigned long> class_counter(0);
+/** Capture state, switched by the control channel. While it is off
+    the hook event is disabled; the flag also stops the hook calls
+    that were already under way. */
+static atomic<bool> capture_enabled(true);
+/** UNIX socket of the control channel ("" = none). */
+static string control_path;
+
+/** Classes to capture, by name and by the class of their loader.
+    The class filter excludes the JDK classes unless default_excludes=0. */
+static ClassFilter class_filter;
+static ClassFilter loader_filter;
+static bool default_excludes = true;
+
+/** Directory fd of TOP_OUT_DIR, opened on first use; all output
+    directories are created relative to it. */
+static int out_dir_fd = -1;
+static pthread_mutex_t out_dir_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Directories (relative to TOP_OUT_DIR) known to exist. Reads are
+    the common case, so they only take the lock in shared mode. */
+static unordered_set<string> created_dirs;
+static pthread_rwlock_t created_dirs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Creates a directory and its parents, relative to the cwd. */
+void make_path(const string& dir) {
+  for (size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+    string prefix = dir.substr(0, pos);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+      cerr << "Could not create directory " << prefix << ": " << strerror(errno) << endl;
+    if (pos == string::npos)
+      break;
+  }
+}
+
+int open_out_dir() {
+  pthread_mutex_lock(&out_dir_fd_lock);
+  if (out_dir_fd == -1) {
+    make_path(TOP_OUT_DIR);
+    out_dir_fd = open(TOP_OUT_DIR.c_str(), O_RDONLY | O_DIRECTORY);
+    if (out_dir_fd == -1)
+      cerr << "Could not open output directory " << TOP_OUT_DIR << ": " << strerror(errno) << endl;
+  }
+  pthread_mutex_unlock(&out_dir_fd_lock);
+  return out_dir_fd;
+}
+
+bool dir_created(const string& dir) {
+  pthread_rwlock_rdlock(&created_dirs_lock);
+  bool found = created_dirs.find(dir) != created_dirs.end();
+  pthread_rwlock_unlock(&created_dirs_lock);
+  return found;
+}
+
+/** Given a directory name under TOP_OUT_DIR, creates it, including
+    all its parents. Every directory is created at most once per run:
+    the ones already created are remembered and skipped. */
+void make_dirs(const string& out_dir) {
+  if (out_dir == TOP_OUT_DIR) {
+    open_out_dir();
+    return;
+  }
+  if (out_dir.compare(0, TOP_OUT_DIR.size() + 1, TOP_OUT_DIR + "/") != 0) {
+    cerr << "Directory " << out_dir << " is not under " << TOP_OUT_DIR << endl;
+    return;
+  }
+  string rel_dir = out_dir.substr(TOP_OUT_DIR.size() + 1);
+  if (dir_created(rel_dir))
+    return;
+
+  int root_fd = open_out_dir();
+  if (root_fd == -1)
+    return;
+  // Walk the path from the top, creating each missing component.
+  for (size_t pos = rel_dir.find('/'); ; pos = rel_dir.find('/', pos + 1)) {
+    string prefix = rel_dir.substr(0, pos);
+    if (!dir_created(prefix)) {
+      if (mkdirat(root_fd, prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Could not create directory " << TOP_OUT_DIR << "/" << prefix <<
+          ": " << strerror(errno) << endl;
+        return;
+      }
+      pthread_rwlock_wrlock(&created_dirs_lock);
+      created_dirs.insert(prefix);
+      pthread_rwlock_unlock(&created_dirs_lock);
+    }
+    if (pos == string::npos)
+      break;
+  }
+}
+
+/** Lock file of the output root, held until the process exits. */
+static int out_lock_fd = -1;
+
+/** Replaces "%p" in a path with the pid, for processes started with
+    the same options to get their own directories. */
+string expand_pid(const string& path) {
+  string expanded;
+  for (size_t i = 0; i < path.size(); i++)
+    if (path[i] == '%' && i + 1 < path.size() && path[i + 1] == 'p') {
+      expanded += to_string(getpid());
+      i++;
+    } else
+      expanded += path[i];
+  return expanded;
+}
+
+/** Locks the output root for this process, at start-up. Two
+    processes cannot share the run files of a root (manifests, event
+    log, stats), so a process that finds the root locked by another
+    one, e.g. a worker JVM started with the same options, writes them
+    to "<root>.<pid>" instead. The store stays the one of the root and
+    is shared. */
+void claim_out_dir() {
+  if (STORE_DIR.empty())
+    STORE_DIR = TOP_OUT_DIR + "/objects";
+  int dir_fd = open_out_dir();
+  if (dir_fd == -1)
+    return;
+  int fd = openat(dir_fd, ".lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    string root = TOP_OUT_DIR;
+    pthread_mutex_lock(&out_dir_fd_lock);
+    close(out_dir_fd);
+    out_dir_fd = -1;
+    TOP_OUT_DIR = root + "." + to_string(getpid());
+    pthread_mutex_unlock(&out_dir_fd_lock);
+    cerr << root << " is used by another process, writing to " << TOP_OUT_DIR << endl;
+    dir_fd = open_out_dir();
+    fd = dir_fd == -1 ? -1 : openat(dir_fd, ".lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd != -1)
+      flock(fd, LOCK_EX | LOCK_NB);
+  }
+  out_lock_fd = fd;
+}
+
+/** Index of the store shared with the other processes that use it
+    (STORE_DIR/index), opened with the store. */
+static StoreIndex store_index;
+static atomic<bool> store_opened(false);
+static pthread_mutex_t store_open_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Objects written to the store by this process, and objects it did
+    not write because another process had. */
+static atomic<long> objects_written(0);
+static atomic<long> objects_shared(0);
+
+/** Creates the store with its 256 fan-out directories, and maps its
+    shared index, on first use. A store outside the output root is
+    linked from TOP_OUT_DIR/objects, where the tools look for it. */
+void open_store() {
+  if (store_opened.load(memory_order_acquire))
+    return;
+  pthread_mutex_lock(&store_open_lock);
+  if (!store_opened.load(memory_order_relaxed)) {
+    make_path(STORE_DIR);
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+      string dir = STORE_DIR + "/" + digits[i >> 4] + digits[i & 0xf];
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        cerr << "Could not create directory " << dir << ": " << strerror(errno) << endl;
+    }
+    string error;
+    if (!store_index.open_index(STORE_DIR + "/index", store_index_slots, &error))
+      cerr << "Could not open the store index (" << error <<
+        "), the objects of other processes are looked up on disk." << endl;
+    if (STORE_DIR != TOP_OUT_DIR + "/objects") {
+      char* store_path = realpath(STORE_DIR.c_str(), NULL);
+      int dir_fd = open_out_dir();
+      if (store_path != NULL && dir_fd != -1 &&
+          symlinkat(store_path, dir_fd, "objects") != 0 && errno != EEXIST)
+        cerr << "Could not link " << TOP_OUT_DIR << "/objects to " << store_path << ": " <<
+          strerror(errno) << endl;
+      free(store_path);
+    }
+    store_opened.store(true, memory_order_release);
+  }
+  pthread_mutex_unlock(&store_open_lock);
+}
+
+string object_path(const Hash128& hash, string* object_dir);
+
+/** Decides if this process writes an object that is new to it: not if
+    another process of the store has written it (the shared index only
+    lists the objects in place). Without a usable index, the store
+    itself is checked. */
+bool claim_object(const Hash128& hash) {
+  open_store();
+  INDEX_RESULT result = store_index.lookup(hash);
+  if (result == INDEX_FULL) {
+    string object_dir;
+    result = access(object_path(hash, &object_dir).c_str(), F_OK) == 0 ? INDEX_PRESENT : INDEX_ABSENT;
+  }
+  if (result == INDEX_PRESENT)
+    objects_shared++;
+  return result != INDEX_PRESENT;
+}
+
+/** Content-addressed class store: every distinct class file is kept
+    once under STORE_DIR, named after its hash. The index
+    maps each "<loaderHash>/<class name>" key to the hashes of all the
+    versions seen under it, so duplicates are detected without reading
+    anything back from disk. */
+static unordered_map<string, vector<Hash128> > class_versions;
+static unordered_set<Hash128, Hash128Hasher> stored_objects;
+static pthread_mutex_t class_index_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Name-to-hash manifest, one "<key> <version> <hash> <loader>"
+    line per version. */
+static FILE* class_manifest = NULL;
+
+/** Classes captured by earlier runs (base=DIR), keyed by "<loader>
+    <class> <hash>", and their names, keyed by "<loader> <class>".
+    Loaders are matched by class signature, as their ids change from
+    run to run. Read-only once the agent is initialized. */
+static string base_dir;
+static unordered_set<string> base_classes;
+static unordered_set<string> base_names;
+/** Classes of this run that are new or changed relative to the base,
+    one "+|~ <key> <hash> <loader>" line each. */
+static FILE* class_delta = NULL;
+static atomic<long> classes_unchanged(0);
+
+/** Reads the manifest of an earlier run. A missing manifest is an
+    empty base (first run). */
+bool load_base(const string& dir) {
+  string manifest_name = dir + "/classes.manifest";
+  ifstream manifest(manifest_name);
+  if (!manifest) {
+    cerr << "No " << manifest_name << ", capturing all classes." << endl;
+    return true;
+  }
+  string line;
+  while (getline(manifest, line)) {
+    istringstream fields(line);
+    string key, version, hash, loader;
+    if (!(fields >> key >> version >> hash >> loader) || key.find('/') == string::npos) {
+      cerr << "Bad line in " << manifest_name << " (written by an older agent?): " << line << endl;
+      return false;
+    }
+    string name = key.substr(key.find('/') + 1);
+    base_classes.insert(loader + " " + name + " " + hash);
+    base_names.insert(loader + " " + name);
+  }
+  cerr << "Base capture " << dir << ": " << base_classes.size() << " classes." << endl;
+  return true;
+}
+
+/** True if a class with these contents was captured by an earlier run. */
+bool in_base(const string& loader_sig, const string& name, const Hash128& hash) {
+  return !base_dir.empty() &&
+    base_classes.count(loader_sig + " " + name + " " + hash.to_hex()) != 0;
+}
+
+/** Records the contents of a class under a key. Returns the version
+    number of the contents (1 for the first contents of the key), or 0
+    if the same contents have already been recorded under the
+    key. Sets new_object if the contents are not in the store yet. */
+int index_class(const string& key, const string& loader_sig, const Hash128& hash,
+                bool* new_object) {
+  pthread_mutex_lock(&class_index_lock);
+  vector<Hash128>& versions = class_versions[key];
+  int version = 0;
+  for (size_t i = 0; i < versions.size(); i++)
+    if (versions[i] == hash) {
+      pthread_mutex_unlock(&class_index_lock);
+      return 0;
+    }
+  versions.push_back(hash);
+  version = versions.size();
+  *new_object = stored_objects.insert(hash).second && claim_object(hash);
+
+  if (class_manifest == NULL) {
+    make_dirs(TOP_OUT_DIR);
+    string manifest_name = TOP_OUT_DIR + "/classes.manifest";
+    class_manifest = fopen(manifest_name.c_str(), "w");
+    if (class_manifest == NULL)
+      cerr << "Could not create " << manifest_name << ": " << strerror(errno) << endl;
+  }
+  if (class_manifest != NULL)
+    fprintf(class_manifest, "%s %d %s %s\n", key.c_str(), version, hash.to_hex().c_str(),
+            loader_sig.c_str());
+  if (!base_dir.empty()) {
+    if (class_delta == NULL) {
+      string delta_name = TOP_OUT_DIR + "/delta.manifest";
+      class_delta = fopen(delta_name.c_str(), "w");
+      if (class_delta == NULL)
+        cerr << "Could not create " << delta_name << ": " << strerror(errno) << endl;
+    }
+    string name = key.substr(key.find('/') + 1);
+    if (class_delta != NULL)
+      fprintf(class_delta, "%c %s %s %s\n", base_names.count(loader_sig + " " + name) ? '~' : '+',
+              key.c_str(), hash.to_hex().c_str(), loader_sig.c_str());
+  }
+  pthread_mutex_unlock(&class_index_lock);
+  return version;
+}
 
-inline bool starts_with(const string search_str, const string s) {
-  return (s.substr(0, search_str.size()) == search_str);
+void close_class_manifest() {
+  pthread_mutex_lock(&class_index_lock);
+  if (class_manifest != NULL)
+    fclose(class_manifest);
+  class_manifest = NULL;
+  if (class_delta != NULL)
+    fclose(class_delta);
+  class_delta = NULL;
+  pthread_mutex_unlock(&class_index_lock);
 }
 
-/** Given a directory name, this function calls 'mkdir -p' to create
-    it, including all its parents. */
-void make_dirs(const string out_dir) {
-  string mkdir_cmd = "mkdir -p '" + out_dir + "'";
-  system(mkdir_cmd.c_str());
+/** The path of a class in the store, e.g. out/objects/3f/2a...c1.class */
+string object_path(const Hash128& hash, string* object_dir) {
+  string hex = hash.to_hex();
+  *object_dir = STORE_DIR + "/" + hex.substr(0, 2);
+  return *object_dir + "/" + hex.substr(2) + ".class";
 }
 
-// Taken from https://stackoverflow.com/questions/12774207/fastest-way-to-check-if-a-file-exist-using-standard-c-c11-c
-inline bool file_exists (const std::string& name) {
-  struct stat buffer;
-  return (stat (name.c_str(), &buffer) == 0);
+/** A name next to file_name that no other thread or process uses. */
+string temp_name(const string& file_name) {
+  static atomic<unsigned long> temp_counter(0);
+  return file_name + ".tmp." + to_string(getpid()) + "." + to_string(temp_counter++);
+}
+
+/** Writes a file under a temporary name, then renames it into place:
+    readers, and other processes writing the same file, never see it
+    partially written. */
+bool write_file(const string& file_name, jint data_len, const unsigned char* data) {
+  string tmp_name = temp_name(file_name);
+  int fd = open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return false;
+  bool ok = true;
+  for (jint done = 0; ok && done < data_len; ) {
+    ssize_t n = write(fd, data + done, data_len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    done += n;
+  }
+  ok = (close(fd) == 0) && ok && rename(tmp_name.c_str(), file_name.c_str()) == 0;
+  if (!ok)
+    unlink(tmp_name.c_str());
+  return ok;
+}
+
+/** Saves class contents in the store (unless already there) and
+    returns their path. */
+string store_object(const Hash128& hash, bool new_object,
+                    jint class_data_len, const unsigned char* class_data) {
+  string object_dir;
+  string object_file_name = object_path(hash, &object_dir);
+  if (new_object) {
+    open_store();
+    if (write_file(object_file_name, class_data_len, class_data)) {
+      objects_written++;
+      store_index.insert(hash);
+    } else {
+      cerr << "Could not write " << object_file_name << endl;
+      // Written again by the next class with these contents.
+      pthread_mutex_lock(&class_index_lock);
+      stored_objects.erase(hash);
+      pthread_mutex_unlock(&class_index_lock);
+    }
+  }
+  return object_file_name;
 }
 
 /** Writes a bytecode data stream to a file. Takes the fully-qualifed
     name of the class (e.g. 'package1/package2/C'), the base output
-    directory (e.g. 'out'), the full output dir for the target class,
-    the length of the class data, and the class data byte array.
+    directory (e.g. 'out/1234'), the length of the class data, and the
+    class data byte array. The contents go to the content-addressed
+    store and the class file is linked to them; if another class with
+    the same name was already saved, the new contents are only kept in
+    the store, as a new version. The hash of the class data is given,
+    and loader_sig is the class signature of its loader.
 
     Returns 0 if the class was saved, 1 if the same class has already
     been saved, 2 if another class with the same name was saved.
  */
-int write_class(const string name, const string out_base_dir,
-                jint class_data_len, const unsigned char* class_data) {
-
-  string class_file_name = out_base_dir + "/" + name + ".class";
-  if (file_exists(class_file_name)) {
-    // Output file already exists, check if its contents are the
-    // same or we have another class with the same name.
-    // FILE* existing = fopen(class_file_name, "r");
-    ifstream existing;
-    existing.open(class_file_name, ios::in | ios::binary);
-    // fseek(existing, 0L, SEEK_END);
-    existing.seekg(0L, ios::end);
-    // size_t sz = ftell(existing);
-    streampos sz = existing.tellg();
-    if (sz != (streampos)class_data_len) {
-      cerr <<  "File " << class_file_name <<
-        " already exists, with different contents (different size: " << sz <<
-        " vs. " << class_data_len<< ")." << endl;
-      return 2;
-    }
-    else {
-      existing.seekg(0L, ios::beg);
-      char *mem_block = new char[class_data_len];
-      existing.read(mem_block, class_data_len);
-      // rewind(existing);
-      int different_pos = -1;
-      for (int pos = 0; pos < class_data_len; pos++)
-        if (mem_block[pos] != class_data[pos]) {
-          different_pos = pos;
-          break;
-        }
-      // fclose(existing);
-      existing.close();
-      if (different_pos == -1) {
-        cerr << "File " << class_file_name << " already exists, with same contents." << endl;
-        return 1;
-      }
-      else {
-        cerr <<  "File " << class_file_name << " already exists, with different contents (first different byte @ pos " << different_pos << " )" << endl;
-        exit(-1);
-        return 2;
-      }
-    }
-  } else {
-    /* // Replace '$' with '_' (e.g. generated proxy classes). */
-    /* for (int i = 0; i < strlen(class_file_name); i++) */
-    /*   if (class_file_name[i] == '$') */
-    /*  class_file_name[i] = '_'; */
-    cout << "* Writing " << class_file_name << " (" << class_data_len << " bytes)..." << endl;
-    ofstream class_file;
-    class_file.open(class_file_name, ios::app | ios::binary);
-    class_file.write((const char*)class_data, class_data_len);
-    class_file.close();
+int write_class(const string& name, const string& out_base_dir, const string& loader_sig,
+                const Hash128& hash, jint class_data_len, const unsigned char* class_data) {
+
+  string_view class_file_name = hook_arena.concat({out_base_dir, "/", name, ".class"});
+  string key(string_view(out_base_dir).substr(TOP_OUT_DIR.size() + 1));
+  key.append("/").append(name);
+  bool new_object = false;
+  int version = index_class(key, loader_sig, hash, &new_object);
+  if (version == 0) {
+    cerr << "File " << class_file_name << " already exists, with same contents." << endl;
+    return 1;
+  }
+
+  string object_file_name = store_object(hash, new_object, class_data_len, class_data);
+  if (version > 1) {
+    cerr << "File " << class_file_name << " already exists, with different contents; kept as version " <<
+      version << " (" << object_file_name << ")." << endl;
+    return 2;
+  }
+
+  /* // Replace '$' with '_' (e.g. generated proxy classes). */
+  /* for (int i = 0; i < strlen(class_file_name); i++) */
+  /*   if (class_file_name[i] == '$') */
+  /*  class_file_name[i] = '_'; */
+  cout << "* Writing " << class_file_name << " (" << class_data_len << " bytes)..." << endl;
+  int rc = link(object_file_name.c_str(), class_file_name.data());
+  if (rc != 0 && errno == ENOENT && !new_object) {
+    // Being written by another thread, or kept as a delta: write it
+    // too, renaming over the same bytes is harmless.
+    store_object(hash, true, class_data_len, class_data);
+    rc = link(object_file_name.c_str(), class_file_name.data());
+  }
+  if (rc != 0 && errno == EEXIST) {
+    // Leftover of an earlier run, replaced in one step.
+    string tmp_name = temp_name(string(class_file_name));
+    rc = link(object_file_name.c_str(), tmp_name.c_str());
+    if (rc == 0 && (rc = rename(tmp_name.c_str(), class_file_name.data())) != 0)
+      unlink(tmp_name.c_str());
+  }
+  if (rc != 0) {
+    // The store is on another file system: keep a copy.
+    write_file(string(class_file_name), class_data_len, class_data);
   }
   return 0;
 }
 
-/** Call hashCode() method on Java object. */
+/** Tags set on Java objects by the agent carry their kind in the top
+    byte, so that ObjectFree knows what was freed. */
+#define TAG_KIND_SHIFT 56
+#define TAG_KIND_CLASS 1L
+#define TAG_KIND_LOADER 2L
+#define TAG_ID_MASK ((1L << TAG_KIND_SHIFT) - 1)
+
+/** What the agent knows about a class loader, filled in when the
+    first class it defines is seen. */
+struct LoaderInfo {
+  int loader_status;
+  /** Class signature of the loader, or a placeholder on error. */
+  string loader_sig;
+  /** Class name of the loader, as matched by the loader filter. */
+  string loader_name;
+};
+
+/** Loaders by id. Entries are never removed and unordered_map nodes
+    are stable, so a LoaderInfo can be read after the lock is
+    released. Id 0 is the bootstrap loader. */
+static unordered_map<int, LoaderInfo> loaders;
+static pthread_rwlock_t loaders_lock = PTHREAD_RWLOCK_INITIALIZER;
+/** Serializes the registration of new loaders. */
+static pthread_mutex_t loader_register_lock = PTHREAD_MUTEX_INITIALIZER;
+static int loader_id_counter = 0;
+/** Set if the loaders cannot be tagged (no can_tag_objects). */
+static atomic<bool> loader_tags_missing(false);
+
+const LoaderInfo* find_loader(int loader_id) {
+  const LoaderInfo* info = NULL;
+  pthread_rwlock_rdlock(&loaders_lock);
+  auto it = loaders.find(loader_id);
+  if (it != loaders.end())
+    info = &it->second;
+  pthread_rwlock_unlock(&loaders_lock);
+  return info;
+}
+
+/** Reads the class of a loader. Called once per loader. */
+void read_loader_info(JNIEnv *env, const jobject loader, LoaderInfo* info) {
+  if (loader == NULL) {
+    info->loader_status = LOADER_NULL;
+    info->loader_sig = "Null-classloader";
+    info->loader_name = "<bootstrap>";
+    return;
+  }
+  jclass loader_class = env->GetObjectClass(loader);
+  if (loader_class == NULL) {
+    info->loader_status = LOADER_ERROR_1;
+    info->loader_sig = "No-classloader-error-1";
+    return;
+  }
+  JvmtiBuffer<char> loader_sig(jvmti);
+  jvmtiError err = jvmti->GetClassSignature(loader_class, loader_sig.out(), NULL);
+  if ((err == JVMTI_ERROR_NONE) && (loader_sig.get() != NULL)) {
+    info->loader_status = LOADER_OK;
+    info->loader_sig = loader_sig.get();
+    size_t len = info->loader_sig.size();
+    if (len >= 2 && loader_sig[0] == 'L' && loader_sig[len - 1] == ';')
+      info->loader_name = info->loader_sig.substr(1, len - 2);
+    else
+      info->loader_name = info->loader_sig;
+  } else {
+    info->loader_status = LOADER_ERROR_2;
+    info->loader_sig = "No-classloader-error-2";
+  }
+  env->DeleteLocalRef(loader_class);
+}
+
+/** Call hashCode() method on Java object. Only used to identify
+    loaders when they cannot be tagged. */
 int hash_code(JNIEnv *env, const jobject obj) {
   if (!obj)
     return 0;
@@ -155,286 +638,655 @@ int hash_code(JNIEnv *env, const jobject obj) {
   }
 }
 
-void add_loader(int loader_hash, string loader_name) {
-  auto f_loader = loaders.find(loader_hash);
-  if (f_loader == loaders.end()) {
-    // Loader not found, add it.
-    loaders[loader_hash] = loader_name;
+/** Registers a loader not seen before and returns its id. */
+int register_loader(JNIEnv *env, const jobject loader) {
+  pthread_mutex_lock(&loader_register_lock);
+  int id;
+  jlong tag = 0;
+  if (loader == NULL)
+    id = 0;
+  else if (loader_tags_missing)
+    id = hash_code(env, loader);
+  else if (jvmti->GetTag(loader, &tag) == JVMTI_ERROR_NONE &&
+           (tag >> TAG_KIND_SHIFT) == TAG_KIND_LOADER) {
+    // Registered by another thread since our own GetTag().
+    pthread_mutex_unlock(&loader_register_lock);
+    return (int)(tag & TAG_ID_MASK);
   } else {
-    auto f_loader_name = f_loader->second;
-    if (f_loader_name != loader_name) {
-      cerr << "Error: loader-hash already points to " << f_loader_name <<
-              " but is now attempted to point to " << loader_name;
-      exit(-1);
+    id = ++loader_id_counter;
+    if (jvmti->SetTag(loader, (TAG_KIND_LOADER << TAG_KIND_SHIFT) | id) != JVMTI_ERROR_NONE) {
+      cerr << "Loaders cannot be tagged, identifying them by hashCode()." << endl;
+      loader_tags_missing = true;
+      id = hash_code(env, loader);
     }
   }
+
+  if (find_loader(id) == NULL) {
+    LoaderInfo info;
+    read_loader_info(env, loader, &info);
+    pthread_rwlock_wrlock(&loaders_lock);
+    loaders[id] = info;
+    pthread_rwlock_unlock(&loaders_lock);
+  }
+  pthread_mutex_unlock(&loader_register_lock);
+  return id;
 }
 
-void process_classloader_info(ostream* context_stream, JNIEnv *env,
-                              const jobject loader, const int loader_hash) {
+/** Returns the id of a loader (0 for the bootstrap loader). Only the
+    first class of a loader pays for its registration; later ones
+    just read the loader tag. */
+int loader_id(JNIEnv *env, const jobject loader) {
   if (loader == NULL) {
-    *context_stream << "[Null classloader (bootstrap?)]" << endl;
-    add_loader(0, "Null-classloader");
+    static atomic<bool> bootstrap_registered(false);
+    if (!bootstrap_registered.load(memory_order_acquire)) {
+      register_loader(env, NULL);
+      bootstrap_registered.store(true, memory_order_release);
+    }
+    return 0;
   }
-  else {
-    // Show information about the class loader.
-    jclass loader_class = env->GetObjectClass(loader);
-    if (loader_class == NULL) {
-      *context_stream << "[Error retrieving classloader " << loader_hash << " (#1).]" << endl;
-      add_loader(loader_hash, "No-classloader-error-1");
+  jlong tag = 0;
+  if (!loader_tags_missing &&
+      jvmti->GetTag(loader, &tag) == JVMTI_ERROR_NONE &&
+      (tag >> TAG_KIND_SHIFT) == TAG_KIND_LOADER)
+    return (int)(tag & TAG_ID_MASK);
+  return register_loader(env, loader);
+}
+
+void process_classloader_info(ExecContext* ctx, JNIEnv *env,
+                              const jobject loader, const int loader_hash) {
+  ctx->loader_hash = loader_hash;
+  const LoaderInfo* info = find_loader(loader_hash);
+  if (info == NULL) {
+    ctx->loader_status = LOADER_ERROR_1;
+    return;
+  }
+  ctx->loader_status = info->loader_status;
+  if (info->loader_status == LOADER_OK)
+    ctx->loader_class = info->loader_sig;
+}
+
+/** Symbolic information of a method, fetched once per jmethodID. */
+struct MethodInfo {
+  string name;
+  /** The signature shown in contexts (the generic signature). */
+  string sig;
+  bool has_sig;
+  /** The method descriptor, e.g. "(Ljava/lang/String;)V". */
+  string descriptor;
+  /** Tag of the declaring class, 0 if unknown. */
+  jlong class_tag;
+  int decl_status;
+  string declaring_class;
+  jvmtiError lines_err;
+  /** Line number table, sorted by start location. */
+  vector<jvmtiLineNumberEntry> lines;
+  /** Id of the method in the calling-context tree, -1 until it is
+      first added. Guarded by context_lock. */
+  mutable int64_t context_method;
+};
+
+#define METHOD_CACHE_SHARDS 64
+struct MethodCacheShard {
+  pthread_mutex_t lock;
+  unordered_map<jmethodID, shared_ptr<const MethodInfo> > methods;
+};
+static MethodCacheShard method_cache[METHOD_CACHE_SHARDS];
+/** Cached methods per tag of their declaring class, so that they can
+    be evicted when the class is unloaded. */
+static unordered_map<jlong, vector<jmethodID> > methods_by_class;
+static pthread_mutex_t methods_by_class_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<jlong> class_tag_counter(0);
+/** Serializes the tagging of untagged classes, so that two threads
+    never give the same class two different tags. */
+static pthread_mutex_t class_tag_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The constant pool and the bytecodes of a class that has methods
+    at call sites, fetched once per class tag. */
+struct ClassCode {
+  jvmtiError pool_err;
+  vector<unsigned char> pool_bytes;
+  ClassFile pool;
+  /** Bytecodes per method; entries are never changed once added. */
+  unordered_map<jmethodID, vector<unsigned char> > bytecodes;
+};
+static unordered_map<jlong, shared_ptr<ClassCode> > class_code;
+/** Guards class_code and the bytecodes maps. */
+static pthread_mutex_t class_code_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Tags of freed (unloaded) classes. ObjectFree may not block or call
+    back into the VM, so it only pushes the tag here; the evictions
+    happen on the next cache lookup. */
+struct FreedTag {
+  jlong tag;
+  FreedTag* next;
+};
+static atomic<FreedTag*> freed_class_tags(NULL);
+
+/** Live inventory of the prepared classes (inventory=on), kept from
+    ClassPrepare events and the unloads seen as freed class tags. */
+static bool inventory_enabled = false;
+static ClassInventory class_inventory;
+
+/** Class-loading latency profile (profile=on), kept from the hook and
+    the ClassLoad and ClassPrepare events. */
+static bool profile_enabled = false;
+static LoadProfile load_profile;
+/** Number of slowest loads reported with their stacks. */
+static size_t profile_top = 20;
+
+MethodCacheShard* method_shard(jmethodID method_id) {
+  return &method_cache[((uintptr_t)method_id >> 3) % METHOD_CACHE_SHARDS];
+}
+
+void init_method_cache() {
+  for (int i = 0; i < METHOD_CACHE_SHARDS; i++)
+    pthread_mutex_init(&method_cache[i].lock, NULL);
+}
+
+void JNICALL ObjectFree(jvmtiEnv *jvmti_env, jlong tag) {
+  if ((tag >> TAG_KIND_SHIFT) == TAG_KIND_CLASS) {
+    FreedTag* freed = new FreedTag;
+    freed->tag = tag;
+    freed->next = freed_class_tags.load();
+    while (!freed_class_tags.compare_exchange_weak(freed->next, freed))
+      ;
+  }
+}
+
+/** Evicts the cached methods of the classes unloaded since the last
+    call, and removes the classes from the inventory. */
+void evict_unloaded_methods() {
+  if (freed_class_tags.load(memory_order_relaxed) == NULL)
+    return;
+  FreedTag* freed = freed_class_tags.exchange(NULL);
+  while (freed != NULL) {
+    vector<jmethodID> methods;
+    pthread_mutex_lock(&methods_by_class_lock);
+    auto it = methods_by_class.find(freed->tag);
+    if (it != methods_by_class.end()) {
+      methods.swap(it->second);
+      methods_by_class.erase(it);
     }
-    else {
-      char* loader_sig;
-      jvmtiError err = jvmti->GetClassSignature(loader_class, &loader_sig, NULL);
-      if ((err == JVMTI_ERROR_NONE) && (loader_sig != NULL)) {
-        *context_stream << "[classloader " << loader_hash << " class: " << loader_sig << "]" << endl;
-        add_loader(loader_hash, loader_sig);
-      } else {
-        *context_stream << "[Error retrieving classloader " << loader_hash << " (#2).]" << endl;
-        add_loader(loader_hash, "No-classloader-error-2");
-      }
+    pthread_mutex_unlock(&methods_by_class_lock);
+    pthread_mutex_lock(&class_code_lock);
+    class_code.erase(freed->tag);
+    pthread_mutex_unlock(&class_code_lock);
+    if (inventory_enabled)
+      class_inventory.unloaded(freed->tag & TAG_ID_MASK);
+    if (profile_enabled)
+      load_profile.unloaded(freed->tag & TAG_ID_MASK);
+    for (size_t i = 0; i < methods.size(); i++) {
+      MethodCacheShard* shard = method_shard(methods[i]);
+      pthread_mutex_lock(&shard->lock);
+      shard->methods.erase(methods[i]);
+      pthread_mutex_unlock(&shard->lock);
     }
+    FreedTag* next = freed->next;
+    delete freed;
+    freed = next;
   }
-  context_stream->flush();
 }
 
-/** Test disassembler of selected bytecode instructions. */
-void print_bc(ostream* stream, const unsigned char c) {
-  switch (c) {
-  case  18: *stream << "ldc"            ; break;
-  case  19: *stream << "ldc_w"          ; break;
-  case 178: *stream << "getstatic"      ; break;
-  case 179: *stream << "putstatic"      ; break;
-  case 182: *stream << "invokevirtual"  ; break;
-  case 183: *stream << "invokespecial"  ; break;
-  case 184: *stream << "invokestatic"   ; break;
-  case 185: *stream << "invokeinterface"; break;
-  case 186: *stream << "invokedynamic"  ; break;
-  case 187: *stream << "new"            ; break;
-  case 189: *stream << "anewarray"      ; break;
-  case 191: *stream << "athrow"         ; break;
-  case 192: *stream << "checkcast"      ; break;
-  case 193: *stream << "instanceof"     ; break;
-  case 197: *stream << "multianewarray" ; break;
-  default : *stream << "bytecode-" << c ;
-  }
+bool line_entry_before(const jvmtiLineNumberEntry& entry, jlocation location) {
+  return entry.start_location < location;
 }
 
-void count_bytecode_location(ostream* context_stream, jlocation location,
-                             jmethodID method_id) {
-  jint bytecode_count_ptr;
-  unsigned char* bytecodes_ptr;
-  jvmtiError bc_err = jvmti->GetBytecodes(method_id, &bytecode_count_ptr, &bytecodes_ptr);
-  if (bc_err == JVMTI_ERROR_NONE) {
-    char bc = bytecodes_ptr[location];
+/** Returns the tag of a class, tagging it first if needed. Returns 0
+    if objects cannot be tagged. */
+jlong class_tag(jclass klass) {
+  jlong tag = 0;
+  if (jvmti->GetTag(klass, &tag) != JVMTI_ERROR_NONE)
+    return 0;
+  if (tag != 0)
+    return tag;
+  // Checked again under the lock: another thread may have tagged it.
+  pthread_mutex_lock(&class_tag_lock);
+  if (jvmti->GetTag(klass, &tag) != JVMTI_ERROR_NONE)
+    tag = 0;
+  else if (tag == 0) {
+    tag = (TAG_KIND_CLASS << TAG_KIND_SHIFT) | ++class_tag_counter;
+    if (jvmti->SetTag(klass, tag) != JVMTI_ERROR_NONE)
+      tag = 0;
+  }
+  pthread_mutex_unlock(&class_tag_lock);
+  return tag;
+}
 
-    // No lock here, caller holds the lock.
-    // pthread_mutex_lock(&stats_lock);
-    bytecodes[(unsigned char)bc]++;
-    // pthread_mutex_unlock(&stats_lock);
+/** Asks the JVM for the symbolic information of a method. Returns
+    NULL if the method name cannot be read. */
+MethodInfo* fetch_method_info(const jmethodID method_id, jlong* declaring_class_tag) {
+  JvmtiBuffer<char> method_name(jvmti), method_desc(jvmti), method_sig(jvmti);
+  jvmtiError err = jvmti->GetMethodName(method_id, method_name.out(), method_desc.out(),
+                                        method_sig.out());
+  if (err != JVMTI_ERROR_NONE)
+    return NULL;
+  MethodInfo* info = new MethodInfo;
+  info->context_method = -1;
+  info->name = method_name.get();
+  info->has_sig = (method_sig.get() != NULL);
+  info->sig = info->has_sig ? method_sig.get() : "";
+  info->descriptor = (method_desc.get() != NULL) ? method_desc.get() : "";
 
-    *context_stream << "[bc:"; print_bc(context_stream, bc); *context_stream << "]";
+  // Find class that defines the method.
+  *declaring_class_tag = 0;
+  jclass declaring_class;
+  jvmtiError err2 = jvmti->GetMethodDeclaringClass(method_id, &declaring_class);
+  if (err2 == JVMTI_ERROR_NONE) {
+    // Find class signature.
+    JvmtiBuffer<char> class_sig(jvmti);
+    jvmtiError err3 = jvmti->GetClassSignature(declaring_class, class_sig.out(), NULL);
+    if ((err3 == JVMTI_ERROR_NONE) && (class_sig.get() != NULL)) {
+      info->decl_status = DECL_OK;
+      info->declaring_class = class_sig.get();
+    }
+    else
+      info->decl_status = DECL_ERROR_3;
+    *declaring_class_tag = class_tag(declaring_class);
   }
   else
-    *context_stream << "(error reading bytecode)";
+    info->decl_status = DECL_ERROR_2;
+  info->class_tag = *declaring_class_tag;
+
+  jint entry_count;
+  JvmtiBuffer<jvmtiLineNumberEntry> table(jvmti);
+  info->lines_err = jvmti->GetLineNumberTable(method_id, &entry_count, table.out());
+  if (info->lines_err == JVMTI_ERROR_NONE) {
+    info->lines.assign(table.get(), table.get() + entry_count);
+    sort(info->lines.begin(), info->lines.end(),
+         [](const jvmtiLineNumberEntry& a, const jvmtiLineNumberEntry& b) {
+           return a.start_location < b.start_location; });
+  }
+  return info;
 }
 
-void print_location(ostream* context_stream, const jlocation location,
-                    const jmethodID method_id, int* read_bytecode) {
-  jvmtiJlocationFormat locFormat;
-  if (location == -1) {
-    *context_stream << "(native method) ";
-    return;
+/** Returns the cached information of a method, fetching it on first
+    use. No lock is held while calling into the JVM. */
+shared_ptr<const MethodInfo> lookup_method(const jmethodID method_id) {
+  evict_unloaded_methods();
+  MethodCacheShard* shard = method_shard(method_id);
+  pthread_mutex_lock(&shard->lock);
+  auto it = shard->methods.find(method_id);
+  if (it != shard->methods.end()) {
+    shared_ptr<const MethodInfo> cached = it->second;
+    pthread_mutex_unlock(&shard->lock);
+    return cached;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  jlong declaring_class_tag;
+  MethodInfo* fetched = fetch_method_info(method_id, &declaring_class_tag);
+  if (fetched == NULL)
+    return shared_ptr<const MethodInfo>();
+  shared_ptr<const MethodInfo> info(fetched);
+  pthread_mutex_lock(&shard->lock);
+  bool inserted = shard->methods.insert(make_pair(method_id, info)).second;
+  pthread_mutex_unlock(&shard->lock);
+  if (inserted && declaring_class_tag != 0) {
+    pthread_mutex_lock(&methods_by_class_lock);
+    methods_by_class[declaring_class_tag].push_back(method_id);
+    pthread_mutex_unlock(&methods_by_class_lock);
+  }
+  return info;
+}
+
+/** Returns the code of the declaring class of a method, asking the
+    JVM for its constant pool on first use. */
+shared_ptr<ClassCode> lookup_class_code(const jmethodID method_id, const jlong tag) {
+  if (tag != 0) {
+    pthread_mutex_lock(&class_code_lock);
+    auto it = class_code.find(tag);
+    shared_ptr<ClassCode> cached = (it != class_code.end()) ? it->second : shared_ptr<ClassCode>();
+    pthread_mutex_unlock(&class_code_lock);
+    if (cached)
+      return cached;
   }
-  jvmtiError err1 = jvmti->GetJLocationFormat(&locFormat);
+
+  shared_ptr<ClassCode> code(new ClassCode);
+  jclass declaring_class;
+  code->pool_err = jvmti->GetMethodDeclaringClass(method_id, &declaring_class);
+  if (code->pool_err == JVMTI_ERROR_NONE) {
+    jint count, byte_count;
+    JvmtiBuffer<unsigned char> bytes(jvmti);
+    code->pool_err = jvmti->GetConstantPool(declaring_class, &count, &byte_count, bytes.out());
+    if (code->pool_err == JVMTI_ERROR_NONE) {
+      code->pool_bytes.assign(bytes.get(), bytes.get() + byte_count);
+      if (!code->pool.parse_pool(code->pool_bytes.data(), code->pool_bytes.size(), count))
+        code->pool_err = JVMTI_ERROR_INVALID_CLASS_FORMAT;
+    }
+  }
+  if (tag != 0) {
+    pthread_mutex_lock(&class_code_lock);
+    // Another thread may have been first.
+    code = class_code.insert(make_pair(tag, code)).first->second;
+    pthread_mutex_unlock(&class_code_lock);
+  }
+  return code;
+}
+
+/** Returns the bytecodes of a method, or NULL if they cannot be read. */
+const vector<unsigned char>* method_bytecodes(ClassCode* code, const jmethodID method_id) {
+  pthread_mutex_lock(&class_code_lock);
+  auto it = code->bytecodes.find(method_id);
+  const vector<unsigned char>* cached = (it != code->bytecodes.end()) ? &it->second : NULL;
+  pthread_mutex_unlock(&class_code_lock);
+  if (cached != NULL)
+    return cached;
+
+  jint bytecode_count;
+  JvmtiBuffer<unsigned char> bytecodes_ptr(jvmti);
+  if (jvmti->GetBytecodes(method_id, &bytecode_count, bytecodes_ptr.out()) != JVMTI_ERROR_NONE)
+    return NULL;
+  vector<unsigned char> fetched(bytecodes_ptr.get(), bytecodes_ptr.get() + bytecode_count);
+  pthread_mutex_lock(&class_code_lock);
+  // Map nodes are stable, so the vector can be read after unlocking.
+  cached = &code->bytecodes.insert(make_pair(method_id, fetched)).first->second;
+  pthread_mutex_unlock(&class_code_lock);
+  return cached;
+}
+
+/** A call site where classes were loaded lazily: the instruction at
+    a bytecode index of a method, and its resolved constant pool
+    operand. */
+struct CallSite {
+  string caller_class;
+  string caller_method;
+  string caller_descriptor;
+  jlocation bci;
+  int opcode;
+  string target;
+  int count;
+};
+/** Call sites by caller and bci. */
+static unordered_map<string, CallSite> call_sites;
+static pthread_mutex_t call_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Decodes the instruction at a call site and counts it, in the
+    opcode histogram and in the call site table. Returns the opcode.
+    A new call site is decoded without the lock held. */
+int count_call_site(const jlocation location, const jmethodID method_id,
+                    const MethodInfo* method) {
+  string key = method->declaring_class + " " + method->name + method->descriptor +
+    " " + to_string(location);
+  pthread_mutex_lock(&call_sites_lock);
+  auto it = call_sites.find(key);
+  if (it != call_sites.end()) {
+    it->second.count++;
+    int opcode = it->second.opcode;
+    pthread_mutex_unlock(&call_sites_lock);
+    hook_stats.count_opcode(opcode);
+    return opcode;
+  }
+  pthread_mutex_unlock(&call_sites_lock);
+
+  shared_ptr<ClassCode> code = lookup_class_code(method_id, method->class_tag);
+  const vector<unsigned char>* method_code = method_bytecodes(code.get(), method_id);
+  if (method_code == NULL || location < 0 || (size_t)location >= method_code->size())
+    return BC_ERROR;
+  CallSite site;
+  site.caller_class = method->declaring_class;
+  site.caller_method = method->name;
+  site.caller_descriptor = method->descriptor;
+  site.bci = location;
+  site.opcode = (*method_code)[location];
+  if (code->pool_err == JVMTI_ERROR_NONE)
+    site.target = code->pool.instruction_target(method_code->data(), method_code->size(), location);
+  site.count = 1;
+  pthread_mutex_lock(&call_sites_lock);
+  // Another thread may have decoded it in the meantime.
+  auto added = call_sites.insert(make_pair(key, site));
+  if (!added.second)
+    added.first->second.count++;
+  pthread_mutex_unlock(&call_sites_lock);
+  hook_stats.count_opcode(site.opcode);
+  return site.opcode;
+}
+
+/** Writes the call site table to out/call-sites.tsv, most frequent
+    first. */
+void write_call_sites() {
+  pthread_mutex_lock(&call_sites_lock);
+  vector<const CallSite*> sorted;
+  for (auto it = call_sites.begin(); it != call_sites.end(); ++it)
+    sorted.push_back(&it->second);
+  sort(sorted.begin(), sorted.end(), [](const CallSite* a, const CallSite* b) {
+      return a->count != b->count ? a->count > b->count :
+        tie(a->caller_class, a->caller_method, a->bci) < tie(b->caller_class, b->caller_method, b->bci); });
+  ofstream out(TOP_OUT_DIR + "/call-sites.tsv");
+  out << "caller_class\tcaller_method\tcaller_descriptor\tbci\topcode\ttarget\tcount" << endl;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    const CallSite* site = sorted[i];
+    out << site->caller_class << "\t" << site->caller_method << "\t" <<
+      site->caller_descriptor << "\t" << site->bci << "\t";
+    print_bc(&out, site->opcode);
+    out << "\t" << site->target << "\t" << site->count << endl;
+  }
+  pthread_mutex_unlock(&call_sites_lock);
+}
+
+void read_location(ContextNode* frame, const jlocation location,
+                   const jmethodID method_id, const MethodInfo* method,
+                   int* read_bytecode) {
+  // The location format is fixed for the lifetime of the VM.
+  static jvmtiJlocationFormat locFormat;
+  static jvmtiError err1 = jvmti->GetJLocationFormat(&locFormat);
+  frame->location = location;
+  frame->loc_status = LOCATION_OK;
+  frame->bytecode = BC_NONE;
+  frame->line = LINE_NONE;
+  frame->line_error = 0;
+  if (location == -1)
+    return;
   if (err1 != JVMTI_ERROR_NONE) {
-    *context_stream << "(error reading location) ";
+    frame->loc_status = LOCATION_ERROR;
     return;
   }
   else if (locFormat != JVMTI_JLOCATION_JVMBCI) {
-    *context_stream << "(unsupported location type) ";
+    frame->loc_status = LOCATION_UNSUPPORTED;
     return;
   }
   else {
-    *context_stream << "(bytecode @ position " << location <<  ") ";
     if (*read_bytecode) {
-      count_bytecode_location(context_stream, location, method_id);
+      frame->bytecode = count_call_site(location, method_id, method);
       *read_bytecode = 0;
     }
 
-    jint entry_count;
-    jvmtiLineNumberEntry* table;
-    jvmtiError lines_err = jvmti->GetLineNumberTable(method_id, &entry_count, &table);
-    if (lines_err == JVMTI_ERROR_NONE) {
-      int before = 0, found = 0;
-      for (int j = 0; j < entry_count; j++) {
-    jlocation loc = table[j].start_location;
-    if (loc < location)
-      before = 1;
-    else if ((loc >= location) && before) {
-      // This check needs one more instruction after the
-      // one we need. This should always be the case, as
-      // the last instruction is always a non-invoke
-      // (e.g. areturn).
-      *context_stream << "(candidate line number: " << table[j-1].line_number << ") ";
-      found = 1;
-      break;
-    }
-      }
-      if (!found)
-        *context_stream << "(could not determine source location) ";
+    if (method->lines_err == JVMTI_ERROR_NONE) {
+      // The line of the last entry before the first entry at or
+      // after location. This needs one more instruction after the
+      // one we need. This should always be the case, as the last
+      // instruction is always a non-invoke (e.g. areturn).
+      auto next = lower_bound(method->lines.begin(), method->lines.end(),
+                              location, line_entry_before);
+      if (next != method->lines.end() && next != method->lines.begin())
+        frame->line = (next - 1)->line_number;
     }
     else
-      *context_stream << "(source location: error " << lines_err << ") ";
+      frame->line_error = method->lines_err;
   }
 }
 
-ostream *choose_stdout_or_file(const string class_name, const string out_base_dir,
-                               const string out_dir, const int file_mode) {
-  if (file_mode == USE_STDOUT)
-    return &cout;
-  else {
-    string info_file_name = out_base_dir + "/" + class_name + ".info";
-    ofstream *context_stream = new ofstream;
-    context_stream->open(info_file_name, ios::app);
-    return context_stream;
+/** The name of the current thread. Its thread group and context
+    loader are local references, deleted through env. */
+string current_thread_name(JNIEnv *env) {
+  JvmtiThreadInfo thread(jvmti, env);
+  if (jvmti->GetThreadInfo(NULL, &thread.info) != JVMTI_ERROR_NONE || thread.info.name == NULL)
+    return "";
+  return thread.info.name;
+}
+
+uint64_t now_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Calling-context tree of the loading stacks. Methods and nodes are
+    added with context_lock held. */
+static ContextTree context_tree;
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Symbolizes a frame of the loading stack into a node of the
+    calling-context tree (its method and parent are set when the stack
+    is interned). Frame 0 also classifies the class, by its top method.
+    Returns false if the method is unknown. */
+bool read_frame(ExecContext* ctx, int i, const jvmtiFrameInfo& frame_info,
+                int* read_bytecode, ContextNode* frame,
+                shared_ptr<const MethodInfo>* frame_method) {
+  jmethodID method_id = frame_info.method;
+  shared_ptr<const MethodInfo> method = lookup_method(method_id);
+  if (!method)
+    return false;
+  *frame_method = method;
+  frame->decl_status = method->decl_status;
+  // Check topmost method to see if this class is a truly
+  // dynamically generated/loaded class. If it's not one of the
+  // known class generators/loaders, it must be due to lazy
+  // loading; in that case, set read_bytecode to check this
+  // frame's bytecode call site and record the opcode there in
+  // the stats.
+  if (i == 0) {
+    if (method->has_sig) {
+      if (method->name == "defineClass1")
+        ctx->top_kind = TOP_DEFINE_CLASS;
+      else if (method->name == "defineAnonymousClass")
+        ctx->top_kind = TOP_DEFINE_ANONYMOUS_CLASS;
+      else {
+        ctx->top_kind = TOP_UNKNOWN;
+        *read_bytecode = 1;
+      }
+    } else {
+      ctx->top_kind = TOP_UNNAMED;
+      *read_bytecode = 1;
+    }
   }
+  read_location(frame, frame_info.location, method_id, method.get(), read_bytecode);
+  return true;
 }
 
-void print_declaring_class(ostream* context_stream, const jmethodID method_id) {
-  // Find class that defines the method.
-  jclass declaring_class;
-  jvmtiError err2 = jvmti->GetMethodDeclaringClass(method_id, &declaring_class);
-  if (err2 == JVMTI_ERROR_NONE) {
-    // Find class signature.
-    char* class_sig;
-    jvmtiError err3 = jvmti->GetClassSignature(declaring_class, &class_sig, NULL);
-    if ((err3 == JVMTI_ERROR_NONE) && (class_sig != NULL))
-      *context_stream << "[declaring class: " << class_sig << "]";
-    else
-      *context_stream << "[declaring class not found (err3).]";
+/** The counter of a class, by its loading stack. Every class gets
+    exactly one, so the counters add up without a global lock. */
+int classify(const ExecContext* ctx) {
+  if (ctx->stack_status == STACK_SKIPPED)
+    return COUNT_UNCLASSIFIED;
+  if (ctx->stack_status != STACK_OK)
+    return COUNT_BY_UNKNOWN;
+  switch (ctx->top_kind) {
+  case TOP_DEFINE_CLASS           : return COUNT_BY_DEFINE_CLASS;
+  case TOP_DEFINE_ANONYMOUS_CLASS : return COUNT_BY_DEFINE_ANONYMOUS_CLASS;
+  case TOP_UNKNOWN                :
+  case TOP_UNNAMED                : return COUNT_IN_OTHER_METHODS;
+  default                         : return COUNT_BY_UNKNOWN;  // unknown top method
   }
-  else
-    *context_stream << "[declaring class not found (err2).]";
 }
 
-/** Reads the stack and finds the innermost method. */
-void write_exec_context(JNIEnv *env, const string class_name,
-                        const jobject loader, const int loader_hash,
-                        const string out_base_dir, const string out_dir,
-                        const int file_mode) {
-  const jint max_frame_count = 47;
-  jvmtiFrameInfo* frames = new jvmtiFrameInfo[max_frame_count];
-  jint count;
+/** Reads the stack and finds the innermost method. The stack is
+    interned in the calling-context tree and the context is captured
+    in ctx, to be written later as .info text or as an event of the
+    binary log. */
+void read_exec_context(JNIEnv *env, const string& class_name,
+                       const jobject loader, const int loader_hash,
+                       const int stack_depth, const STACK_MODE stack_mode,
+                       ExecContext* ctx) {
+  // Frame buffers of the loading thread, reused across its classes.
+  static thread_local vector<jvmtiFrameInfo> frames;
+  static thread_local vector<ContextNode> nodes;
+  static thread_local vector<shared_ptr<const MethodInfo> > node_methods;
+  if (frames.size() < (size_t)stack_depth)
+    frames.resize(stack_depth);
+  nodes.clear();
+  node_methods.clear();
+  jint count = 0;
   jthread current_thread = NULL;
-  ostream *context_stream = choose_stdout_or_file(class_name, out_base_dir, out_dir, file_mode);
 
-  pthread_mutex_lock(&stats_lock);
-
-  int dc = defined_by_defineClass;
-  int dac = defined_by_defineAnonymousClass;
-  int du = defined_by_unknown;
-  int dm = defined_missing;
-
-  jvmtiError err = jvmti->GetStackTrace(current_thread, 0,
-                                        max_frame_count, frames, &count);
-  if (err != JVMTI_ERROR_NONE) {
-    *context_stream << "[error reading stack trace]";
-    context_stream->flush();
-    defined_by_unknown++;
+  ctx->class_id = class_counter++;
+  ctx->class_name = class_name;
+  ctx->thread_name = current_thread_name(env);
+  ctx->timestamp = now_nanos();
+  ctx->top_kind = TOP_NONE;
+  ctx->stack_status = STACK_OK;
+  ctx->context_node = 0;
+
+  // In classify mode, only the top frame is read first.
+  jint first_count = (stack_mode == STACK_CLASSIFY) ? 1 : stack_depth;
+  jvmtiError err = JVMTI_ERROR_NONE;
+  uint64_t walk_start = monotonic_nanos();
+  if (stack_depth == 0)
+    ctx->stack_status = STACK_SKIPPED;
+  else if ((err = jvmti->GetStackTrace(current_thread, 0, first_count,
+                                       frames.data(), &count)) != JVMTI_ERROR_NONE) {
+    hook_stats.phase_done(PHASE_STACK_WALK, walk_start);
+    ctx->stack_status = STACK_ERROR;
   }
   else {
+    uint64_t symbolize_start = hook_stats.phase_done(PHASE_STACK_WALK, walk_start);
     // Flag to control bytecode reading.
     int read_bytecode = 0;
     for (int i = 0; i < count; i++) {
-      char *method_name;
-      jmethodID method_id = frames[i].method;
-      jlocation location = frames[i].location;
-      char* method_sig;
-      err = jvmti->GetMethodName(method_id, &method_name, NULL, &method_sig);
-      if (err != JVMTI_ERROR_NONE) {
-        defined_by_unknown++;
-      } else {
-        *context_stream << "{ Frame " << i << ": ";
-        // *context_stream << "Class " << class_name << " loaded while executing method: " << method_name << endl;
-        *context_stream << "* In method: " << method_name << " (signature: " <<
-                           (method_sig == NULL? "no signature" : method_sig) << ") " << endl;
-        // Check topmost method to see if this class is a truly
-        // dynamically generated/loaded class. If it's not one of the
-        // known class generators/loaders, it must be due to lazy
-        // loading; in that case, set read_bytecode to check this
-        // frame's bytecode call site and record the opcode there in
-        // the stats.
-        if (i == 0) {
-          if (method_sig != NULL) {
-            if (strcmp(method_name, "defineClass1") == 0)
-              defined_by_defineClass++;
-            else if (strcmp(method_name, "defineAnonymousClass") == 0)
-              defined_by_defineAnonymousClass++;
-            else {
-              *context_stream << "[Unknown top method!]";
-              defined_missing++;
-              read_bytecode = 1;
-            }
-          } else {
-            *context_stream << "[Unnamed top method!]";
-            defined_missing++;
-            read_bytecode = 1;
-          }
-        }
-        print_location(context_stream, location, method_id, &read_bytecode);
-        print_declaring_class(context_stream, method_id);
-        *context_stream << " }" << endl;
-        context_stream->flush();
+      nodes.push_back(ContextNode());
+      node_methods.push_back(NULL);
+      if (!read_frame(ctx, i, frames[i], &read_bytecode, &nodes.back(), &node_methods.back())) {
+        nodes.pop_back();
+        node_methods.pop_back();
+      }
+      // Classes loaded lazily or by unknown code are the interesting
+      // cases: read the rest of their stack.
+      if (i == 0 && count == 1 && first_count == 1 && stack_depth > 1 &&
+          ctx->top_kind != TOP_DEFINE_CLASS && ctx->top_kind != TOP_DEFINE_ANONYMOUS_CLASS) {
+        jint rest_count;
+        uint64_t rest_start = monotonic_nanos();
+        if (jvmti->GetStackTrace(current_thread, 1, stack_depth - 1,
+                                 frames.data() + 1, &rest_count) == JVMTI_ERROR_NONE)
+          count += rest_count;
+        // Not part of the symbolization time.
+        uint64_t rest_done = hook_stats.phase_done(PHASE_STACK_WALK, rest_start);
+        symbolize_start += rest_done - rest_start;
       }
     }
-    if (count == 0) {
-      *context_stream << "[empty stack trace]" << endl;
-      context_stream->flush();
-      defined_by_unknown++;
+    if (count > 0)
+      hook_stats.phase_done(PHASE_SYMBOLIZE, symbolize_start);
+    // Outermost frame first, from the root down. Only this part,
+    // which makes no JVMTI call, is serialized.
+    uint32_t node = 0;
+    if (!nodes.empty()) {
+      hook_stats.lock_timed(&context_lock, PHASE_CONTEXT_WAIT);
+      for (size_t i = nodes.size(); i-- > 0; ) {
+        const MethodInfo* method = node_methods[i].get();
+        if (method->context_method < 0)
+          method->context_method = context_tree.add_method(method->name, method->sig,
+                                                           method->declaring_class);
+        nodes[i].method = method->context_method;
+        nodes[i].parent = node;
+        node = context_tree.child(nodes[i]);
+      }
+      pthread_mutex_unlock(&context_lock);
     }
+    ctx->context_node = node;
+    if (count == 0)
+      ctx->stack_status = STACK_EMPTY;
   }
-  free(frames);
+  hook_stats.count(classify(ctx));
 
-  // Sanity check to see if class did not register (or was counted
-  // more than once).
-  int sum_before = dm + du + dc + dac;
-  int sum_after = defined_missing + defined_by_unknown + defined_by_defineClass + defined_by_defineAnonymousClass;
-  if ((sum_before + 1) != (sum_after)) {
-    cerr << "[Class stats check failed: diffs: " <<
-      defined_missing - dm << ", " <<
-      defined_by_unknown - du << ", " <<
-      defined_by_defineClass - dc << ", " <<
-      defined_by_defineAnonymousClass - dac << "] ";
-  }
-
-  process_classloader_info(context_stream, env, loader, loader_hash);
-
-  pthread_mutex_unlock(&stats_lock);
-
-  // // TODO: close
-  // if (file_mode != USE_STDOUT)
-  //   context_stream->close();
+  process_classloader_info(ctx, env, loader, loader_hash);
 }
 
 void printLoadedClasses(ostream* context_stream) {
   jint class_count;
-  jclass* classes;
-  jvmtiError err0 = jvmti->GetLoadedClasses(&class_count, &classes);
+  JvmtiBuffer<jclass> classes(jvmti);
+  jvmtiError err0 = jvmti->GetLoadedClasses(&class_count, classes.out());
   if (err0 == JVMTI_ERROR_NONE) {
     *context_stream << class_count << " loaded classes." << endl;
     for (int i=0; i<class_count; i++) {
       // Find class signature.
-      char* class_sig;
-      jvmtiError err1 = jvmti->GetClassSignature(classes[i], &class_sig, NULL);
-      if ((err1 == JVMTI_ERROR_NONE) && (class_sig != NULL)) {
+      JvmtiBuffer<char> class_sig(jvmti);
+      jvmtiError err1 = jvmti->GetClassSignature(classes[i], class_sig.out(), NULL);
+      if ((err1 == JVMTI_ERROR_NONE) && (class_sig.get() != NULL)) {
         jint field_count;
-        jfieldID* fields;
-        jvmtiError err2 = jvmti->GetClassFields(classes[i], &field_count, &fields);
+        JvmtiBuffer<jfieldID> fields(jvmti);
+        jvmtiError err2 = jvmti->GetClassFields(classes[i], &field_count, fields.out());
         if (err2 == JVMTI_ERROR_NONE)
-          *context_stream << "[class: " << class_sig << " (" << field_count << " fields)]" << endl;
+          *context_stream << "[class: " << class_sig.get() << " (" << field_count << " fields)]" << endl;
         else
-          *context_stream << "[class: " << class_sig << " (cannot retrieve fields, error code " << err2 << ")]" << endl;
+          *context_stream << "[class: " << class_sig.get() << " (cannot retrieve fields, error code " << err2 << ")]" << endl;
         context_stream->flush();
       }
       else {
@@ -445,14 +1297,616 @@ void printLoadedClasses(ostream* context_stream) {
   }
 }
 
-void record_class(JNIEnv *env, const string class_name, const jobject loader,
-                  const int loader_hash, const string out_base_dir,
-                  const string out_dir, const int file_mode,
-                  jint class_data_len, const unsigned char* class_data) {
-  make_dirs(out_dir);
-  write_class(class_name, out_base_dir, class_data_len, class_data);
-  write_exec_context(env, class_name, loader, loader_hash, out_base_dir,
-                     out_dir, file_mode);
+/** A captured class, copied out of the hook so that a writer thread
+    can persist it after the hook has returned. */
+struct CaptureRecord {
+  string class_name;
+  int loader_hash;
+  /** Set for redefinitions and retransformations. */
+  bool redefined;
+  string out_base_dir;
+  string out_dir;
+  int file_mode;
+  ExecContext context;
+  jint class_data_len;
+  unsigned char* class_data;
+};
+
+/** Bounded multi-producer/multi-consumer queue of capture records
+    (Vyukov's array-based queue). Enqueue and dequeue are lock-free;
+    they return false when the queue is full or empty respectively. */
+class RecordQueue {
+  struct Cell {
+    atomic<unsigned long> seq;
+    CaptureRecord* rec;
+  };
+  Cell* cells;
+  unsigned long mask;
+  char pad0[64];
+  atomic<unsigned long> enqueue_pos;
+  char pad1[64];
+  atomic<unsigned long> dequeue_pos;
+
+public:
+  void init(unsigned long capacity) {
+    unsigned long size = 2;
+    while (size < capacity)
+      size <<= 1;
+    cells = new Cell[size];
+    for (unsigned long i = 0; i < size; i++)
+      cells[i].seq.store(i, memory_order_relaxed);
+    mask = size - 1;
+    enqueue_pos.store(0, memory_order_relaxed);
+    dequeue_pos.store(0, memory_order_relaxed);
+  }
+
+  bool enqueue(CaptureRecord* rec) {
+    unsigned long pos = enqueue_pos.load(memory_order_relaxed);
+    for (;;) {
+      Cell* cell = &cells[pos & mask];
+      unsigned long seq = cell->seq.load(memory_order_acquire);
+      long diff = (long)seq - (long)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          cell->rec = rec;
+          cell->seq.store(pos + 1, memory_order_release);
+          return true;
+        }
+      } else if (diff < 0)
+        return false;
+      else
+        pos = enqueue_pos.load(memory_order_relaxed);
+    }
+  }
+
+  bool dequeue(CaptureRecord** rec) {
+    unsigned long pos = dequeue_pos.load(memory_order_relaxed);
+    for (;;) {
+      Cell* cell = &cells[pos & mask];
+      unsigned long seq = cell->seq.load(memory_order_acquire);
+      long diff = (long)seq - (long)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          *rec = cell->rec;
+          cell->seq.store(pos + mask + 1, memory_order_release);
+          return true;
+        }
+      } else if (diff < 0)
+        return false;
+      else
+        pos = dequeue_pos.load(memory_order_relaxed);
+    }
+  }
+};
+
+static RecordQueue capture_queue;
+/** Counts queued records, wakes writers. */
+static sem_t queue_items;
+/** Counts free queue slots, used to block producers. */
+static sem_t queue_slots;
+/** Records enqueued but not yet taken by a writer. */
+static atomic<long> queue_pending(0);
+/** Records submitted to the writers (or being spilled) and not yet
+    persisted: unlike queue_pending, only decremented once the record
+    is written. */
+static atomic<long> records_in_flight(0);
+static atomic<bool> writers_stopping(false);
+static pthread_t* writer_threads = NULL;
+static atomic<long> records_dropped(0);
+static atomic<long> records_spilled(0);
+
+/** Writers persisting different records may still race on the same
+    class name (and thus the same files), so the file work for a name
+    is serialized on one of these striped locks. */
+#define NAME_LOCKS 64
+static pthread_mutex_t name_locks[NAME_LOCKS];
+
+pthread_mutex_t* name_lock(const string& class_name) {
+  return &name_locks[hash<string>()(class_name) % NAME_LOCKS];
+}
+
+/** A JAR being streamed to disk. Entries are written as classes
+    arrive; the central directory is written at unload, or when the
+    outputs are rotated. */
+struct CaptureArchive {
+  string path;
+  ZipWriter zip;
+  /** Set once the file of the current segment has been created (or
+      has failed to be). */
+  bool opened;
+  pthread_mutex_t lock;
+  /** Content hash of every class entry, to detect duplicates. */
+  unordered_map<string, Hash128> classes;
+  /** Number of contexts written for each class. */
+  map<string, int> contexts;
+};
+
+static map<string, CaptureArchive*> archives;
+static pthread_mutex_t archives_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Creates the file of an archive and adds the manifest. Called with
+    the archive locked. */
+void open_archive(CaptureArchive* archive) {
+  archive->opened = true;
+  make_dirs(TOP_OUT_DIR);
+  if (!archive->zip.open(archive->path))
+    cerr << "Could not create archive " << archive->path << ": " << strerror(errno) << endl;
+  else if (!jar_manifest.empty()) {
+    ifstream manifest(jar_manifest, ios::in | ios::binary);
+    if (!manifest)
+      cerr << "Could not read manifest " << jar_manifest << endl;
+    string contents((istreambuf_iterator<char>(manifest)), istreambuf_iterator<char>());
+    archive->zip.add("META-INF/MANIFEST.MF", (const unsigned char*)contents.data(),
+                     contents.size(), jar_compression);
+  }
+}
+
+/** Returns the archive that a record goes to, creating it on first
+    use. Archives are never deleted, so the pointer stays valid. */
+CaptureArchive* archive_for(const CaptureRecord* rec) {
+  string path = (output_mode == OUT_JAR) ?
+    TOP_OUT_DIR + "/loaded-classes.jar" : rec->out_base_dir + ".jar";
+  pthread_mutex_lock(&archives_lock);
+  CaptureArchive* archive = archives[path];
+  if (archive == NULL) {
+    archive = new CaptureArchive;
+    archive->path = path;
+    archive->opened = false;
+    pthread_mutex_init(&archive->lock, NULL);
+    archives[path] = archive;
+  }
+  pthread_mutex_unlock(&archives_lock);
+  return archive;
+}
+
+/** Adds the bytecode and the context of a record to its archive. A
+    class already in the archive is only written once; a different
+    class with the same name is kept as a new version. Every version is
+    also put in the content-addressed store, which classes.manifest,
+    class-versions and the redefinitions read it back from. */
+void archive_record(CaptureRecord* rec, const string& loader_sig, const Hash128& hash,
+                    bool unchanged) {
+  // unchanged: saved by an earlier run or as a redefinition.
+  CaptureArchive* archive = archive_for(rec);
+  string entry_name = rec->class_name + ".class";
+  bool new_object = false;
+  int version = unchanged ? 0 :
+    index_class(to_string(rec->loader_hash) + "/" + rec->class_name, loader_sig, hash, &new_object);
+  string object_file_name;
+  if (!unchanged)
+    object_file_name = store_object(hash, new_object, rec->class_data_len, rec->class_data);
+
+  pthread_mutex_lock(&archive->lock);
+  if (!archive->opened)
+    open_archive(archive);
+  auto existing = archive->classes.find(entry_name);
+  if (unchanged)
+    cout << "* Skipping " << entry_name << " (already saved)" << endl;
+  else if (existing == archive->classes.end()) {
+    cout << "* Adding " << entry_name << " (" << rec->class_data_len << " bytes)..." << endl;
+    archive->zip.add(entry_name, rec->class_data, rec->class_data_len, jar_compression);
+    archive->classes[entry_name] = hash;
+  } else if (existing->second == hash)
+    cerr << "Entry " << entry_name << " already exists, with same contents." << endl;
+  else {
+    // Another loader (same archive) or another version of the class.
+    cerr << "Entry " << entry_name << " already exists, with different contents; kept as version " <<
+      (version == 0 ? 1 : version) << " (" << object_file_name << ")." << endl;
+  }
+
+  if (context_mode == CONTEXT_INFO) {
+    ostringstream context_text;
+    format_exec_context(&context_text, rec->context);
+    if (rec->file_mode == USE_STDOUT)
+      cout << context_text.str();
+    else {
+      // Entries cannot be appended to, so repeated contexts of the same
+      // class get numbered entries (C.info, C.2.info, ...).
+      int n = ++archive->contexts[rec->class_name];
+      string info_name = rec->class_name + (n == 1 ? "" : "." + to_string(n)) + ".info";
+      string text = context_text.str();
+      archive->zip.add(info_name, (const unsigned char*)text.data(), text.size(), jar_compression);
+    }
+  }
+  pthread_mutex_unlock(&archive->lock);
+}
+
+/** The name of a file of an output segment: out/events.bin becomes
+    out/events.<segment>.bin. */
+string segment_name(const string& path, int segment) {
+  size_t slash = path.rfind('/');
+  size_t dot = path.rfind('.');
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    dot = path.size();
+  return path.substr(0, dot) + "." + to_string(segment) + path.substr(dot);
+}
+
+/** Writes the central directories of all archives. With a segment
+    number, the archives are renamed after that segment, and the next
+    classes go to new archives. */
+void close_archives(int segment = 0) {
+  pthread_mutex_lock(&archives_lock);
+  for (auto it = archives.begin(); it != archives.end(); ++it) {
+    CaptureArchive* archive = it->second;
+    pthread_mutex_lock(&archive->lock);
+    if (archive->zip.is_open()) {
+      size_t entry_count = archive->zip.get_entries().size();
+      string name = (segment == 0) ? it->first : segment_name(it->first, segment);
+      bool ok = archive->zip.close() &&
+        (segment == 0 || rename(it->first.c_str(), name.c_str()) == 0);
+      if (ok)
+        cerr << "Wrote " << name << " (" << entry_count << " entries)." << endl;
+      else
+        cerr << "Error writing " << name << endl;
+    }
+    if (segment != 0) {
+      archive->opened = false;
+      archive->classes.clear();
+      archive->contexts.clear();
+    }
+    pthread_mutex_unlock(&archive->lock);
+  }
+  pthread_mutex_unlock(&archives_lock);
+}
+
+/** The binary event log (context=events), opened on first use. */
+static EventLogWriter event_log;
+static pthread_mutex_t event_log_lock = PTHREAD_MUTEX_INITIALIZER;
+#define EVENT_LOG_BUFFER_SIZE (4 * 1024 * 1024)
+
+void append_event(const ExecContext& ctx) {
+  pthread_mutex_lock(&event_log_lock);
+  if (!event_log.is_open()) {
+    make_dirs(TOP_OUT_DIR);
+    string log_name = TOP_OUT_DIR + "/events.bin";
+    if (!event_log.open(log_name, EVENT_LOG_BUFFER_SIZE))
+      cerr << "Could not create " << log_name << ": " << strerror(errno) << endl;
+  }
+  event_log.append(ctx, context_tree);
+  pthread_mutex_unlock(&event_log_lock);
+}
+
+/** Closes the event log. With a segment number, it is renamed after
+    that segment, and the next event starts a new log. */
+void close_event_log(int segment = 0) {
+  pthread_mutex_lock(&event_log_lock);
+  if (event_log.is_open()) {
+    uint64_t size = event_log.get_bytes_written();
+    string log_name = TOP_OUT_DIR + "/events.bin";
+    string name = (segment == 0) ? log_name : segment_name(log_name, segment);
+    if (event_log.close() && (segment == 0 || rename(log_name.c_str(), name.c_str()) == 0))
+      cerr << "Wrote " << name << " (" << size << " bytes)." << endl;
+    else
+      cerr << "Error writing " << name << endl;
+  }
+  pthread_mutex_unlock(&event_log_lock);
+}
+
+/** Whether the classes retransformed by other agents are captured
+    (retransform=on). Off by default: a JVMTI environment that can
+    retransform makes HotSpot keep the original bytes of every class
+    loaded while the hook is enabled. */
+static bool retransform_enabled = false;
+/** The hash of the latest version of the classes redefined so far, by
+    key, to diff the next redefinition against. Its contents are read
+    back from the store. */
+static unordered_map<string, Hash128> latest_versions;
+/** Longest chain of deltas to read back to rebuild a version; a
+    version whose base is at the end of a chain this long is stored in
+    full. */
+static const int MAX_DELTA_CHAIN = 8;
+/** Redefinition index, one "<key> <version> <hash> <class id>
+    <storage>" line per redefinition. */
+static FILE* redefinitions_index = NULL;
+/** Guards latest_versions and redefinitions_index. Taken before
+    class_index_lock. */
+static pthread_mutex_t redefinitions_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<long> classes_redefined(0);
+
+/** The hash of the latest version recorded under a key. */
+bool last_version(const string& key, Hash128* hash) {
+  pthread_mutex_lock(&class_index_lock);
+  auto it = class_versions.find(key);
+  bool found = (it != class_versions.end() && !it->second.empty());
+  if (found)
+    *hash = it->second.back();
+  pthread_mutex_unlock(&class_index_lock);
+  return found;
+}
+
+bool read_file(const string& file_name, vector<unsigned char>* data) {
+  ifstream in(file_name, ios::binary);
+  if (!in)
+    return false;
+  data->assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  return !in.bad();
+}
+
+/** Reads contents back from the store, applying the chain of deltas
+    that leads to them (as class-versions does). Sets chain to the
+    number of deltas applied. */
+bool read_object(const string& hex, vector<unsigned char>* data, int* chain) {
+  string prefix = STORE_DIR + "/" + hex.substr(0, 2) + "/" + hex.substr(2);
+  *chain = 0;
+  if (read_file(prefix + ".class", data))
+    return true;
+  vector<unsigned char> delta, base;
+  if (!read_file(prefix + ".delta", &delta))
+    return false;
+  string base_hex = delta_base_hex(delta.data(), delta.size());
+  if (base_hex.empty() || !read_object(base_hex, &base, chain))
+    return false;
+  (*chain)++;
+  return apply_delta(base.data(), base.size(), delta.data(), delta.size(), data);
+}
+
+/** Saves a redefined (or retransformed) class as a new version of
+    its key, as a delta against the version it replaces when that one
+    can be read back, else in full. The redefinition index links the
+    version to the class id of its context (the stack that triggered
+    it). Returns false if the class has no earlier version, for the
+    caller to save it as a newly captured class. */
+bool store_redefinition(const CaptureRecord* rec, const string& loader_sig, const Hash128& hash) {
+  string key = to_string(rec->loader_hash) + "/" + rec->class_name;
+  pthread_mutex_lock(&redefinitions_lock);
+  Hash128 base_hash;
+  auto latest = latest_versions.find(key);
+  if (latest != latest_versions.end())
+    base_hash = latest->second;
+  else if (!last_version(key, &base_hash)) {
+    pthread_mutex_unlock(&redefinitions_lock);
+    return false;
+  }
+  vector<unsigned char> base;
+  int chain = 0;
+  if (!read_object(base_hash.to_hex(), &base, &chain)) {
+    cerr << "Could not read version " << base_hash.to_hex() << " of " << key <<
+      " from " << STORE_DIR << ", storing the new version in full." << endl;
+    base.clear();
+  } else if (chain >= MAX_DELTA_CHAIN)
+    base.clear();
+
+  classes_redefined++;
+  bool new_object = false;
+  int version = index_class(key, loader_sig, hash, &new_object);
+  string storage;
+  if (version == 0)
+    storage = "same";             // back to contents seen before
+  else if (!new_object)
+    storage = "stored";
+  else {
+    string object_dir;
+    string object_file_name = object_path(hash, &object_dir);
+    vector<unsigned char> delta;
+    if (!base.empty())
+      encode_delta(base.data(), base.size(), rec->class_data, rec->class_data_len,
+                   base_hash.to_hex(), &delta);
+    if (!base.empty() && delta.size() < (size_t)rec->class_data_len) {
+      string delta_file_name = object_file_name.substr(0, object_file_name.size() - 6) + ".delta";
+      if (write_file(delta_file_name, delta.size(), delta.data())) {
+        store_index.insert(hash);
+        storage = "delta:" + base_hash.to_hex();
+      } else {
+        cerr << "Could not write " << delta_file_name << endl;
+        pthread_mutex_lock(&class_index_lock);
+        stored_objects.erase(hash);
+        pthread_mutex_unlock(&class_index_lock);
+        storage = "failed";
+      }
+    } else {
+      store_object(hash, true, rec->class_data_len, rec->class_data);
+      // store_object reports a failed write; tell it apart in the index.
+      storage = access(object_file_name.c_str(), F_OK) == 0 ? "full" : "failed";
+    }
+  }
+  cout << "* Redefined " << key << ": version " << version << " (" << storage << ")" << endl;
+
+  if (redefinitions_index == NULL) {
+    string index_name = TOP_OUT_DIR + "/redefinitions.index";
+    redefinitions_index = fopen(index_name.c_str(), "w");
+    if (redefinitions_index == NULL)
+      cerr << "Could not create " << index_name << ": " << strerror(errno) << endl;
+  }
+  if (redefinitions_index != NULL) {
+    fprintf(redefinitions_index, "%s %d %s %lu %s\n", key.c_str(), version, hash.to_hex().c_str(),
+            (unsigned long)rec->context.class_id, storage.c_str());
+    fflush(redefinitions_index);
+  }
+  latest_versions[key] = hash;
+  pthread_mutex_unlock(&redefinitions_lock);
+  return true;
+}
+
+void close_redefinitions_index() {
+  pthread_mutex_lock(&redefinitions_lock);
+  if (redefinitions_index != NULL)
+    fclose(redefinitions_index);
+  redefinitions_index = NULL;
+  pthread_mutex_unlock(&redefinitions_lock);
+}
+
+/** Does the directory and file work for a record: creates the output
+    directory, saves the bytecode, and appends the execution context. */
+void persist_record(CaptureRecord* rec) {
+  if (context_mode == CONTEXT_EVENTS)
+    append_event(rec->context);
+  else
+    context_tree.frames(rec->context.context_node, &rec->context.frames);
+
+  // Classes captured unchanged by an earlier run are not written
+  // again, and redefinitions go to the store as new versions.
+  const LoaderInfo* loader = find_loader(rec->loader_hash);
+  const string loader_sig = (loader != NULL) ? loader->loader_sig : "No-classloader-error-1";
+  Hash128 hash = hash128(rec->class_data, rec->class_data_len);
+  bool unchanged = false;
+  if (rec->redefined)
+    unchanged = store_redefinition(rec, loader_sig, hash);
+  else if ((unchanged = in_base(loader_sig, rec->class_name, hash)))
+    classes_unchanged++;
+
+  if (output_mode != OUT_DIRS) {
+    uint64_t write_start = monotonic_nanos();
+    archive_record(rec, loader_sig, hash, unchanged);
+    hook_stats.phase_done(PHASE_WRITE_CLASS, write_start);
+    return;
+  }
+  if (unchanged && context_mode != CONTEXT_INFO)
+    return;
+  pthread_mutex_t* lock = name_lock(rec->class_name);
+  pthread_mutex_lock(lock);
+  uint64_t dirs_start = monotonic_nanos();
+  make_dirs(rec->out_dir);
+  uint64_t write_start = hook_stats.phase_done(PHASE_MAKE_DIRS, dirs_start);
+  if (!unchanged)
+    write_class(rec->class_name, rec->out_base_dir, loader_sig, hash,
+                rec->class_data_len, rec->class_data);
+  hook_stats.phase_done(PHASE_WRITE_CLASS, write_start);
+  if (context_mode == CONTEXT_INFO) {
+    ofstream info_stream;
+    ostream *context_stream = &cout;
+    if (rec->file_mode != USE_STDOUT) {
+      info_stream.open(rec->out_base_dir + "/" + rec->class_name + ".info", ios::app);
+      context_stream = &info_stream;
+    }
+    format_exec_context(context_stream, rec->context);
+    context_stream->flush();
+  }
+  pthread_mutex_unlock(lock);
+}
+
+void free_record(CaptureRecord* rec) {
+  free(rec->class_data);
+  delete rec;
+}
+
+/** Body of a background writer thread: persists queued records until
+    the agent unloads and the queue is drained. */
+void* writer_loop(void* arg) {
+  for (;;) {
+    sem_wait(&queue_items);
+    CaptureRecord* rec;
+    // A producer may have claimed a cell but not published it yet,
+    // so retry until the record shows up.
+    while (!capture_queue.dequeue(&rec)) {
+      if (writers_stopping.load() && queue_pending.load() == 0)
+        return NULL;
+      sched_yield();
+    }
+    queue_pending--;
+    sem_post(&queue_slots);
+    persist_record(rec);
+    free_record(rec);
+    hook_arena.reset();
+    records_in_flight--;
+  }
+}
+
+/** Hands a record over to the writer threads, applying the queue-full
+    policy when no slot is free. */
+void submit_record(CaptureRecord* rec) {
+  if (queue_full_policy == FULL_BLOCK) {
+    while (sem_wait(&queue_slots) != 0)
+      ;
+  } else if (sem_trywait(&queue_slots) != 0) {
+    if (queue_full_policy == FULL_DROP) {
+      records_dropped++;
+      cerr << "Capture queue full, dropping class " << rec->class_name << endl;
+    } else {
+      records_spilled++;
+      records_in_flight++;
+      persist_record(rec);
+      records_in_flight--;
+    }
+    free_record(rec);
+    return;
+  }
+  records_in_flight++;
+  queue_pending++;
+  while (!capture_queue.enqueue(rec))
+    sched_yield();
+  sem_post(&queue_items);
+}
+
+void start_writers() {
+  capture_queue.init(queue_capacity);
+  sem_init(&queue_items, 0, 0);
+  sem_init(&queue_slots, 0, queue_capacity);
+  for (int i = 0; i < NAME_LOCKS; i++)
+    pthread_mutex_init(&name_locks[i], NULL);
+  writer_threads = new pthread_t[writer_count];
+  for (int i = 0; i < writer_count; i++)
+    pthread_create(&writer_threads[i], NULL, writer_loop, NULL);
+}
+
+/** Wakes up all writers and waits until they have drained the queue. */
+void drain_writers() {
+  if (writer_threads == NULL)
+    return;
+  cerr << "Draining capture queue (" << queue_pending.load() << " pending)..." << endl;
+  writers_stopping.store(true);
+  for (int i = 0; i < writer_count; i++)
+    sem_post(&queue_items);
+  for (int i = 0; i < writer_count; i++)
+    pthread_join(writer_threads[i], NULL);
+  delete[] writer_threads;
+  writer_threads = NULL;
+}
+
+void record_class(JNIEnv *env, string_view class_name, const jobject loader,
+                  const int loader_hash, string_view out_base_dir,
+                  string_view out_dir, const int file_mode, const int level,
+                  const bool redefined, jint class_data_len, const unsigned char* class_data) {
+  CaptureRecord* rec = new CaptureRecord;
+  rec->class_name = class_name;
+  rec->loader_hash = loader_hash;
+  rec->redefined = redefined;
+  rec->out_base_dir = out_base_dir;
+  rec->out_dir = out_dir;
+  rec->file_mode = file_mode;
+  rec->class_data_len = class_data_len;
+  // Lower capture levels read less of the stack.
+  if (level == LEVEL_FULL)
+    read_exec_context(env, rec->class_name, loader, loader_hash, stack_depth, stack_mode, &rec->context);
+  else if (level == LEVEL_TOP_FRAME)
+    read_exec_context(env, rec->class_name, loader, loader_hash, min(stack_depth, 1), STACK_FULL, &rec->context);
+  else
+    read_exec_context(env, rec->class_name, loader, loader_hash, 0, STACK_FULL, &rec->context);
+  governor.count_class(level);
+  if (profile_enabled && !redefined)
+    load_profile.captured(rec->context);
+
+  if (writer_count == 0) {
+    rec->class_data = (unsigned char*)class_data;
+    persist_record(rec);
+    delete rec;
+    return;
+  }
+
+  // Asynchronous mode: only copy the bytecode and the stack-derived
+  // context, the file work happens in the writer threads.
+  rec->class_data = (unsigned char*)malloc(class_data_len);
+  memcpy(rec->class_data, class_data, class_data_len);
+  submit_record(rec);
+}
+
+/** Accounts the time of a hook call and releases its scratch memory. */
+void hook_done(OverheadGovernor::ThreadTime* hook_time, uint64_t hook_start) {
+  hook_arena.reset();
+  hook_stats.record(PHASE_HOOK, monotonic_nanos() - hook_start);
+  governor.hook_done(hook_time, hook_start, class_counter.load());
+}
+
+/** Outcome of the last unnamed class (name == NULL) seen by the hook
+    on this thread, -1 if none. Such classes are prepared by the thread
+    that defines them, right after the hook. */
+static thread_local int unnamed_hook_outcome = -1;
+
+/** Reports what the hook did with a class to the inventory. */
+void inventory_hook_outcome(int loader_id, const char* name, int outcome) {
+  if (name == NULL)
+    unnamed_hook_outcome = outcome;
+  else
+    class_inventory.hook_outcome(loader_id, name, outcome);
 }
 
 /** The hook that instruments class loading and captures all generated
@@ -463,136 +1917,798 @@ ClassFileLoadHook(jvmtiEnv *jvmti_env, JNIEnv *env, jclass class_being_redefined
         jint class_data_len, const unsigned char* class_data,
         jint *new_class_data_len, unsigned char** new_class_data) {
 
-  static int anonymous_class_counter = 0;
-
-  if (SERIALIZE)
-    pthread_mutex_lock(&serialize_lock);
-
-  pthread_mutex_lock(&stats_lock);
-  defined_sum++;
-  pthread_mutex_unlock(&stats_lock);
+  static atomic<int> anonymous_class_counter(0);
+  if (!capture_enabled.load(memory_order_relaxed))
+    return;
+  uint64_t hook_start = monotonic_nanos();
+  OverheadGovernor::ThreadTime* hook_time = governor.current_thread();
+  if (hook_time == NULL)
+    hook_time = governor.register_thread(hook_start);
+  const int level = governor.get_level();
+
+  // Redefined and retransformed classes (hot swap, other agents) are
+  // kept as new versions of the class.
+  const bool redefined = (class_being_redefined != NULL);
+
+  // Filter before any JNI/JVMTI work or locking, so that ignored
+  // classes cost only a trie walk (and a loader tag read if loaders
+  // are filtered).
+  bool ignored = ((name != NULL && !class_filter.accepts(name)) ||
+                  (!loader_filter.empty() &&
+                   !loader_filter.accepts(find_loader(loader_id(env, loader))->loader_name.c_str())));
+  hook_stats.phase_done(PHASE_FILTER, hook_start);
+  // Over the overhead budget, only one class in every few is captured.
+  bool sampled_out = !ignored && level == LEVEL_SAMPLED && !governor.sample();
+  if (ignored || sampled_out) {
+    hook_stats.count(COUNT_DEFINED);
+    hook_stats.count(ignored ? COUNT_IGNORED : COUNT_SAMPLED_OUT);
+    if (inventory_enabled && !redefined)
+      inventory_hook_outcome(loader_id(env, loader), name,
+                             ignored ? CLASS_IGNORED : CLASS_SAMPLED_OUT);
+    if (profile_enabled && !redefined) {
+      load_profile.hooked(loader_id(env, loader), name, hook_start);
+      load_profile.hook_returned(monotonic_nanos());
+    }
+    hook_done(hook_time, hook_start);
+    return;
+  }
 
-  int loader_hash = hash_code(env, loader);
-  string out_base_dir = TOP_OUT_DIR + "/" + to_string(loader_hash);
-  string out_dir;
+  // Named here, past the filter: reading the name is a JVMTI call.
+  if (!hook_time->named)
+    governor.name_thread(hook_time, current_thread_name(env));
+
+  // With writer threads the hook does no file work, so there is
+  // nothing left to serialize.
+  const bool serialize = SERIALIZE && (writer_count == 0);
+
+  if (serialize)
+    hook_stats.lock_timed(&serialize_lock, PHASE_SERIALIZE_WAIT);
+
+  hook_stats.count(COUNT_DEFINED);
+
+  uint64_t loader_start = monotonic_nanos();
+  int loader_hash = loader_id(env, loader);
+  hook_stats.phase_done(PHASE_LOADER, loader_start);
+  if (inventory_enabled && !redefined)
+    inventory_hook_outcome(loader_hash, name, CLASS_CAPTURED);
+  if (profile_enabled && !redefined)
+    load_profile.hooked(loader_hash, name, hook_start);
+  // The paths only live until the hook returns: they are assembled in
+  // the arena and copied once, into the capture record.
+  string_view out_base_dir = hook_arena.concat({TOP_OUT_DIR, "/", hook_arena.number(loader_hash)});
+  string_view out_dir;
   OUTPUT_MODE file_mode = USE_FILE;
 
-  // This failure is mostly for diagnostic reasons. If we remove this
-  // check, we may end up with same-name classes, as in the case of
-  // the anonymous lambda classes.
-  if (class_being_redefined != NULL) {
-    cerr << "Class redefinition is currently not suported." << endl;
-    exit(-1);
-  }
-
   // If no name is given (e.g. lambdas), then produce an
   // auto-generated name for the .class file name.
   if (name == 0) {
 
-    pthread_mutex_lock(&stats_lock);
-    anonymous_class_counter++;
-    pthread_mutex_unlock(&stats_lock);
-
-    cout << "Anonymous class #" << anonymous_class_counter << " found." << endl;
-    string anon_name = "AnonGeneratedClass_" + to_string(anonymous_class_counter);
-    cout << "* Class name: " << anon_name << endl;
+    int anonymous_class = ++anonymous_class_counter;
+    string_view anon_name = hook_arena.concat({"AnonGeneratedClass_",
+                                               hook_arena.number(anonymous_class)});
 
     record_class(env, anon_name, loader, loader_hash, out_base_dir, out_base_dir,
-                 file_mode, class_data_len, class_data);
+                 file_mode, level, redefined, class_data_len, class_data);
   }
   else {
-    string name_s(name);
-    // Ignore built-in classes.
-    int builtIn = starts_with("java/", name) || starts_with("javax/", name) || starts_with("com/sun", name) || starts_with("sun/", name) || starts_with("jdk/", name);
-    if (builtIn) {
-      // cout << "Ignoring built-in class: " << name << endl;
-
-      pthread_mutex_lock(&stats_lock);
-      defined_but_ignored++;
-      pthread_mutex_unlock(&stats_lock);
-
-      goto capture_end;
-    }
+    string_view name_s(name);
 
     // If the fully qualified class name contains '/', it contains a
     // package prefix -- create here a subdirectory for it.
     size_t last_slash_pos = name_s.find_last_of('/');
-    if (last_slash_pos != string::npos) {
-      string package_name = name_s.substr(0, last_slash_pos);
-      string extracted_name = name_s.substr(last_slash_pos + 1, string::npos);
-      out_dir = out_base_dir + "/" + package_name;
-      cout << "Saving class " << name << " (package = " << package_name << ", name = " << extracted_name << ") under \"" << out_dir << "\"" << endl;
+    // The writer reports the class as it saves it: no per-class output
+    // here.
+    if (last_slash_pos != string_view::npos) {
+      string_view package_name = name_s.substr(0, last_slash_pos);
+      out_dir = hook_arena.concat({out_base_dir, "/", package_name});
     }
-    else {
+    else
       out_dir = out_base_dir;
-      cout << "Saving class " << name << " under \"" << out_dir << "\"" << endl;
-    }
 
-    record_class(env, name, loader, loader_hash, out_base_dir, out_dir, file_mode,
-                 class_data_len, class_data);
+    record_class(env, name_s, loader, loader_hash, out_base_dir, out_dir, file_mode,
+                 level, redefined, class_data_len, class_data);
     // printLoadedClasses(stdout);
   }
 
- capture_end:
-  if (SERIALIZE)
+  if (serialize)
     pthread_mutex_unlock(&serialize_lock);
-  else
+  if (profile_enabled && !redefined)
+    load_profile.hook_returned(monotonic_nanos());
+  hook_done(hook_time, hook_start);
+}
+
+/** Monotonic time when the agent was loaded. */
+static uint64_t agent_start_nanos;
+
+/* == Class inventory ==
+ *
+ * With inventory=on, every prepared class is added to class_inventory
+ * by the ClassPrepare event, and removed when it is unloaded. The
+ * changes are appended to out/inventory.log by the stats thread, the
+ * control channel and at unload; out/inventory-crosscheck.tsv lists
+ * the classes the hook missed.
+ */
+
+static FILE* inventory_log = NULL;
+static pthread_mutex_t inventory_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Adds a prepared class to the inventory. unmatched_outcome is its
+    outcome if the hook has not reported one. Returns false if the
+    class cannot be read or is already in the inventory. */
+bool inventory_add(JNIEnv *env, jclass klass, int unmatched_outcome) {
+  JvmtiBuffer<char> class_sig(jvmti);
+  if (jvmti->GetClassSignature(klass, class_sig.out(), NULL) != JVMTI_ERROR_NONE ||
+      class_sig.get() == NULL)
+    return false;
+  InventoryClass cls;
+  string_view sig(class_sig.get());
+  if (sig.size() >= 2 && sig[0] == 'L' && sig[sig.size() - 1] == ';')
+    sig = sig.substr(1, sig.size() - 2);
+  cls.name = string(sig);
+  jint count;
+  JvmtiBuffer<jfieldID> fields(jvmti);
+  cls.fields = (jvmti->GetClassFields(klass, &count, fields.out()) == JVMTI_ERROR_NONE) ? count : -1;
+  JvmtiBuffer<jmethodID> methods(jvmti);
+  cls.methods = (jvmti->GetClassMethods(klass, &count, methods.out()) == JVMTI_ERROR_NONE) ? count : -1;
+  jobject loader = NULL;
+  if (jvmti->GetClassLoader(klass, &loader) != JVMTI_ERROR_NONE)
+    loader = NULL;
+  cls.loader_id = loader_id(env, loader);
+  if (loader != NULL)
+    env->DeleteLocalRef(loader);
+  cls.outcome = unmatched_outcome;
+  return class_inventory.prepared(class_tag(klass) & TAG_ID_MASK, std::move(cls), unmatched_outcome);
+}
+
+void JNICALL ClassPrepare(jvmtiEnv *jvmti_env, JNIEnv *env, jthread thread, jclass klass) {
+  if (profile_enabled)
+    load_profile.prepared(class_tag(klass) & TAG_ID_MASK, monotonic_nanos());
+  if (!inventory_enabled)
+    return;
+  int unmatched_outcome = CLASS_MISSED;
+  if (unnamed_hook_outcome != -1) {
+    unmatched_outcome = unnamed_hook_outcome;
+    unnamed_hook_outcome = -1;
+  }
+  inventory_add(env, klass, unmatched_outcome);
+}
+
+/** Adds the classes prepared before the inventory started (before
+    VMInit, or before the agent was attached), as preloaded. */
+void inventory_seed(JNIEnv *env) {
+  jint class_count;
+  JvmtiBuffer<jclass> classes(jvmti);
+  jvmtiError err = jvmti->GetLoadedClasses(&class_count, classes.out());
+  if (err != JVMTI_ERROR_NONE) {
+    cerr << "Could not list the loaded classes, error = " << err << endl;
     return;
+  }
+  int added = 0;
+  for (int i = 0; i < class_count; i++) {
+    jint status;
+    if (jvmti->GetClassStatus(classes[i], &status) == JVMTI_ERROR_NONE &&
+        (status & JVMTI_CLASS_STATUS_PREPARED) != 0 &&
+        (status & (JVMTI_CLASS_STATUS_ARRAY | JVMTI_CLASS_STATUS_PRIMITIVE)) == 0 &&
+        inventory_add(env, classes[i], CLASS_PRELOADED))
+      added++;
+    env->DeleteLocalRef(classes[i]);
+  }
+  cout << "Class inventory: " << added << " classes prepared before it started." << endl;
+}
+
+void JNICALL VMInit(jvmtiEnv *jvmti_env, JNIEnv *env, jthread thread) {
+  inventory_seed(env);
 }
 
-void write_loaders() {
+/** Appends the inventory changes since the last export to
+    out/inventory.log; with force, also a snapshot line when nothing
+    changed. Returns the number of changes written. */
+size_t export_inventory(bool force) {
+  if (!inventory_enabled)
+    return 0;
+  // Unloads are only collected from the freed tags.
+  evict_unloaded_methods();
+  size_t changes = 0;
+  pthread_mutex_lock(&inventory_log_lock);
+  if (inventory_log == NULL) {
+    make_dirs(TOP_OUT_DIR);
+    string log_name = TOP_OUT_DIR + "/inventory.log";
+    inventory_log = fopen(log_name.c_str(), "w");
+    if (inventory_log == NULL)
+      cerr << "Could not create " << log_name << ": " << strerror(errno) << endl;
+  }
+  if (inventory_log != NULL) {
+    changes = class_inventory.export_changes(inventory_log,
+                                             (monotonic_nanos() - agent_start_nanos) / 1000000,
+                                             force);
+    fflush(inventory_log);
+  }
+  pthread_mutex_unlock(&inventory_log_lock);
+  return changes;
+}
+
+/** Writes out/inventory-crosscheck.tsv. */
+void write_inventory_crosscheck() {
+  string crosscheck_name = TOP_OUT_DIR + "/inventory-crosscheck.tsv";
+  FILE* crosscheck = fopen(crosscheck_name.c_str(), "w");
+  if (crosscheck == NULL) {
+    cerr << "Could not create " << crosscheck_name << ": " << strerror(errno) << endl;
+    return;
+  }
+  class_inventory.write_crosscheck(crosscheck);
+  fclose(crosscheck);
+}
+
+void close_inventory() {
+  if (!inventory_enabled)
+    return;
+  export_inventory(true);
+  write_inventory_crosscheck();
+  pthread_mutex_lock(&inventory_log_lock);
+  if (inventory_log != NULL)
+    fclose(inventory_log);
+  inventory_log = NULL;
+  pthread_mutex_unlock(&inventory_log_lock);
+}
+
+/* == Load profile ==
+ *
+ * With profile=on, the hook, ClassLoad and ClassPrepare timestamp
+ * every class in load_profile. The report is written at unload and
+ * by the flush command: out/load-times.tsv (one row per class),
+ * out/load-profile.tsv (by package, loader and call site) and
+ * out/load-slowest.txt (the slowest loads with their stacks).
+ */
+
+void JNICALL ClassLoad(jvmtiEnv *jvmti_env, JNIEnv *env, jthread thread, jclass klass) {
+  uint64_t now = monotonic_nanos();
+  JvmtiBuffer<char> class_sig(jvmti);
+  if (jvmti->GetClassSignature(klass, class_sig.out(), NULL) != JVMTI_ERROR_NONE ||
+      class_sig.get() == NULL)
+    return;
+  string_view sig(class_sig.get());
+  if (sig.size() >= 2 && sig[0] == 'L' && sig[sig.size() - 1] == ';')
+    sig = sig.substr(1, sig.size() - 2);
+  jobject loader = NULL;
+  if (jvmti->GetClassLoader(klass, &loader) != JVMTI_ERROR_NONE)
+    loader = NULL;
+  int loader_hash = loader_id(env, loader);
+  if (loader != NULL)
+    env->DeleteLocalRef(loader);
+  load_profile.loaded(class_tag(klass) & TAG_ID_MASK, loader_hash, sig, now);
+}
+
+/** Class signatures of the loaders, by id. */
+map<int, string> loader_signatures() {
+  map<int, string> sigs;
+  pthread_rwlock_rdlock(&loaders_lock);
+  for (auto it = loaders.begin(); it != loaders.end(); ++it)
+    sigs[it->first] = it->second.loader_sig;
+  pthread_rwlock_unlock(&loaders_lock);
+  return sigs;
+}
+
+void write_load_profile() {
+  if (!profile_enabled)
+    return;
+  open_out_dir();
+  map<int, string> loader_sigs = loader_signatures();
+  ofstream times(TOP_OUT_DIR + "/load-times.tsv");
+  load_profile.write_times(times, agent_start_nanos, context_tree);
+  ofstream breakdown(TOP_OUT_DIR + "/load-profile.tsv");
+  load_profile.write_breakdown(breakdown, context_tree, loader_sigs);
+  ofstream slowest(TOP_OUT_DIR + "/load-slowest.txt");
+  load_profile.write_slowest(slowest, profile_top, context_tree, loader_sigs);
+  if (!times || !breakdown || !slowest)
+    cerr << "Could not write the load profile to " << TOP_OUT_DIR << endl;
+}
+
+static pthread_t stats_thread;
+/** Posted at unload to stop the stats thread. */
+static sem_t stats_stop;
+/** Serializes the writers of stats.json (the stats thread and the
+    control channel). */
+static pthread_mutex_t stats_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Writes the class counters and the phase histograms to
+    out/stats.json, through a temporary file so that readers never see
+    a partial file. */
+void write_stats_json(bool final) {
+  uint64_t counters[COUNTER_COUNT];
+  hook_stats.counters(counters);
+
+  open_out_dir();
+  pthread_mutex_lock(&stats_file_lock);
+  string stats_file = TOP_OUT_DIR + "/stats.json";
+  ofstream out(stats_file + ".tmp");
+  out << "{" << endl;
+  out << "  \"final\": " << (final ? "true" : "false") << "," << endl;
+  out << "  \"elapsed_ms\": " << (monotonic_nanos() - agent_start_nanos) / 1000000 << "," << endl;
+  out << "  \"capture\": " << (capture_enabled.load() ? "true" : "false") << "," << endl;
+  out << "  \"capture_level\": \"" << capture_level_name(governor.get_level()) << "\"," << endl;
+  out << "  \"classes\": {";
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    out << (i == 0 ? " " : ", ") << "\"" << class_counter_name(i) << "\": " << counters[i];
+  out << ", \"unchanged\": " << classes_unchanged.load() <<
+    ", \"redefined\": " << classes_redefined.load() <<
+    ", \"dropped\": " << records_dropped.load() <<
+    ", \"spilled\": " << records_spilled.load() << " }," << endl;
+  out << "  \"context_nodes\": " << context_tree.size() - 1 << "," << endl;
+  out << "  \"store\": { \"written\": " << objects_written.load() <<
+    ", \"shared\": " << objects_shared.load() <<
+    ", \"index_entries\": " << store_index.entries() <<
+    ", \"index_capacity\": " << store_index.capacity() << " }," << endl;
+  if (inventory_enabled) {
+    ClassInventory::Counters inventory = class_inventory.get_counters();
+    out << "  \"inventory\": { \"live\": " << inventory.live <<
+      ", \"prepared\": " << inventory.prepared << ", \"unloaded\": " << inventory.unloaded;
+    for (int i = 0; i < CLASS_OUTCOME_COUNT; i++)
+      out << ", \"" << class_outcome_name(i) << "\": " << inventory.outcomes[i];
+    out << ", \"not_prepared\": " << inventory.unprepared << " }," << endl;
+  }
+  out << "  \"phases\": ";
+  hook_stats.write_json(out);
+  out << endl << "}" << endl;
+  out.close();
+  if (!out || rename((stats_file + ".tmp").c_str(), stats_file.c_str()) != 0)
+    cerr << "Could not write " << stats_file << endl;
+  pthread_mutex_unlock(&stats_file_lock);
+}
+
+void* stats_loop(void* arg) {
+  while (true) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += stats_interval;
+    if (sem_timedwait(&stats_stop, &deadline) == 0)
+      return NULL;
+    write_stats_json(false);
+    export_inventory(false);
+  }
+}
+
+void start_stats_thread() {
+  sem_init(&stats_stop, 0, 0);
+  pthread_create(&stats_thread, NULL, stats_loop, NULL);
+}
+
+void stop_stats_thread() {
+  sem_post(&stats_stop);
+  pthread_join(stats_thread, NULL);
+}
+
+/** Writes out/loaders.json, and lists the loaders on the standard
+    output if report is set. */
+void write_loaders(bool report) {
   ofstream loaders_file;
   loaders_file.open(TOP_OUT_DIR + "/loaders.json", ios::out);
   loaders_file << "[ ";
-  cout << "Classloaders:" << endl;
-  for (auto it = loaders.begin(); it != loaders.end(); ++it) {
-    if (it != loaders.begin())
+  if (report)
+    cout << "Classloaders:" << endl;
+  // Sorted by id, i.e. in the order the loaders were seen.
+  pthread_rwlock_rdlock(&loaders_lock);
+  map<int, string> sorted_loaders;
+  for (auto it = loaders.begin(); it != loaders.end(); ++it)
+    sorted_loaders[it->first] = it->second.loader_sig;
+  pthread_rwlock_unlock(&loaders_lock);
+  for (auto it = sorted_loaders.begin(); it != sorted_loaders.end(); ++it) {
+    if (it != sorted_loaders.begin())
       loaders_file << "," << endl << "  ";
 
     int l_hash = it->first;
     string l_name = it->second;
-    cout << " * " << l_name << " (hashCode() = " << l_hash << ")" << endl;
+    if (report)
+      cout << " * " << l_name << " (id = " << l_hash << ")" << endl;
     loaders_file << "{ loaderName : '" << l_name << "', loaderHash : '" << l_hash << "' }";
   }
   loaders_file << endl << "]" << endl;
   loaders_file.close();
 }
 
-/*
+/* == Control channel ==
+ *
+ * With control=PATH, a thread of the agent serves commands on a UNIX
+ * socket, one per line, each answered with an "ok ..." or "error ..."
+ * line, e.g.: echo stop | socat - UNIX-CONNECT:PATH
+ *
+ *   start   enables the class load hook
+ *   stop    disables it, waits for the queued records and flushes
+ *   flush   flushes the manifests and the event log, and rewrites
+ *           stats.json, loaders.json, call-sites.tsv and the load
+ *           profile
+ *   rotate  also finalizes the JARs and the event log as segment N
+ *           (out/loaded-classes.N.jar, out/events.N.bin, ...); the
+ *           next classes go to new files
+ *   stats   rewrites stats.json and loaders.json
+ *   status  reports the capture state and counters
+ *   inventory  appends a snapshot to out/inventory.log and rewrites
+ *           out/inventory-crosscheck.tsv
+ */
+
+static pthread_t control_thread;
+static int control_fd = -1;
+static atomic<bool> control_stopping(false);
+/** Written to at unload, to wake up the control thread wherever it
+    waits (for a client, or for a command of an idle client). */
+static int control_stop_pipe[2] = { -1, -1 };
+static JavaVM* java_vm = NULL;
+/** Number of the last rotated segment. */
+static int output_segment = 0;
+
+/** Waits until the writer threads have persisted the queued records. */
+void wait_for_writers() {
+  while (records_in_flight.load() > 0)
+    usleep(1000);
+}
+
+void flush_outputs() {
+  pthread_mutex_lock(&class_index_lock);
+  if (class_manifest != NULL)
+    fflush(class_manifest);
+  if (class_delta != NULL)
+    fflush(class_delta);
+  pthread_mutex_unlock(&class_index_lock);
+  pthread_mutex_lock(&redefinitions_lock);
+  if (redefinitions_index != NULL)
+    fflush(redefinitions_index);
+  pthread_mutex_unlock(&redefinitions_lock);
+  pthread_mutex_lock(&event_log_lock);
+  if (event_log.is_open() && !event_log.flush())
+    cerr << "Error writing " << TOP_OUT_DIR << "/events.bin" << endl;
+  pthread_mutex_unlock(&event_log_lock);
+  write_stats_json(false);
+  write_loaders(false);
+  write_call_sites();
+  export_inventory(false);
+  write_load_profile();
+}
+
+/** Turns the class load hook on or off. The JVM only accepts the
+    change from an attached thread in the live phase. */
+string set_capture(bool on) {
+  jvmtiPhase phase;
+  if (jvmti->GetPhase(&phase) != JVMTI_ERROR_NONE || phase != JVMTI_PHASE_LIVE)
+    return "error VM not started";
+  JNIEnv* env;
+  JavaVMAttachArgs args = { JNI_VERSION_1_6, (char*)"BytecodeCapture control", NULL };
+  if (java_vm->AttachCurrentThreadAsDaemon((void**)&env, &args) != JNI_OK)
+    return "error cannot attach to the VM";
+  if (on)
+    capture_enabled.store(true);
+  jvmtiError err = jvmti->SetEventNotificationMode(on ? JVMTI_ENABLE : JVMTI_DISABLE,
+                                                   JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
+  if (!on)
+    capture_enabled.store(false);
+  java_vm->DetachCurrentThread();
+  if (err != JVMTI_ERROR_NONE)
+    return "error SetEventNotificationMode failed, error = " + to_string(err);
+  if (!on) {
+    wait_for_writers();
+    flush_outputs();
+  }
+  cerr << "Capture " << (on ? "started" : "stopped") << " (control channel)." << endl;
+  return on ? "ok capture on" : "ok capture off";
+}
+
+string control_command(const string& command) {
+  if (command == "start")
+    return set_capture(true);
+  else if (command == "stop")
+    return set_capture(false);
+  else if (command == "flush") {
+    flush_outputs();
+    return "ok flushed";
+  } else if (command == "rotate") {
+    int segment = ++output_segment;
+    close_archives(segment);
+    close_event_log(segment);
+    flush_outputs();
+    return "ok segment " + to_string(segment);
+  } else if (command == "stats") {
+    write_stats_json(false);
+    write_loaders(false);
+    return "ok " + TOP_OUT_DIR + "/stats.json " + TOP_OUT_DIR + "/loaders.json";
+  } else if (command == "status") {
+    return string("ok capture ") + (capture_enabled.load() ? "on" : "off") +
+      " level " + capture_level_name(governor.get_level()) +
+      " defined " + to_string(hook_stats.counter(COUNT_DEFINED)) +
+      " ignored " + to_string(hook_stats.counter(COUNT_IGNORED)) +
+      " sampled_out " + to_string(hook_stats.counter(COUNT_SAMPLED_OUT)) +
+      " pending " + to_string(queue_pending.load()) + " segment " + to_string(output_segment);
+  } else if (command == "inventory") {
+    if (!inventory_enabled)
+      return "error inventory is off";
+    size_t changes = export_inventory(true);
+    write_inventory_crosscheck();
+    ClassInventory::Counters inventory = class_inventory.get_counters();
+    return "ok snapshot " + to_string(inventory.snapshots) + " changes " + to_string(changes) +
+      " live " + to_string(inventory.live) +
+      " missed " + to_string(inventory.outcomes[CLASS_MISSED]) +
+      " not_prepared " + to_string(inventory.unprepared);
+  }
+  return "error unknown command: " + command +
+    " (start, stop, flush, rotate, stats, status, inventory)";
+}
+
+/** Waits until fd is readable. Returns false if the control thread
+    is being stopped. */
+bool wait_control_input(int fd) {
+  struct pollfd fds[2] = { { fd, POLLIN, 0 }, { control_stop_pipe[0], POLLIN, 0 } };
+  while (!control_stopping.load()) {
+    int rc = poll(fds, 2, -1);
+    if (rc < 0 && errno != EINTR)
+      return false;
+    if (rc > 0)
+      return (fds[1].revents == 0);
+  }
+  return false;
+}
+
+/** Only the user of the JVM (and root) may send commands. */
+bool control_client_allowed(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return false;
+  return cred.uid == geteuid() || cred.uid == 0;
+}
+
+/** Serves the commands of one connection, one per line. */
+void serve_control_client(int fd) {
+  string pending;
+  char buf[256];
+  ssize_t n;
+  while (wait_control_input(fd) && (n = read(fd, buf, sizeof(buf))) > 0) {
+    pending.append(buf, n);
+    size_t eol;
+    while ((eol = pending.find('\n')) != string::npos) {
+      string command = pending.substr(0, eol);
+      pending.erase(0, eol + 1);
+      if (!command.empty() && command[command.size() - 1] == '\r')
+        command.erase(command.size() - 1);
+      if (command.empty())
+        continue;
+      string reply = control_command(command) + "\n";
+      if (write(fd, reply.data(), reply.size()) != (ssize_t)reply.size())
+        return;
+    }
+  }
+}
+
+void* control_loop(void* arg) {
+  while (wait_control_input(control_fd)) {
+    int client = accept(control_fd, NULL, NULL);
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    if (control_client_allowed(client))
+      serve_control_client(client);
+    else
+      cerr << "Control channel: connection from another user refused." << endl;
+    close(client);
+  }
+  return NULL;
+}
+
+bool start_control_thread() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (control_path.size() >= sizeof(addr.sun_path)) {
+    cerr << "Control socket path too long: " << control_path << endl;
+    return false;
+  }
+  strcpy(addr.sun_path, control_path.c_str());
+  // Only a stale socket (of an earlier run) is replaced.
+  struct stat st;
+  if (lstat(control_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(control_path.c_str());
+  control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // The socket is created accessible to the user only.
+  mode_t old_umask = umask(0077);
+  bool listening = control_fd != -1 &&
+    bind(control_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(control_fd, 4) == 0;
+  umask(old_umask);
+  if (!listening || pipe(control_stop_pipe) != 0) {
+    cerr << "Could not listen on " << control_path << ": " << strerror(errno) << endl;
+    if (control_fd != -1)
+      close(control_fd);
+    control_fd = -1;
+    return false;
+  }
+  cerr << "Control channel on " << control_path << endl;
+  pthread_create(&control_thread, NULL, control_loop, NULL);
+  return true;
+}
+
+void stop_control_thread() {
+  if (control_fd == -1)
+    return;
+  control_stopping.store(true);
+  // Wakes up the poll() of the control thread.
+  if (write(control_stop_pipe[1], "x", 1) != 1)
+    shutdown(control_fd, SHUT_RDWR);
+  pthread_join(control_thread, NULL);
+  close(control_fd);
+  control_fd = -1;
+  close(control_stop_pipe[0]);
+  close(control_stop_pipe[1]);
+  unlink(control_path.c_str());
+}
+
+/** Adds the ':'-separated patterns of an include/exclude option. */
+void add_filter_patterns(ClassFilter* filter, const string& patterns, bool include) {
+  size_t start = 0;
+  while (start <= patterns.size()) {
+    size_t end = patterns.find(':', start);
+    if (end == string::npos)
+      end = patterns.size();
+    if (end > start)
+      filter->add(patterns.substr(start, end - start), include);
+    start = end + 1;
+  }
+}
+
+/** Compiles the class filter: the built-in excludes first, so that
+    the patterns given in the options override them. */
+void init_class_filter(const vector<pair<string, bool> >& patterns) {
+  if (default_excludes) {
+    const char* builtin[] = { "java/", "javax/", "com/sun", "sun/", "jdk/" };
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+      class_filter.add(builtin[i], false);
+  }
+  for (size_t i = 0; i < patterns.size(); i++)
+    add_filter_patterns(&class_filter, patterns[i].first, patterns[i].second);
+}
+
+/** Parses the agent options, a comma-separated list of key=value
+    pairs, e.g. -agentpath:./libBytecodeCapture.so=writers=2,on_full=drop */
 static jint init_options(char *options) {
-  char* class_name;
-  char* from;
-  char* to;
-
-  fprintf(stderr, "Agent library loaded with options = %s\n", options);
-  if ((class_name = options) != NULL &&
-      (from = strchr(class_name, ',')) != NULL && (from[1] != 0)) {
-    *from = 0;
-    from++;
-    if ((to = strchr(from, ',')) != NULL && (to[1] != 0)) {
-      *to = 0;
-      to++;
-      if (strchr(to, ',') == NULL &&
-          strlen(to) == strlen(from) &&
-          strlen(class_name) > 0 &&
-          strlen(to) > 0) {
-        CLASS_NAME = class_name;
-        FROM = from;
-        TO = to;
-        fprintf(stderr, "CLASS_NAME = %s, FROM = %s, TO = %s\n",
-                CLASS_NAME, FROM, TO);
-        return JNI_OK;
-      }
+  if (options == NULL || *options == 0) {
+    init_class_filter(vector<pair<string, bool> >());
+    return JNI_OK;
+  }
+
+  cerr << "Agent library loaded with options = " << options << endl;
+  vector<pair<string, bool> > class_patterns;
+  unsigned long budget_ms = 0;
+  double budget_percent = 0;
+  string opts(options);
+  size_t start = 0;
+  while (start <= opts.size()) {
+    size_t end = opts.find(',', start);
+    if (end == string::npos)
+      end = opts.size();
+    string opt = opts.substr(start, end - start);
+    start = end + 1;
+    if (opt.empty())
+      continue;
+
+    size_t eq = opt.find('=');
+    string key = opt.substr(0, eq);
+    string value = (eq == string::npos) ? "" : opt.substr(eq + 1);
+    if (key == "writers" && !value.empty())
+      writer_count = atoi(value.c_str());
+    else if (key == "queue" && !value.empty())
+      queue_capacity = strtoul(value.c_str(), NULL, 10);
+    else if (key == "on_full" && value == "block")
+      queue_full_policy = FULL_BLOCK;
+    else if (key == "on_full" && value == "drop")
+      queue_full_policy = FULL_DROP;
+    else if (key == "on_full" && value == "spill")
+      queue_full_policy = FULL_SPILL;
+    else if (key == "output" && value == "dirs")
+      output_mode = OUT_DIRS;
+    else if (key == "output" && value == "jar")
+      output_mode = OUT_JAR;
+    else if (key == "output" && value == "loader-jars")
+      output_mode = OUT_LOADER_JARS;
+    else if (key == "compress" && value == "store")
+      jar_compression = ZIP_STORED;
+    else if (key == "compress" && value == "deflate")
+      jar_compression = ZIP_DEFLATED;
+    else if (key == "manifest" && !value.empty())
+      jar_manifest = value;
+    else if (key == "context" && value == "events")
+      context_mode = CONTEXT_EVENTS;
+    else if (key == "context" && value == "info")
+      context_mode = CONTEXT_INFO;
+    else if (key == "stack_depth" && !value.empty())
+      stack_depth = atoi(value.c_str());
+    else if (key == "stack" && value == "full")
+      stack_mode = STACK_FULL;
+    else if (key == "stack" && value == "classify")
+      stack_mode = STACK_CLASSIFY;
+    else if (key == "budget" && !value.empty() && value[value.size() - 1] == '%')
+      budget_percent = atof(value.c_str());
+    else if (key == "budget" && !value.empty())
+      budget_ms = strtoul(value.c_str(), NULL, 10);
+    else if (key == "stats_interval" && !value.empty())
+      stats_interval = atoi(value.c_str());
+    else if (key == "sample" && !value.empty())
+      governor.set_sample_every(strtoul(value.c_str(), NULL, 10));
+    else if ((key == "include" || key == "exclude") && !value.empty())
+      class_patterns.push_back(make_pair(value, key == "include"));
+    else if (key == "include_loader" && !value.empty())
+      add_filter_patterns(&loader_filter, value, true);
+    else if (key == "exclude_loader" && !value.empty())
+      add_filter_patterns(&loader_filter, value, false);
+    else if (key == "default_excludes" && (value == "0" || value == "1"))
+      default_excludes = (value == "1");
+    else if (key == "base" && !value.empty())
+      base_dir = value;
+    else if (key == "out" && !value.empty())
+      TOP_OUT_DIR = expand_pid(value);
+    else if (key == "store" && !value.empty())
+      STORE_DIR = expand_pid(value);
+    else if (key == "store_index" && !value.empty())
+      store_index_slots = strtoul(value.c_str(), NULL, 10);
+    else if (key == "control" && !value.empty())
+      control_path = value;
+    else if (key == "capture" && (value == "on" || value == "off"))
+      capture_enabled.store(value == "on");
+    else if (key == "inventory" && (value == "on" || value == "off"))
+      inventory_enabled = (value == "on");
+    else if (key == "profile" && (value == "on" || value == "off"))
+      profile_enabled = (value == "on");
+    else if (key == "profile_top" && !value.empty())
+      profile_top = strtoul(value.c_str(), NULL, 10);
+    else if (key == "retransform" && (value == "on" || value == "off"))
+      retransform_enabled = (value == "on");
+    else {
+      cerr << "Incorrect option: " << opt << endl <<
+        "Supported options (comma-separated):" << endl <<
+        "  writers=N                  background writer threads (0 = write in the hook)" << endl <<
+        "  queue=N                    capacity of the capture queue" << endl <<
+        "  on_full=block|drop|spill   what to do when the capture queue is full" << endl <<
+        "  output=dirs|jar|loader-jars  write class files, one JAR, or one JAR per loader" << endl <<
+        "  compress=store|deflate     compression of JAR entries" << endl <<
+        "  manifest=PATH              MANIFEST.MF to embed in the JARs" << endl <<
+        "  context=events|info        save contexts in out/events.bin or in .info files" << endl <<
+        "  stack_depth=N              frames of the loading stack to read (0 = none)" << endl <<
+        "  stack=full|classify        read the whole stack, or only the top frame" << endl <<
+        "                             unless the class is not loaded by defineClass" << endl <<
+        "  budget=MS|P%               hook time (all threads) allowed per second, or share" << endl <<
+        "                             of the time of the threads running the hook;" << endl <<
+        "                             over it, less context is captured" << endl <<
+        "  sample=N                   capture 1 in N classes at the last budget level" << endl <<
+        "  stats_interval=SECONDS     refresh out/stats.json during the run" << endl <<
+        "  include=P1:P2...           capture only classes matching these patterns" << endl <<
+        "  exclude=P1:P2...           do not capture classes matching these patterns" << endl <<
+        "  include_loader=P1:P2...    capture only classes of these loader classes" << endl <<
+        "  exclude_loader=P1:P2...    do not capture classes of these loader classes" << endl <<
+        "  default_excludes=0|1       exclude the JDK classes (java/, javax/, ...)" << endl <<
+        "  base=DIR                   skip the classes captured unchanged in DIR" << endl <<
+        "  out=DIR                    output directory (default out; %p = pid)" << endl <<
+        "  store=DIR                  class store, may be shared by several JVMs" << endl <<
+        "                             (default DIR/objects of the output directory)" << endl <<
+        "  store_index=N              slots of the shared index of a new store" << endl <<
+        "  control=PATH               serve start/stop/flush/rotate/stats/status/" << endl <<
+        "                             inventory commands on this UNIX socket" << endl <<
+        "  capture=on|off             whether capture starts on (default) or waits" << endl <<
+        "                             for a start command" << endl <<
+        "  inventory=on|off           keep an inventory of the prepared classes" << endl <<
+        "                             in out/inventory.log" << endl <<
+        "  profile=on|off             profile the define and link times of the classes" << endl <<
+        "                             in out/load-profile.tsv and out/load-times.tsv" << endl <<
+        "  profile_top=N              slowest loads in out/load-slowest.txt" << endl <<
+        "  retransform=on|off         also capture the classes retransformed by other" << endl <<
+        "                             agents (the JVM then keeps every class's bytes)" << endl;
+      return JNI_ERR;
     }
   }
-  fprintf(stderr,
-          "Incorrect options. You need to start the JVM with -agentlib:ClassFileLoadHook=<classname>,<from>,<to>\n"
-          "where <classname> is the class you want to hook, <from> is the string in the classfile to be replaced\n"
-          "with <to>.  <from> and <to> must have the same length. Example:\n"
-          "    @run main/native -agentlib:ClassFileLoadHook=Foo,XXX,YYY ClassFileLoadHookTest\n");
-  return JNI_ERR;
+  if (writer_count < 0 || queue_capacity == 0 || stack_depth < 0) {
+    cerr << "Incorrect options: writers and stack_depth must be >= 0 and queue > 0." << endl;
+    return JNI_ERR;
+  }
+  if (!base_dir.empty() && !load_base(base_dir))
+    return JNI_ERR;
+  init_class_filter(class_patterns);
+  governor.set_budget(budget_ms, budget_percent / 100);
+  return JNI_OK;
 }
-*/
 
 static jint Agent_Initialize(JavaVM *jvm, char *options, void *reserved) {
   int rc;
@@ -601,18 +2717,30 @@ static jint Agent_Initialize(JavaVM *jvm, char *options, void *reserved) {
     cerr << "Unable to create jvmtiEnv, GetEnv failed, error = " << rc << endl;
     return JNI_ERR;
   }
-  /* if ((rc = init_options(options)) != JNI_OK) { */
-  /*   return JNI_ERR; */
-  /* } */
+  if ((rc = init_options(options)) != JNI_OK) {
+    return JNI_ERR;
+  }
+  claim_out_dir();
 
   (void) memset(&callbacks, 0, sizeof(callbacks));
   callbacks.ClassFileLoadHook = &ClassFileLoadHook;
+  callbacks.ObjectFree = &ObjectFree;
+  if (inventory_enabled) {
+    callbacks.ClassPrepare = &ClassPrepare;
+    callbacks.VMInit = &VMInit;
+  }
+  if (profile_enabled) {
+    callbacks.ClassLoad = &ClassLoad;
+    callbacks.ClassPrepare = &ClassPrepare;
+  }
   if ((rc = jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks))) != JNI_OK) {
     cerr << "SetEventCallbacks failed, error = " << rc << endl;
     return JNI_ERR;
   }
 
-  if ((rc = jvmti->SetEventNotificationMode(JVMTI_ENABLE,
+  java_vm = jvm;
+  if (capture_enabled.load() &&
+      (rc = jvmti->SetEventNotificationMode(JVMTI_ENABLE,
                                             JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL)) != JNI_OK) {
     cerr << "SetEventNotificationMode failed, error = " << rc << endl;
     return JNI_ERR;
@@ -622,21 +2750,57 @@ static jint Agent_Initialize(JavaVM *jvm, char *options, void *reserved) {
   caps.can_get_bytecodes = 1;
   caps.can_get_line_numbers = 1;
   caps.can_get_constant_pool = 1;
+  caps.can_tag_objects = 1;
+  caps.can_generate_object_free_events = 1;
 
   jvmtiError caps_err = jvmti->AddCapabilities(&caps);
   if (caps_err == JVMTI_ERROR_NONE) {
+    // Unloaded classes are seen as frees of their tagged objects.
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, NULL);
   }
   else
     cout << "Capabilities could not be set, some functionality may be missing." << endl;
+  // Also see the classes retransformed by other agents. Optional, so
+  // requested on its own, and only on demand: it costs a copy of the
+  // bytes of every loaded class.
+  if (retransform_enabled) {
+    jvmtiCapabilities retransform_caps;
+    (void)memset(&retransform_caps, 0, sizeof(retransform_caps));
+    retransform_caps.can_retransform_classes = 1;
+    if (jvmti->AddCapabilities(&retransform_caps) != JVMTI_ERROR_NONE)
+      cout << "Retransformed classes will not be captured." << endl;
+  }
 
-  for (int i = 0; i < 256; i++)
-    bytecodes[i] = 0;
-  defined_sum = 0;
-  defined_by_unknown = 0;
-  defined_by_defineClass = 0;
-  defined_by_defineAnonymousClass = 0;
-  defined_but_ignored = 0;
-  defined_missing = 0;
+  init_method_cache();
+
+  agent_start_nanos = monotonic_nanos();
+
+  if (writer_count > 0) {
+    cout << "Starting " << writer_count << " writer thread(s)..." << endl;
+    start_writers();
+  }
+  if (stats_interval > 0)
+    start_stats_thread();
+  if (!control_path.empty() && !start_control_thread())
+    return JNI_ERR;
+  if (inventory_enabled) {
+    jvmtiPhase phase;
+    JNIEnv* env;
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
+    // Attached to a running VM, the classes prepared so far are read
+    // now; otherwise at VMInit.
+    if (jvmti->GetPhase(&phase) == JVMTI_ERROR_NONE && phase == JVMTI_PHASE_LIVE &&
+        jvm->GetEnv((void**)&env, JNI_VERSION_1_6) == JNI_OK)
+      inventory_seed(env);
+    else
+      jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
+  }
+  if (profile_enabled) {
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_LOAD, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
+  }
+  if (!capture_enabled.load())
+    cout << "Capture is off until a start command." << endl;
 
   return JNI_OK;
 }
@@ -654,15 +2818,35 @@ JNIEXPORT jint JNICALL Agent_OnAttach(JavaVM *jvm, char *options, void *reserved
 JNIEXPORT void JNICALL Agent_OnUnload(JavaVM *vm) {
   cerr << "Agent terminates." << endl;
 
-  cerr << "Classes defined: " << defined_sum << endl;
-  cerr << "Classes defined (ignored): " << defined_but_ignored << endl;
-  cerr << "Classes defined by unknown code (stack trace error or empty): " << defined_by_unknown << endl;
-  cerr << "Classes defined by defineClass(): " << defined_by_defineClass << endl;
-  cerr << "Classes defined by defineAnonymousClass(): " << defined_by_defineAnonymousClass << endl;
-
-  cerr << "Classes in other methods: " << defined_missing << endl;
+  stop_control_thread();
+  if (stats_interval > 0)
+    stop_stats_thread();
+  drain_writers();
+  close_archives();
+  close_redefinitions_index();
+  close_class_manifest();
+  close_event_log();
+  close_inventory();
+  write_load_profile();
+  write_stats_json(true);
+  write_call_sites();
+
+  uint64_t counters[COUNTER_COUNT];
+  hook_stats.counters(counters);
+  cerr << "Classes defined: " << counters[COUNT_DEFINED] << endl;
+  cerr << "Classes defined (ignored): " << counters[COUNT_IGNORED] << endl;
+  cerr << "Classes defined (sampled out): " << counters[COUNT_SAMPLED_OUT] << endl;
+  cerr << "Classes defined by unknown code (stack trace error or empty): " << counters[COUNT_BY_UNKNOWN] << endl;
+  cerr << "Classes defined by defineClass(): " << counters[COUNT_BY_DEFINE_CLASS] << endl;
+  cerr << "Classes defined by defineAnonymousClass(): " << counters[COUNT_BY_DEFINE_ANONYMOUS_CLASS] << endl;
+
+  if (stack_depth == 0)
+    cerr << "Classes not classified (stack_depth=0): " << counters[COUNT_UNCLASSIFIED] << endl;
+  cerr << "Classes in other methods: " << counters[COUNT_IN_OTHER_METHODS] << endl;
   cerr << "  Bytecode frequencies in call sites:" << endl;
-  int bytecodes_sum = 0;
+  uint64_t bytecodes[256];
+  hook_stats.opcode_counts(bytecodes);
+  uint64_t bytecodes_sum = 0;
   int count = 1;
   cerr << setprecision(3);
   for (int i = 0; i < 256; i++)
@@ -674,8 +2858,34 @@ JNIEXPORT void JNICALL Agent_OnUnload(JavaVM *vm) {
     }
   cerr << "  Bytecodes sum = " << bytecodes_sum << endl;
 
-  int uncounted = defined_sum - (defined_but_ignored + defined_by_unknown + defined_by_defineClass + defined_by_defineAnonymousClass + defined_missing);
+  // Every class is counted once, as ignored, sampled out or by its stack.
+  uint64_t counted = 0;
+  for (int i = COUNT_IGNORED; i < COUNTER_COUNT; i++)
+    counted += counters[i];
+  long uncounted = (long)(counters[COUNT_DEFINED] - counted);
   cerr << "Uncounted classes: " << uncounted << endl;
+  governor.report(cerr);
+  cerr << "Calling-context tree: " << context_tree.size() - 1 << " nodes." << endl;
+  if (inventory_enabled) {
+    ClassInventory::Counters inventory = class_inventory.get_counters();
+    cerr << "Class inventory: " << inventory.live << " live, " << inventory.prepared <<
+      " prepared, " << inventory.unloaded << " unloaded; " << inventory.outcomes[CLASS_MISSED] <<
+      " missed by the hook, " << inventory.unprepared << " seen by the hook but not prepared." << endl;
+  }
+  if (profile_enabled) {
+    LoadProfile::Counters profile = load_profile.get_counters();
+    cerr << "Load profile: " << profile.completed << " classes timed, " << profile.in_flight <<
+      " not prepared, " << profile.unmatched << " loaded without the hook, " <<
+      profile.abandoned << " failed definitions." << endl;
+  }
+  if (classes_redefined.load() > 0)
+    cerr << "Class redefinitions: " << classes_redefined.load() << endl;
+  if (!base_dir.empty())
+    cerr << "Classes unchanged since the base capture (not written): " << classes_unchanged.load() << endl;
+  if (writer_count > 0) {
+    cerr << "Classes dropped (capture queue full): " << records_dropped.load() << endl;
+    cerr << "Classes spilled (capture queue full): " << records_spilled.load() << endl;
+  }
 
-  write_loaders();
+  write_loaders(true);
 }
@@ -0,0 +1,90 @@
+#!/bin/bash
+
+# Merges the output of a capture run into a cumulative capture, for
+# incremental capturing: run the agent with base=BASE, so that it only
+# writes the classes that are new or changed since BASE, then fold
+# them into BASE.
+#
+# Usage: ./merge-captures.sh BASE RUN
+#
+#   BASE : cumulative capture directory (created if missing).
+#   RUN  : output directory of the run (e.g. out), in output=dirs mode.
+#
+# Loaders are matched by class signature, since loader ids change from
+# run to run: the n-th loader of a class in the run goes to the BASE
+# directory of the n-th loader of the same class, or to a new
+# directory, so that two loaders of one class never share a directory.
+# A class is skipped if a BASE loader of the same class already has
+# it with the same contents (as the agent skips it with base=). The class
+# file of a changed class is replaced by its new contents; the old
+# ones stay in BASE/objects and in BASE/classes.manifest as an earlier
+# version. Contexts (events.bin, .info files) are not merged.
+
+BASE=$1
+RUN=$2
+
+if [ \( "${BASE}" == "" \) -o \( "${RUN}" == "" \) ]
+then
+    echo Usage: ./merge-captures.sh BASE RUN
+    exit 1
+fi
+if [ ! -f ${RUN}/classes.manifest ]
+then
+    echo "No ${RUN}/classes.manifest, nothing to merge."
+    exit 0
+fi
+
+mkdir -p ${BASE}
+touch ${BASE}/classes.manifest
+
+# One "<base key> <version> <hash> <loader> <version in run>" line per
+# class version of the run missing in the base.
+awk '
+FILENAME == ARGV[1] {
+    split($1, k, "/")
+    if (!(k[1] in base_loader)) {
+        base_loader[k[1]] = 1
+        loader_of[$4, ++loaders[$4]] = k[1]
+    }
+    if (k[1] + 0 > max_id) max_id = k[1] + 0
+    versions[$1]++
+    in_base[$4 " " substr($1, length(k[1]) + 1) " " $3] = 1
+    seen[$1 " " $3] = 1
+    next
+}
+{
+    split($1, k, "/")
+    if (!(k[1] in run_loader)) {
+        n = ++run_loaders[$4]
+        run_loader[k[1]] = (n <= loaders[$4]) ? loader_of[$4, n] : ++max_id
+    }
+    name = substr($1, length(k[1]) + 1)
+    key = run_loader[k[1]] name
+    if (($4 " " name " " $3) in in_base || (key " " $3) in seen) next
+    seen[key " " $3] = 1
+    print key, ++versions[key], $3, $4, $2
+}' ${BASE}/classes.manifest ${RUN}/classes.manifest |
+while read KEY VERSION HASH LOADER RUN_VERSION
+do
+    OBJECT=objects/${HASH:0:2}/${HASH:2}.class
+    # Redefined versions may be stored as deltas.
+    STORED=${OBJECT}
+    if [ ! -f ${RUN}/${STORED} ]
+    then
+        STORED=${OBJECT%.class}.delta
+    fi
+    if [ ! -f ${BASE}/${STORED} ]
+    then
+        mkdir -p `dirname ${BASE}/${STORED}`
+        cp ${RUN}/${STORED} ${BASE}/${STORED} || exit 1
+    fi
+    # Only the first version of a run has a class file.
+    if [ "${RUN_VERSION}" == "1" ]
+    then
+        CLASS_FILE=${BASE}/${KEY}.class
+        mkdir -p `dirname ${CLASS_FILE}`
+        ln -f ${BASE}/${OBJECT} ${CLASS_FILE} 2> /dev/null || cp -f ${BASE}/${OBJECT} ${CLASS_FILE}
+    fi
+    echo "${KEY} ${VERSION} ${HASH} ${LOADER}" >> ${BASE}/classes.manifest
+    echo "${KEY}"
+done | wc -l | xargs echo Classes merged into ${BASE}: